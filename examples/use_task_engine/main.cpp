@@ -2,6 +2,11 @@
 
 #include "silver_bullets/task_engine/ParallelTaskScheduler.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <future>
 #include <iostream>
 
 using namespace std;
@@ -409,6 +414,1006 @@ void testParallelScheduler()
     reportTimeElapsed();
 }
 
+// Coalescing of tasks posted to TaskQueueExecutor.
+// A coalesced task posted to an idle executor runs; tasks posted while
+// one of the same type is waiting in the queue replace it, so that
+// of the three tasks posted while both workers are busy, only one runs.
+void test_05()
+{
+    TaskQueueFuncRegistry funcRegistry;
+    atomic<int> runCount = 0;
+    promise<void> release;
+    auto released = release.get_future().share();
+    funcRegistry[0] = [&runCount](boost::any&, const sync::CancelController::Checker&) {
+        ++runCount;
+    };
+    funcRegistry[1] = [released](boost::any&, const sync::CancelController::Checker&) {
+        released.wait();
+    };
+
+    TaskQueueCoalescingRegistry coalescingRegistry;
+    coalescingRegistry[0] = TaskQueueCoalescing::Replace;
+
+    sync::CancelController cc;
+    TaskQueueExecutor x(cc.checker(), 2);
+    x.setTaskFuncRegistry(&funcRegistry);
+    x.setCoalescingRegistry(&coalescingRegistry);
+
+    // Let the workers go idle
+    this_thread::sleep_for(chrono::milliseconds(100));
+    x.post(0);
+    auto remaining = x.wait(chrono::seconds(2));
+    cout << "idle executor: remaining " << remaining << ", ran " << runCount << endl;
+
+    x.post(1);
+    x.post(1);
+    for (auto i=0; i<3; ++i)
+        x.post(0);
+    release.set_value();
+    x.wait();
+    cout << "busy executor: ran " << runCount << endl;
+}
+
+// Map task squaring elements of a collection, and a task summing the squares up.
+// Chunks of the collection are processed by different executors; the chunk holding
+// element 7 fails at the first attempt, and only that chunk is retried.
+//
+//  +-----+     +-----+     +-----+
+//  | gen | --> | x*x | --> | sum | --> 285
+//  +-----+     +-----+     +-----+
+//               (map)
+void test_06()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto genId = 1;
+    auto squareId = 2;
+    auto sumId = 3;
+    atomic<int> attempts = 0;
+    auto square = makeSimpleMapTaskFunc([](int x) {
+        return x*x;
+    });
+    TFR taskFuncRegistry;
+    taskFuncRegistry[genId] = makeSimpleTaskFunc([](int n) {
+        TaskCollection result;
+        for (auto i=0; i<n; ++i)
+            result.push_back(i);
+        return result;
+    });
+    taskFuncRegistry[squareId] = [square, &attempts](const pany_range& out, const const_pany_range& in) {
+        for (auto& element : boost::any_cast<const TaskCollection&>(*in[0]))
+            if (boost::any_cast<int>(element) == 7 && attempts++ == 0)
+                // The chunk fails because its results are missing
+                return;
+        square(out, in);
+    };
+    taskFuncRegistry[sumId] = makeSimpleTaskFunc([](const TaskCollection& squares) {
+        auto result = 0;
+        for (auto& x : squares)
+            result += boost::any_cast<int>(x);
+        return result;
+    });
+
+    auto resType = 1;
+
+    TGX x;
+    x.setRetryPolicy({ 3, chrono::milliseconds(10) });
+    for (auto i=0; i<4; ++i)
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    TaskGraphBuilder b;
+    auto gen = b.addTask(1, 1, genId, resType);
+    auto sq = b.addTask(1, 1, squareId, resType);
+    auto sum = b.addTask(1, 1, sumId, resType);
+    b.setKind(sq, TaskKind::Map);
+    b.connect(gen, 0, sq, 0);
+    b.connect(sq, 0, sum, 0);
+
+    auto g = b.taskGraph();
+    g.input(gen, 0) = 10;
+
+    auto cache = x.makeCache();
+    x.start(&g, cache).wait();
+
+    cout << boost::any_cast<int>(g.output(sum, 0)) << ", element 7 processed " << attempts << " times" << endl;
+}
+
+// Reduce task concatenating letters computed by eight tasks, which finish in reverse order.
+// Adjacent values are combined as soon as both are available, but the result keeps
+// the order of reduce task inputs.
+//
+//  +---+ +---+       +---+
+//  | a | | b |  ...  | h |
+//  +---+ +---+       +---+
+//    |     |           |
+//  +---------------------+
+//  |        a+b+...      |  (reduce)
+//  +---------------------+
+//             |
+//          abcdefgh
+void test_07()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto letterId = 1;
+    auto concatId = 2;
+    atomic<int> combineCount = 0;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[letterId] = makeSimpleTaskFunc([](char letter, int delay) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+        return std::string(1, letter);
+    });
+    taskFuncRegistry[concatId] = makeSimpleTaskFunc([&combineCount](const std::string& a, const std::string& b) {
+        ++combineCount;
+        return a + b;
+    });
+
+    auto resType = 1;
+
+    TGX x;
+    for (auto i=0; i<8; ++i)
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    constexpr auto N = 8;
+    TaskGraphBuilder b;
+    auto concat = b.addTask(N, 1, concatId, resType);
+    b.setKind(concat, TaskKind::Reduce);
+    std::vector<size_t> letters;
+    for (auto i=0; i<N; ++i) {
+        letters.push_back(b.addTask(2, 1, letterId, resType));
+        b.connect(letters[i], 0, concat, i);
+    }
+
+    auto g = b.taskGraph();
+    for (auto i=0; i<N; ++i) {
+        g.input(letters[i], 0) = static_cast<char>('a' + i);
+        g.input(letters[i], 1) = 20*(N - i);
+    }
+
+    auto cache = x.makeCache();
+    x.start(&g, cache).wait();
+
+    cout << boost::any_cast<std::string>(g.output(concat, 0)) << ", " << combineCount << " combines" << endl;
+}
+
+// One step of the Collatz sequence with conditional execution. The switch task passes
+// an even number to its output 0 and an odd one to its output 1; the other output
+// is left empty, so the untaken branch is skipped. The merge task takes the value
+// of the branch that has run.
+//
+//          +--------+
+//          | switch |
+//          +--------+
+//          0|      |1
+//       +-----+  +-----+
+//       | x/2 |  | 3x  |
+//       +-----+  +-----+
+//          |        |
+//          |     +-----+
+//          |     | x+1 |
+//          |     +-----+
+//          |        |
+//          +--------+
+//          | merge  |
+//          +--------+
+//              |
+//       6 -> 3, 7 -> 22
+void test_08()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto switchId = 1;
+    auto halfId = 2;
+    auto tripleId = 3;
+    auto incId = 4;
+    auto mergeId = 5;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[switchId] = [](const pany_range& out, const const_pany_range& in) {
+        auto x = boost::any_cast<int>(*in[0]);
+        *out[x % 2] = x;
+    };
+    taskFuncRegistry[halfId] = makeSimpleTaskFunc([](int x) { return x / 2; });
+    taskFuncRegistry[tripleId] = makeSimpleTaskFunc([](int x) { return 3*x; });
+    taskFuncRegistry[incId] = makeSimpleTaskFunc([](int x) { return x + 1; });
+    taskFuncRegistry[mergeId] = [](const pany_range& out, const const_pany_range& in) {
+        *out[0] = in[0]->empty()? *in[1]: *in[0];
+    };
+
+    auto resType = 1;
+
+    TGX x;
+    for (auto i=0; i<2; ++i)
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    TaskGraphBuilder b;
+    auto sw = b.addTask(1, 2, switchId, resType);
+    auto half = b.addTask(1, 1, halfId, resType);
+    auto triple = b.addTask(1, 1, tripleId, resType);
+    auto inc = b.addTask(1, 1, incId, resType);
+    auto merge = b.addTask(2, 1, mergeId, resType);
+    b.setBranching(sw, TaskBranching::Switch);
+    b.setBranching(merge, TaskBranching::Merge);
+    b.connect(sw, 0, half, 0);
+    b.connect(sw, 1, triple, 0);
+    b.connect(triple, 0, inc, 0);
+    b.connect(half, 0, merge, 0);
+    b.connect(inc, 0, merge, 1);
+
+    auto g = b.taskGraph();
+    auto cache = x.makeCache();
+    for (auto value : { 6, 7 }) {
+        g.input(sw, 0) = value;
+        x.start(&g, cache).wait();
+        auto& status = TGX::taskStatus(cache);
+        auto skipped = std::count(status.begin(), status.end(), TaskStatus::Skipped);
+        cout << value << " -> " << boost::any_cast<int>(g.output(merge, 0))
+             << ", " << skipped << " tasks skipped" << endl;
+    }
+}
+
+// Computes the square root of 2 by Newton's method in a loop. The loop body is
+// the step task, whose output 0 is fed back to its input at the next iteration,
+// and the task checking convergence; the task after the loop receives the last value.
+//
+//         +------+
+//   1 --> | step | <-+ x
+//         +------+   |
+//          |  |  |   |
+//          |  |  +---+
+//          |  |dx
+//          |  +------+
+//          |  | dx<e |
+//          |  +------+
+//          |
+//       +------+
+//       | x*x  |
+//       +------+
+//          |
+//          2
+void test_09()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto stepId = 1;
+    auto convergedId = 2;
+    auto squareId = 3;
+    atomic<int> stepCount = 0;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[stepId] = [&stepCount](const pany_range& out, const const_pany_range& in) {
+        ++stepCount;
+        auto x = boost::any_cast<double>(*in[0]);
+        auto nextX = (x + 2/x) / 2;
+        *out[0] = nextX;
+        *out[1] = std::abs(nextX - x);
+    };
+    taskFuncRegistry[convergedId] = makeSimpleTaskFunc([](double dx) { return dx < 1e-12; });
+    taskFuncRegistry[squareId] = makeSimpleTaskFunc([](double x) { return x*x; });
+
+    auto resType = 1;
+
+    TGX x;
+    x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    TaskGraphBuilder b;
+    auto step = b.addTask(1, 2, stepId, resType);
+    auto converged = b.addTask(1, 1, convergedId, resType);
+    auto square = b.addTask(1, 1, squareId, resType);
+    b.connect(step, 1, converged, 0);
+    b.connect(step, 0, square, 0);
+    b.addLoop({ step, converged }, { { { step, 0 }, { step, 0 } } }, { converged, 0 }, 100);
+
+    auto g = b.taskGraph();
+    g.input(step, 0) = 1.0;
+
+    auto cache = x.makeCache();
+    x.start(&g, cache).wait();
+
+    cout << boost::any_cast<double>(g.output(square, 0)) << " after " << stepCount << " iterations" << endl;
+}
+
+// Computes squares of 0, ..., 5 by six independent tasks, each taking
+// 10 units of memory while it is running. The memory budget of 25 units
+// lets at most two tasks run at once, although there are six executors.
+void test_10()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto squareId = 1;
+    atomic<int> runningCount = 0;
+    atomic<int> maxRunningCount = 0;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[squareId] = makeSimpleTaskFunc([&](int x) {
+        auto running = ++runningCount;
+        for (auto m=maxRunningCount.load(); m<running && !maxRunningCount.compare_exchange_weak(m, running);) {}
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        --runningCount;
+        return x*x;
+    });
+
+    auto resType = 1;
+
+    TGX x;
+    for (auto i=0; i<6; ++i)
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+    x.setMemoryBudget(25);
+
+    TaskGraphBuilder b;
+    vector<size_t> tasks;
+    for (auto i=0; i<6; ++i) {
+        tasks.push_back(b.addTask(1, 1, squareId, resType));
+        b.setMemoryFootprint(tasks.back(), 0, 10);
+    }
+
+    auto g = b.taskGraph();
+    for (auto i=0; i<6; ++i)
+        g.input(tasks[i], 0) = i;
+
+    auto cache = x.makeCache();
+    x.start(&g, cache).wait();
+
+    for (auto task : tasks)
+        cout << boost::any_cast<int>(g.output(task, 0)) << " ";
+    cout << endl << "At most " << maxRunningCount << " tasks running at once" << endl;
+}
+
+// Computes squares of 0, ..., 5 by six independent tasks; tasks 0, 2, 4 also
+// hold one unit of a device resource, whose capacity is one. Tasks using the
+// device run one by one, while the other tasks run in parallel with them.
+void test_11()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto squareId = 1;
+    auto deviceSquareId = 2;
+    atomic<int> deviceUserCount = 0;
+    atomic<int> maxDeviceUserCount = 0;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[squareId] = makeSimpleTaskFunc([](int x) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return x*x;
+    });
+    taskFuncRegistry[deviceSquareId] = makeSimpleTaskFunc([&](int x) {
+        auto users = ++deviceUserCount;
+        for (auto m=maxDeviceUserCount.load(); m<users && !maxDeviceUserCount.compare_exchange_weak(m, users);) {}
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        --deviceUserCount;
+        return x*x;
+    });
+
+    auto resType = 1;
+    auto deviceResource = 2;
+
+    TGX x;
+    for (auto i=0; i<6; ++i)
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    TaskGraphBuilder b;
+    vector<size_t> tasks;
+    for (auto i=0; i<6; ++i) {
+        auto usesDevice = i % 2 == 0;
+        tasks.push_back(b.addTask(1, 1, usesDevice? deviceSquareId: squareId, resType));
+        if (usesDevice)
+            b.setResourceDemand(tasks.back(), deviceResource, 1);
+    }
+    b.setResourceCapacity(deviceResource, 1);
+
+    auto g = b.taskGraph();
+    for (auto i=0; i<6; ++i)
+        g.input(tasks[i], 0) = i;
+
+    auto cache = x.makeCache();
+    x.start(&g, cache).wait();
+
+    for (auto task : tasks)
+        cout << boost::any_cast<int>(g.output(task, 0)) << " ";
+    cout << endl << "At most " << maxDeviceUserCount << " tasks using the device at once" << endl;
+}
+
+// Computes a chain of four tasks, each adding 1 to its input, cancels the computation
+// while the second task is running, then resumes it. The second task completes anyway,
+// because simple task functions are not cancellable; completed tasks are not run again.
+//
+//   0 --> +1 --> +1 --> +1 --> +1 --> 4
+void test_12()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto incId = 1;
+    atomic<int> runCount = 0;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[incId] = makeSimpleTaskFunc([&runCount](int x) {
+        ++runCount;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return x + 1;
+    });
+
+    auto resType = 1;
+
+    TGX x;
+    x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    TaskGraphBuilder b;
+    vector<size_t> tasks;
+    for (auto i=0; i<4; ++i) {
+        tasks.push_back(b.addTask(1, 1, incId, resType));
+        if (i > 0)
+            b.connect(tasks[i-1], 0, tasks[i], 0);
+    }
+
+    auto g = b.taskGraph();
+    g.input(tasks[0], 0) = 0;
+
+    auto printStatus = [](const boost::any& cache) {
+        const char *statusNames[] = { "pending", "cancelled", "completed", "skipped" };
+        for (auto status : TGX::taskStatus(cache))
+            cout << statusNames[static_cast<int>(status)] << " ";
+        cout << endl;
+    };
+
+    // Tasks are started while the computation is being waited for
+    auto cache = x.makeCache();
+    x.start(&g, cache);
+    thread canceller([&x] {
+        this_thread::sleep_for(chrono::milliseconds(75));
+        x.cancel();
+    });
+    x.wait();
+    canceller.join();
+    cout << "Cancelled after running " << runCount << " tasks: ";
+    printStatus(cache);
+
+    runCount = 0;
+    x.resume(&g, cache).wait();
+    cout << "Resumed and ran " << runCount << " tasks: ";
+    printStatus(cache);
+    cout << boost::any_cast<int>(g.output(tasks.back(), 0)) << endl;
+}
+
+// Computes the chain of test_12, saving checkpoints to a file, and cancels the computation
+// while the second task is running. Another executor, e.g., of another process, then
+// restarts the computation from the checkpoint file, running only the remaining tasks.
+void test_13()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto incId = 1;
+    atomic<int> runCount = 0;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[incId] = makeSimpleTaskFunc([&runCount](int x) {
+        ++runCount;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return x + 1;
+    });
+
+    auto resType = 1;
+
+    TaskDataCodecRegistry codecs;
+    codecs.add<int>(1);
+    TaskGraphCheckpointParam checkpointParam;
+    checkpointParam.fileName = "use_task_engine_checkpoint.bin";
+    checkpointParam.interval = chrono::milliseconds(0);
+    checkpointParam.codecs = &codecs;
+
+    TaskGraphBuilder b;
+    vector<size_t> tasks;
+    for (auto i=0; i<4; ++i) {
+        tasks.push_back(b.addTask(1, 1, incId, resType));
+        if (i > 0)
+            b.connect(tasks[i-1], 0, tasks[i], 0);
+    }
+
+    {
+        TGX x;
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+        x.setCheckpointing(checkpointParam);
+
+        auto g = b.taskGraph();
+        g.input(tasks[0], 0) = 0;
+
+        auto cache = x.makeCache();
+        x.start(&g, cache);
+        thread canceller([&x] {
+            this_thread::sleep_for(chrono::milliseconds(75));
+            x.cancel();
+        });
+        x.wait();
+        canceller.join();
+        cout << "Cancelled after running " << runCount << " tasks" << endl;
+    }
+
+    TGX x;
+    x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+    x.setCheckpointing(checkpointParam);
+
+    auto g = b.taskGraph();
+    g.input(tasks[0], 0) = 0;
+
+    runCount = 0;
+    auto cache = x.makeCache();
+    x.restart(checkpointParam.fileName, &g, cache).wait();
+    cout << "Restarted and ran " << runCount << " tasks" << endl;
+    cout << boost::any_cast<int>(g.output(tasks.back(), 0)) << endl;
+    remove(checkpointParam.fileName.c_str());
+}
+
+// Runs six independent tasks, each sleeping for the duration given by its input,
+// on two executors, and records the order in which tasks are started. Then task
+// durations change, and the computation is replayed with the recorded schedule.
+void test_14()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto sleepId = 1;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[sleepId] = makeSimpleTaskFunc([](int ms) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+        return ms;
+    });
+
+    auto resType = 1;
+
+    TGX x;
+    for (auto i=0; i<2; ++i)
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    TaskGraphBuilder b;
+    vector<size_t> tasks;
+    for (auto i=0; i<6; ++i)
+        tasks.push_back(b.addTask(1, 1, sleepId, resType));
+
+    auto g = b.taskGraph();
+    auto printSchedule = [](const TaskExecutionLog& log) {
+        for (auto& record : log)
+            cout << record.taskId << "@" << record.executorIndex << " ";
+        cout << endl;
+    };
+
+    TaskExecutionLog log;
+    auto cache = x.makeCache();
+    x.setExecutionLog(&log);
+    for (auto i=0; i<6; ++i)
+        g.input(tasks[i], 0) = 10 + 10*i;
+    x.start(&g, cache).wait();
+    cout << "Recorded: ";
+    printSchedule(log);
+
+    TaskExecutionLog replayedLog;
+    x.setExecutionLog(&replayedLog).setReplay(&log);
+    for (auto i=0; i<6; ++i)
+        g.input(tasks[i], 0) = 60 - 10*i;
+    x.start(&g, cache).wait();
+    cout << "Replayed: ";
+    printSchedule(replayedLog);
+}
+
+// Tasks posted to TaskQueueExecutor with payloads; each task squares its payload,
+// and the result is obtained from the future returned by post(). The task
+// given a negative payload throws, and its future rethrows the exception.
+void test_15()
+{
+    TaskQueuePayloadFuncRegistry payloadFuncRegistry;
+    payloadFuncRegistry[0] = [](boost::any&, boost::any& payload, const sync::CancelController::Checker&) {
+        auto x = boost::any_cast<int>(payload);
+        if (x < 0)
+            throw runtime_error("negative payload");
+        return boost::any(x*x);
+    };
+
+    sync::CancelController cc;
+    TaskQueueExecutor x(cc.checker(), 2);
+    x.setPayloadTaskFuncRegistry(&payloadFuncRegistry);
+
+    vector<TaskQueueFuture> futures;
+    for (auto i=0; i<5; ++i)
+        futures.push_back(x.post(0, i));
+    auto failed = x.post(0, -1);
+
+    for (auto& future : futures)
+        cout << future.get<int>() << " ";
+    cout << endl;
+    try {
+        failed.get<int>();
+    }
+    catch(const exception& e) {
+        cout << "task failed: " << e.what() << endl;
+    }
+}
+
+// Priorities of tasks posted to TaskQueueExecutor. While the only worker is busy,
+// tasks of different priorities are posted; once it is released, urgent tasks
+// run first and background tasks last, each class in the order of posting.
+void test_16()
+{
+    TaskQueueFuncRegistry funcRegistry;
+    promise<void> release;
+    auto released = release.get_future().share();
+    vector<int> runOrder;
+    funcRegistry[0] = [released](boost::any&, const sync::CancelController::Checker&) {
+        released.wait();
+    };
+    for (auto taskType=1; taskType<=6; ++taskType)
+        funcRegistry[taskType] = [&runOrder, taskType](boost::any&, const sync::CancelController::Checker&) {
+            runOrder.push_back(taskType);
+        };
+
+    sync::CancelController cc;
+    TaskQueueExecutor x(cc.checker(), 1);
+    x.setTaskFuncRegistry(&funcRegistry);
+
+    x.post(0);
+    x.post(1, TaskQueuePriority::Background);
+    x.post(2, TaskQueuePriority::Normal);
+    x.post(3, TaskQueuePriority::Urgent);
+    x.post(4, TaskQueuePriority::Background);
+    x.post(5, TaskQueuePriority::Normal);
+    x.post(6, TaskQueuePriority::Urgent);
+    release.set_value();
+    x.wait();
+
+    for (auto taskType : runOrder)
+        cout << taskType << " ";
+    cout << endl;
+}
+
+// Tasks added to ParallelTaskScheduler with predecessors. Four tasks square 1, 2, 3, 4,
+// and the task summing the squares up starts once all of them have completed.
+// The task squaring 4 also spawns a task computing the cube of 4.
+void test_17()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using PTS = ParallelTaskScheduler<TaskFunc>;
+
+    auto squareId = 1;
+    auto sumId = 2;
+    auto cubeId = 3;
+    auto resType = 1;
+
+    vector<boost::any> values = { 1, 2, 3, 4 };
+    vector<boost::any> squares(4);
+    boost::any sum;
+    boost::any cube;
+    vector<const boost::any*> valuePtrs;
+    vector<boost::any*> squarePtrs;
+    vector<const boost::any*> constSquarePtrs;
+    for (auto i=0; i<4; ++i) {
+        valuePtrs.push_back(&values[i]);
+        squarePtrs.push_back(&squares[i]);
+        constSquarePtrs.push_back(&squares[i]);
+    }
+    boost::any *sumPtr = &sum;
+    boost::any *cubePtr = &cube;
+
+    TFR taskFuncRegistry;
+    PTS pts;
+    for (auto i=0; i<2; ++i)
+        pts.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    taskFuncRegistry[squareId] = makeSimpleTaskFunc([&](int x) {
+        if (x == 4)
+            pts.spawnTask({
+                {1, 1, cubeId, resType},
+                pany_range(&cubePtr, &cubePtr+1),
+                const_pany_range(valuePtrs.data()+3, valuePtrs.data()+4),
+                std::function<void()>()
+            });
+        return x*x;
+    });
+    taskFuncRegistry[sumId] = makeSimpleTaskFunc([](int a, int b, int c, int d) {
+        return a + b + c + d;
+    });
+    taskFuncRegistry[cubeId] = makeSimpleTaskFunc([](int x) {
+        return x*x*x;
+    });
+
+    vector<ParallelTaskHandle> squareTasks;
+    for (auto i=0; i<4; ++i)
+        squareTasks.push_back(pts.addTask({
+            {1, 1, squareId, resType},
+            pany_range(squarePtrs.data()+i, squarePtrs.data()+i+1),
+            const_pany_range(valuePtrs.data()+i, valuePtrs.data()+i+1),
+            std::function<void()>()
+        }));
+    pts.addTask({
+            {4, 1, sumId, resType},
+            pany_range(&sumPtr, &sumPtr+1),
+            const_pany_range(constSquarePtrs.data(), constSquarePtrs.data()+4),
+            std::function<void()>()
+        },
+        squareTasks);
+
+    pts.wait();
+    cout << "sum of squares " << boost::any_cast<int>(sum) << ", cube " << boost::any_cast<int>(cube) << endl;
+}
+
+// Tasks of two tenants added to ParallelTaskScheduler with one executor. Tenant 1 has
+// weight 3 and tenant 2 weight 1, so that tenant 1 gets three quarters of the executor
+// time while both have waiting tasks; the printed sequence shows which tenant each
+// started task belongs to.
+void test_18()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using PTS = ParallelTaskScheduler<TaskFunc>;
+
+    auto taskFuncId = 1;
+    vector<int> runOrder;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[taskFuncId] = makeSimpleTaskFunc([&runOrder](int tenant) {
+        runOrder.push_back(tenant);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    });
+
+    auto resType = 1;
+
+    PTS pts;
+    pts.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+    pts.setTenantSettings(1, { 3 });
+    pts.setTenantSettings(2, { 1 });
+
+    vector<boost::any> tenants = { 1, 2 };
+    vector<const boost::any*> tenantPtrs = { &tenants[0], &tenants[1] };
+    for (auto i=0; i<8; ++i)
+        for (auto tenant=1; tenant<=2; ++tenant)
+            pts.addTask({
+                    {1, 0, taskFuncId, resType},
+                    pany_range(),
+                    const_pany_range(tenantPtrs.data()+tenant-1, tenantPtrs.data()+tenant),
+                    std::function<void()>()
+                },
+                {},
+                tenant);
+
+    pts.wait();
+    for (auto tenant : runOrder)
+        cout << tenant << " ";
+    cout << endl;
+}
+
+// A graph with a cycle can't be built; the exception message lists tasks
+// making the cycle, and tasks that can't run because they depend on it.
+//
+//   +---+     +---+     +---+     +---+
+//   | 0 | --> | 1 | --> | 2 | --> | 3 |
+//   +---+     +---+     +---+     +---+
+//     ^                   |
+//     +-------------------+
+void test_19()
+{
+    auto funcId = 1;
+    auto resType = 1;
+
+    TaskGraphBuilder b;
+    vector<size_t> tasks;
+    for (auto i=0; i<4; ++i)
+        tasks.push_back(b.addTask(2, 1, funcId, resType));
+    b.connect(tasks[0], 0, tasks[1], 0);
+    b.connect(tasks[1], 0, tasks[2], 0);
+    b.connect(tasks[2], 0, tasks[0], 0);
+    b.connect(tasks[2], 0, tasks[3], 0);
+
+    try {
+        b.taskGraph();
+    }
+    catch(const exception& e) {
+        cout << e.what() << endl;
+    }
+}
+
+// Composite task computing the sum of squares of its two inputs, implemented by a graph
+// of three tasks; it is run next to a plain task adding 10 to its output. The graph
+// is expanded once, when the cache is built, and the second run reuses the expansion.
+//
+//    a   b                  a         b
+//    |   |                  |         |
+//  +-------+              +---+     +---+
+//  |a*a+b*b|  expands to  |x*x|     |x*x|
+//  +-------+              +---+     +---+
+//      |                      \     /
+//   +-----+                    +---+
+//   | +10 |                    | + |
+//   +-----+                    +---+
+void test_20()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto squareId = 1;
+    auto addId = 2;
+    auto sumOfSquaresId = 3;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[squareId] = makeSimpleTaskFunc([](int x) { return x*x; });
+    taskFuncRegistry[addId] = makeSimpleTaskFunc([](int a, int b) { return a + b; });
+
+    auto resType = 1;
+
+    CompositeTaskRegistry compositeTaskRegistry;
+    {
+        TaskGraphBuilder cb;
+        auto squareA = cb.addTask(1, 1, squareId, resType);
+        auto squareB = cb.addTask(1, 1, squareId, resType);
+        auto sum = cb.addTask(2, 1, addId, resType);
+        cb.connect(squareA, 0, sum, 0);
+        cb.connect(squareB, 0, sum, 1);
+        compositeTaskRegistry[sumOfSquaresId] = {
+            cb.taskGraph(),
+            { { { squareA, 0 } }, { { squareB, 0 } } },
+            { { sum, 0 } }
+        };
+    }
+
+    TGX x;
+    for (auto i=0; i<2; ++i)
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+    x.setCompositeTaskRegistry(&compositeTaskRegistry);
+
+    TaskGraphBuilder b;
+    auto sumOfSquares = b.addTask(2, 1, sumOfSquaresId, resType);
+    auto add10 = b.addTask(2, 1, addId, resType);
+    b.connect(sumOfSquares, 0, add10, 0);
+
+    auto g = b.taskGraph();
+    g.input(add10, 1) = 10;
+
+    auto cache = x.makeCache();
+    for (auto a : { 1, 2 }) {
+        g.input(sumOfSquares, 0) = a;
+        g.input(sumOfSquares, 1) = a + 2;
+        x.start(&g, cache).wait();
+        cout << a << "*" << a << " + " << a+2 << "*" << a+2 << " + 10 = "
+             << boost::any_cast<int>(g.output(add10, 0)) << endl;
+    }
+}
+
+// Saves the graph of test_01 to a file, along with the cache built by a run,
+// then loads both from the file and runs the loaded graph with new inputs;
+// the loaded cache is used as is, without building it again.
+void test_21()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto addId = 1;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[addId] = makeSimpleTaskFunc([](int a, int b) { return a + b; });
+
+    auto resType = 1;
+    string fileName = "use_task_engine_graph.sbtg";
+
+    TGX x;
+    x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+
+    size_t t1, t2;
+    {
+        TaskGraphBuilder b;
+        t1 = b.addTask(2, 1, addId, resType);
+        t2 = b.addTask(2, 1, addId, resType);
+        b.connect(t1, 0, t2, 1);
+
+        auto g = b.taskGraph();
+        g.input(t1, 0) = 1;
+        g.input(t1, 1) = 2;
+        g.input(t2, 0) = 4;
+
+        auto cache = x.makeCache();
+        x.start(&g, cache).wait();
+        cout << "Built graph: " << boost::any_cast<int>(g.output(t2, 0)) << endl;
+
+        TaskGraphFileWriter writer;
+        writer.addTaskGraph(g);
+        TGX::addCacheSections(writer, cache);
+        writer.write(fileName);
+    }
+
+    {
+        TaskGraphFile file(fileName);
+        auto g = file.taskGraph();
+        g.input(t1, 0) = 10;
+        g.input(t1, 1) = 20;
+        g.input(t2, 0) = 40;
+
+        auto cache = TGX::loadCache(file);
+        x.start(&g, cache).wait();
+        cout << "Loaded graph: " << boost::any_cast<int>(g.output(t2, 0)) << endl;
+    }
+    remove(fileName.c_str());
+}
+
+// Sums up 1, ..., 8 by a pyramid of tasks, each adding its two inputs, run level
+// by level: the tasks of a level start once all tasks of the level below complete.
+//
+//   1 2   3 4   5 6   7 8
+//   +-+   +-+   +-+   +-+      level 0
+//    |     |     |     |
+//    +-----+     +-----+       level 1
+//       |           |
+//       +-----------+          level 2
+//             |
+//             36
+void test_22()
+{
+    using TaskFunc = SimpleTaskFunc;
+    using TFR = TaskFuncRegistry<TaskFunc>;
+    using TTX = ThreadedTaskExecutor<TaskFunc>;
+    using TGX = TaskGraphExecutor<TaskFunc>;
+
+    auto addId = 1;
+    TFR taskFuncRegistry;
+    taskFuncRegistry[addId] = makeSimpleTaskFunc([](int a, int b) { return a + b; });
+
+    auto resType = 1;
+
+    TGX x;
+    for (auto i=0; i<4; ++i)
+        x.addTaskExecutor(std::make_shared<TTX>(resType, &taskFuncRegistry));
+    x.setLevelSynchronous(true);
+
+    TaskGraphBuilder b;
+    vector<size_t> level;
+    for (auto i=0; i<4; ++i)
+        level.push_back(b.addTask(2, 1, addId, resType));
+    auto leaves = level;
+    while (level.size() > 1) {
+        vector<size_t> nextLevel;
+        for (size_t i=0; i<level.size(); i+=2) {
+            auto task = b.addTask(2, 1, addId, resType);
+            b.connect(level[i], 0, task, 0);
+            b.connect(level[i+1], 0, task, 1);
+            nextLevel.push_back(task);
+        }
+        level.swap(nextLevel);
+    }
+
+    auto g = b.taskGraph();
+    for (auto i=0; i<4; ++i) {
+        g.input(leaves[i], 0) = 2*i + 1;
+        g.input(leaves[i], 1) = 2*i + 2;
+    }
+
+    auto cache = x.makeCache();
+    x.start(&g, cache).wait();
+
+    cout << boost::any_cast<int>(g.output(level.front(), 0)) << endl;
+    auto levelCount = TGX::levelCount(cache);
+    cout << levelCount << " levels:";
+    for (size_t l=0; l<levelCount; ++l)
+        cout << " " << TGX::levelTasks(cache, l).size();
+    cout << " tasks" << endl;
+}
+
 int main()
 {
     TaskQueueFuncRegistry funcRegistry;
@@ -462,5 +1467,77 @@ int main()
     testParallelScheduler();
     cout << "********** FINISHED test_04 **********" << endl << endl;
 
+    cout << "********** STARTING test_05 **********" << endl;
+    test_05();
+    cout << "********** FINISHED test_05 **********" << endl << endl;
+
+    cout << "********** STARTING test_06 **********" << endl;
+    test_06();
+    cout << "********** FINISHED test_06 **********" << endl << endl;
+
+    cout << "********** STARTING test_07 **********" << endl;
+    test_07();
+    cout << "********** FINISHED test_07 **********" << endl << endl;
+
+    cout << "********** STARTING test_08 **********" << endl;
+    test_08();
+    cout << "********** FINISHED test_08 **********" << endl << endl;
+
+    cout << "********** STARTING test_09 **********" << endl;
+    test_09();
+    cout << "********** FINISHED test_09 **********" << endl << endl;
+
+    cout << "********** STARTING test_10 **********" << endl;
+    test_10();
+    cout << "********** FINISHED test_10 **********" << endl << endl;
+
+    cout << "********** STARTING test_11 **********" << endl;
+    test_11();
+    cout << "********** FINISHED test_11 **********" << endl << endl;
+
+    cout << "********** STARTING test_12 **********" << endl;
+    test_12();
+    cout << "********** FINISHED test_12 **********" << endl << endl;
+
+    cout << "********** STARTING test_13 **********" << endl;
+    test_13();
+    cout << "********** FINISHED test_13 **********" << endl << endl;
+
+    cout << "********** STARTING test_14 **********" << endl;
+    test_14();
+    cout << "********** FINISHED test_14 **********" << endl << endl;
+
+    cout << "********** STARTING test_15 **********" << endl;
+    test_15();
+    cout << "********** FINISHED test_15 **********" << endl << endl;
+
+    cout << "********** STARTING test_16 **********" << endl;
+    test_16();
+    cout << "********** FINISHED test_16 **********" << endl << endl;
+
+    cout << "********** STARTING test_17 **********" << endl;
+    test_17();
+    cout << "********** FINISHED test_17 **********" << endl << endl;
+
+    cout << "********** STARTING test_18 **********" << endl;
+    test_18();
+    cout << "********** FINISHED test_18 **********" << endl << endl;
+
+    cout << "********** STARTING test_19 **********" << endl;
+    test_19();
+    cout << "********** FINISHED test_19 **********" << endl << endl;
+
+    cout << "********** STARTING test_20 **********" << endl;
+    test_20();
+    cout << "********** FINISHED test_20 **********" << endl << endl;
+
+    cout << "********** STARTING test_21 **********" << endl;
+    test_21();
+    cout << "********** FINISHED test_21 **********" << endl << endl;
+
+    cout << "********** STARTING test_22 **********" << endl;
+    test_22();
+    cout << "********** FINISHED test_22 **********" << endl << endl;
+
     return 0;
 }
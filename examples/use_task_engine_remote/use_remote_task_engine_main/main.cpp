@@ -29,7 +29,9 @@
 #include <grpcpp/create_channel.h>
 #include <grpcpp/security/credentials.h>
 
+#include "RemoteExecutorService.hpp"
 #include "RemoteTaskExecutor.hpp"
+#include "SharedMemoryRemoteTransport.hpp"
 
 #include "silver_bullets/task_engine.hpp"
 
@@ -124,7 +126,15 @@ void test_01()
 //         +-----+
 //            |
 //            15
-void test_04(const std::string& host, const sync::CancelController::Checker& isCancelled)
+// If loopback is true, workers are run in this process and are called
+// without network, which allows to measure the overhead of the remote pipeline.
+// If sharedMemory is true, task data are passed through shared memory
+// (workers must run on this host).
+void test_04(
+    const std::string& host,
+    bool loopback,
+    bool sharedMemory,
+    const sync::CancelController::Checker& isCancelled)
 {
     // TODO: use cancel
     using TaskFunc = StatefulCancellableTaskFunc;
@@ -176,11 +186,42 @@ void test_04(const std::string& host, const sync::CancelController::Checker& isC
 
     paramregistry[computeFuncId] = std::make_pair(t, f);
 
+    // In-process workers, used in the loopback mode
+    using Service = RemoteServiceImpl<TaskFunc>;
+    std::vector<std::unique_ptr<sync::CancelController>> serviceControllers;
+    std::vector<std::unique_ptr<Service>> services;
+
+    auto withSharedMemory = [sharedMemory](std::shared_ptr<RemoteTransport> transport)
+        -> std::shared_ptr<RemoteTransport> {
+        if (!sharedMemory)
+            return transport;
+        return std::make_shared<SharedMemoryRemoteTransport>(transport, 1 << 16);
+    };
+
     TGX x(isCancelled);
     auto resType = 1;
     auto port = 50051;
     for (auto i = 0; i < 2; ++i)
     {
+        if (loopback)
+        {
+            auto& cc = *serviceControllers.emplace_back(
+                std::make_unique<sync::CancelController>());
+            auto& service = *services.emplace_back(std::make_unique<Service>(
+                &taskFuncRegistry,
+                paramregistry,
+                &cc,
+                []() { return boost::any(1); },
+                cc.checker()));
+            x.addTaskExecutor(std::make_shared<TTX>(
+                withSharedMemory(
+                    std::make_shared<LoopbackRemoteTransport>(&service)),
+                paramregistry,
+                resType,
+                &isCancelled));
+            continue;
+        }
+
         auto channel = grpc::CreateChannel(
             host + ":" + std::to_string(port),
             grpc::InsecureChannelCredentials());
@@ -189,8 +230,11 @@ void test_04(const std::string& host, const sync::CancelController::Checker& isC
         channel->WaitForConnected(gpr_time_add(
                                       gpr_now(GPR_CLOCK_REALTIME),
                                       gpr_time_from_seconds(10, GPR_TIMESPAN)));
-        auto tx =
-            std::make_shared<TTX>(channel, paramregistry, resType, &isCancelled);
+        auto tx = std::make_shared<TTX>(
+            withSharedMemory(std::make_shared<GrpcRemoteTransport>(channel)),
+            paramregistry,
+            resType,
+            &isCancelled);
         x.addTaskExecutor(tx);
         port++;
     }
@@ -244,7 +288,9 @@ int main(int argc, char** argv)
     };
     std::string host;
     po_basic.add_options()
-            ("host", po_value(host), "Host name");
+            ("host", po_value(host), "Host name")
+            ("loopback", "Run workers in this process, without network")
+            ("shm", "Pass task data to workers through shared memory");
 
     po::variables_map vm;
     auto po_alloptions = po::options_description().add(po_generic).add(po_basic);
@@ -271,10 +317,12 @@ int main(int argc, char** argv)
     //                  << std::endl;
     //    };
 
-    funcRegistry[0] = [&host](boost::any&,
+    auto loopback = vm.count("loopback") > 0;
+    auto sharedMemory = vm.count("shm") > 0;
+    funcRegistry[0] = [&host, loopback, sharedMemory](boost::any&,
                          const sync::CancelController::Checker& isCancelled) {
         std::cout << "********** STARTING test_04 **********" << std::endl;
-        test_04(host, isCancelled);
+        test_04(host, loopback, sharedMemory, isCancelled);
         std::cout << "********** FINISHED test_04 **********" << std::endl
                   << std::endl;
     };
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+namespace silver_bullets {
+namespace sync {
+
+// How a thread waits for an event
+enum class WaitStrategy
+{
+    Spin,   // Busy wait; lowest latency, occupies a core while waiting
+    Yield,  // Busy wait, yielding the processor between checks
+    Park    // Sleep in the kernel (futex on Linux) until notified
+};
+
+// Lets threads wait for a condition without locking a mutex on the notifying side.
+// Notification is cheap when nobody waits. Usage:
+//   Waiting side: eventCount.wait([&]{ return conditionIsTrue(); });
+//   Notifying side: make the condition true, then call eventCount.notifyOne() or notifyAll().
+class EventCount
+{
+public:
+    explicit EventCount(WaitStrategy waitStrategy = WaitStrategy::Park) :
+        m_waitStrategy(waitStrategy)
+    {}
+
+    WaitStrategy waitStrategy() const {
+        return m_waitStrategy;
+    }
+
+    template<class Pred>
+    void wait(Pred pred)
+    {
+        while (!pred()) {
+            m_waiterCount.fetch_add(1, std::memory_order_seq_cst);
+            auto key = m_epoch.load(std::memory_order_seq_cst);
+            if (!pred())
+                waitForEpochChange(key);
+            m_waiterCount.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void notifyOne() {
+        notify(1);
+    }
+
+    void notifyAll() {
+        notify(INT_MAX);
+    }
+
+private:
+    WaitStrategy m_waitStrategy;
+    std::atomic<std::uint32_t> m_epoch = 0;
+    std::atomic<std::uint32_t> m_waiterCount = 0;
+#ifndef __linux__
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+#endif
+
+    void notify(int count)
+    {
+        m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        if (m_waitStrategy != WaitStrategy::Park ||
+            m_waiterCount.load(std::memory_order_seq_cst) == 0)
+            return;
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&m_epoch),
+                FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+        std::unique_lock<std::mutex> lk(m_mutex);
+        lk.unlock();
+        if (count == 1)
+            m_cond.notify_one();
+        else
+            m_cond.notify_all();
+#endif
+    }
+
+    void waitForEpochChange(std::uint32_t key)
+    {
+        switch (m_waitStrategy) {
+        case WaitStrategy::Spin:
+            while (m_epoch.load(std::memory_order_acquire) == key)
+            {}
+            break;
+        case WaitStrategy::Yield:
+            while (m_epoch.load(std::memory_order_acquire) == key)
+                std::this_thread::yield();
+            break;
+        case WaitStrategy::Park:
+#ifdef __linux__
+            // Returns immediately if the epoch is no longer equal to key
+            syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&m_epoch),
+                    FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+#else
+            {
+                std::unique_lock<std::mutex> lk(m_mutex);
+                m_cond.wait(lk, [&] {
+                    return m_epoch.load(std::memory_order_acquire) != key;
+                });
+            }
+#endif
+            break;
+        }
+    }
+};
+
+} // namespace sync
+} // namespace silver_bullets
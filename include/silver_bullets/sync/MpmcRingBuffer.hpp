@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#include <boost/assert.hpp>
+
+namespace silver_bullets {
+namespace sync {
+
+// Bounded lock-free multi-producer multi-consumer queue
+// (the algorithm is due to Dmitry Vyukov).
+// The capacity is rounded up to a power of two.
+template<class T>
+class MpmcRingBuffer
+{
+public:
+    explicit MpmcRingBuffer(std::size_t capacity) :
+        m_capacity(roundUpCapacity(capacity)),
+        m_mask(m_capacity - 1),
+        m_cells(new Cell[m_capacity])
+    {
+        for (std::size_t i=0; i<m_capacity; ++i)
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpmcRingBuffer(const MpmcRingBuffer&) = delete;
+    MpmcRingBuffer& operator=(const MpmcRingBuffer&) = delete;
+
+    std::size_t capacity() const {
+        return m_capacity;
+    }
+
+    // Returns false if the buffer is full
+    bool tryPush(const T& value)
+    {
+        auto pos = m_enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            auto& cell = m_cells[pos & m_mask];
+            auto seq = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false if the buffer is empty
+    bool tryPop(T& value)
+    {
+        auto pos = m_dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            auto& cell = m_cells[pos & m_mask];
+            auto seq = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(pos + m_capacity, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Note: The result is only a hint when other threads access the buffer
+    bool empty() const
+    {
+        return m_dequeuePos.load(std::memory_order_acquire) >=
+               m_enqueuePos.load(std::memory_order_acquire);
+    }
+
+private:
+    static constexpr std::size_t CacheLineSize = 64;
+
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    const std::size_t m_capacity;
+    const std::size_t m_mask;
+    std::unique_ptr<Cell[]> m_cells;
+
+    // Producers and consumers modify different cache lines
+    alignas(CacheLineSize) std::atomic<std::size_t> m_enqueuePos = 0;
+    alignas(CacheLineSize) std::atomic<std::size_t> m_dequeuePos = 0;
+
+    static std::size_t roundUpCapacity(std::size_t capacity)
+    {
+        BOOST_ASSERT(capacity > 0);
+        std::size_t result = 2;
+        while (result < capacity)
+            result <<= 1;
+        return result;
+    }
+};
+
+} // namespace sync
+} // namespace silver_bullets
@@ -0,0 +1,200 @@
+#pragma once
+
+#include "TaskGraph.hpp"
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+namespace silver_bullets {
+namespace task_engine {
+
+// Task function implemented by a task graph (see TaskGraphExecutor::setCompositeTaskRegistry()).
+// Composite task inputs are passed to unconnected inputs of the graph tasks,
+// and composite task outputs are taken from outputs of the graph tasks.
+struct CompositeTask
+{
+    TaskGraph taskGraph;
+
+    // Element i lists inputs of taskGraph tasks receiving composite task input i
+    std::vector<std::vector<InputEndPoint>> inputs;
+
+    // Element i is the output of a taskGraph task providing composite task output i
+    std::vector<OutputEndPoint> outputs;
+};
+
+using CompositeTaskRegistry = std::map<int, CompositeTask>;  // key = taskFuncId
+
+namespace detail {
+
+class CompositeTaskExpander
+{
+public:
+    CompositeTaskExpander(const CompositeTaskRegistry& registry, TaskGraph& result) :
+        m_registry(registry),
+        m_result(result)
+    {}
+
+    // Endpoints of the expanded graph corresponding to ports of a task being expanded
+    struct TaskPorts {
+        std::vector<std::vector<InputEndPoint>> inputs;     // index = input port
+        std::vector<OutputEndPoint> outputs;                // index = output port
+    };
+
+    // Appends tasks of g to the result, replacing composite tasks with their graphs.
+    // dataIndex maps indices in g.data to indices in the result data;
+    // its elements equal to ~0 are assigned to new result data elements.
+    std::vector<TaskPorts> expand(const TaskGraph& g, std::vector<std::size_t>& dataIndex)
+    {
+        auto resultDataIndex = [&](std::size_t mapIndex) {
+            auto& di = dataIndex[g.dataMap[mapIndex]];
+            if (di == ~std::size_t(0)) {
+                di = m_result.data.size();
+                m_result.data.push_back(g.data[g.dataMap[mapIndex]]);
+            }
+            return di;
+        };
+
+        std::vector<TaskPorts> ports(g.taskInfo.size());
+        std::vector<std::size_t> resultTaskIds(g.taskInfo.size(), ~std::size_t(0));
+        for (std::size_t taskId=0, n=g.taskInfo.size(); taskId<n; ++taskId) {
+            auto& ti = g.taskInfo[taskId];
+            auto& p = ports[taskId];
+            p.inputs.resize(ti.task.inputCount);
+            p.outputs.resize(ti.task.outputCount);
+            auto it = m_registry.find(ti.task.taskFuncId);
+            if (it == m_registry.end()) {
+                // Copy task
+                auto resultTaskId = resultTaskIds[taskId] = m_result.taskInfo.size();
+                auto rti = ti;
+                rti.inputIndex = m_result.dataMap.size();
+                for (std::size_t inputPort=0; inputPort<ti.task.inputCount; ++inputPort) {
+                    m_result.dataMap.push_back(resultDataIndex(ti.inputIndex+inputPort));
+                    p.inputs[inputPort].push_back({ resultTaskId, inputPort });
+                }
+                rti.outputIndex = m_result.dataMap.size();
+                for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+                    m_result.dataMap.push_back(resultDataIndex(ti.outputIndex+outputPort));
+                    p.outputs[outputPort] = { resultTaskId, outputPort };
+                }
+                rti.resourceDemandIndex = m_result.resourceDemands.size();
+                m_result.resourceDemands.insert(
+                            m_result.resourceDemands.end(),
+                            g.resourceDemands.begin() + ti.resourceDemandIndex,
+                            g.resourceDemands.begin() + ti.resourceDemandIndex + ti.resourceDemandCount);
+                m_result.taskInfo.push_back(rti);
+            }
+            else
+                expandCompositeTask(ti, it->second, p, resultDataIndex);
+        }
+
+        for (auto& c : g.connections) {
+            auto& from = ports[c.from.taskId].outputs[c.from.outputPort];
+            for (auto& to : ports[c.to.taskId].inputs[c.to.inputPort])
+                m_result.connections.push_back({ from, to });
+        }
+
+        for (auto& loop : g.loops) {
+            auto resultLoop = loop;
+            for (auto& taskId : resultLoop.tasks) {
+                taskId = resultTaskIds[taskId];
+                if (taskId == ~std::size_t(0))
+                    throw std::invalid_argument("CompositeTask: Loops containing composite tasks are not supported");
+            }
+            for (auto& c : resultLoop.feedback) {
+                c.from.taskId = resultTaskIds[c.from.taskId];
+                c.to.taskId = resultTaskIds[c.to.taskId];
+            }
+            resultLoop.converged.taskId = resultTaskIds[resultLoop.converged.taskId];
+            m_result.loops.push_back(resultLoop);
+        }
+        return ports;
+    }
+
+private:
+    const CompositeTaskRegistry& m_registry;
+    TaskGraph& m_result;
+    std::set<int> m_expandedTaskFuncIds;   // Composite tasks being expanded, to detect recursion
+
+    template<class ResultDataIndex>
+    void expandCompositeTask(
+            const TaskGraph::TaskInfo& ti,
+            const CompositeTask& ct,
+            TaskPorts& p,
+            ResultDataIndex& resultDataIndex)
+    {
+        auto taskFuncId = ti.task.taskFuncId;
+        auto& ig = ct.taskGraph;
+        if (ct.inputs.size() != ti.task.inputCount || ct.outputs.size() != ti.task.outputCount)
+            throw std::invalid_argument(
+                "CompositeTask: Port count mismatch for task function " + std::to_string(taskFuncId));
+        if (!m_expandedTaskFuncIds.insert(taskFuncId).second)
+            throw std::invalid_argument(
+                "CompositeTask: Task function " + std::to_string(taskFuncId) + " is used in its own graph");
+
+        // Bind inner data elements to the data of composite task ports
+        std::vector<std::size_t> innerDataIndex(ig.data.size(), ~std::size_t(0));
+        auto bind = [&](std::size_t innerMapIndex, std::size_t mapIndex) {
+            auto& di = innerDataIndex[ig.dataMap[innerMapIndex]];
+            if (di != ~std::size_t(0))
+                throw std::invalid_argument(
+                    "CompositeTask: Multiple ports of task function " + std::to_string(taskFuncId) +
+                    " are bound to the same data");
+            di = resultDataIndex(mapIndex);
+        };
+        for (std::size_t inputPort=0; inputPort<ti.task.inputCount; ++inputPort) {
+            for (auto& e : ct.inputs[inputPort]) {
+                auto connected = std::any_of(ig.connections.begin(), ig.connections.end(), [&](const Connection& c) {
+                    return c.to.taskId == e.taskId && c.to.inputPort == e.inputPort;
+                });
+                if (e.taskId >= ig.taskInfo.size() ||
+                        e.inputPort >= ig.taskInfo[e.taskId].task.inputCount || connected)
+                    throw std::invalid_argument(
+                        "CompositeTask: Invalid input of task function " + std::to_string(taskFuncId));
+                bind(ig.taskInfo[e.taskId].inputIndex + e.inputPort, ti.inputIndex + inputPort);
+            }
+        }
+        for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+            auto& e = ct.outputs[outputPort];
+            if (e.taskId >= ig.taskInfo.size() || e.outputPort >= ig.taskInfo[e.taskId].task.outputCount)
+                throw std::invalid_argument(
+                    "CompositeTask: Invalid output of task function " + std::to_string(taskFuncId));
+            bind(ig.taskInfo[e.taskId].outputIndex + e.outputPort, ti.outputIndex + outputPort);
+        }
+
+        auto innerPorts = expand(ig, innerDataIndex);
+        m_expandedTaskFuncIds.erase(taskFuncId);
+
+        for (std::size_t inputPort=0; inputPort<ti.task.inputCount; ++inputPort)
+            for (auto& e : ct.inputs[inputPort]) {
+                auto& innerInputs = innerPorts[e.taskId].inputs[e.inputPort];
+                p.inputs[inputPort].insert(p.inputs[inputPort].end(), innerInputs.begin(), innerInputs.end());
+            }
+        for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+            auto& e = ct.outputs[outputPort];
+            p.outputs[outputPort] = innerPorts[e.taskId].outputs[e.outputPort];
+        }
+    }
+};
+
+} // namespace detail
+
+// Returns g with each task whose taskFuncId is in registry replaced by tasks of the composite task graph,
+// recursively. The first g.data.size() data elements of the result correspond to those of g,
+// but are left empty; other data elements are copied from composite task graphs.
+// Note: Resource capacities of composite task graphs are ignored.
+inline TaskGraph expandCompositeTasks(const TaskGraph& g, const CompositeTaskRegistry& registry)
+{
+    TaskGraph result;
+    result.resourceCapacity = g.resourceCapacity;
+    result.data.resize(g.data.size());
+    std::vector<std::size_t> dataIndex(g.data.size());
+    for (std::size_t i=0, n=dataIndex.size(); i<n; ++i)
+        dataIndex[i] = i;
+    detail::CompositeTaskExpander(registry, result).expand(g, dataIndex);
+    return result;
+}
+
+} // namespace task_engine
+} // namespace silver_bullets
@@ -1,16 +1,45 @@
 #pragma once
 
 #include "TaskExecutor.hpp"
+#include "TaskDispatchPolicy.hpp"
+#include "TaskRetryPolicy.hpp"
 
 #include "silver_bullets/sync/ThreadNotifier.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <deque>
+#include <iterator>
 
 namespace silver_bullets {
 namespace task_engine {
 
+// Identifies a task added to ParallelTaskScheduler
+struct ParallelTaskHandle
+{
+    std::size_t id = 0;
+
+    bool isValid() const {
+        return id != 0;
+    }
+};
+
+// Share of executors given to the tasks of a tenant (see ParallelTaskScheduler::setTenantSettings())
+struct ParallelTaskTenantSettings
+{
+    double weight = 1;  // Tenants get executors of each resource type in proportion to their weights
+    std::size_t maxRunningTaskCount = std::numeric_limits<std::size_t>::max();  // For all resource types
+};
+
 template<class TaskFunc>
 class ParallelTaskScheduler
 {
@@ -23,19 +52,87 @@ public:
 
     ParallelTaskScheduler& addTaskExecutor(const std::shared_ptr<TaskExecutor<TaskFunc>>& taskExecutor)
     {
-        m_resourceInfo[taskExecutor->resourceType()].executors.push_back(taskExecutor);
+        m_resourceInfo[taskExecutor->resourceType()].executorInfo.push_back({taskExecutor, PendingTask()});
         taskExecutor->setTaskCompletionNotifier(&m_taskCompletionNotifier);
         return *this;
     }
 
-    ParallelTaskScheduler& addTask(const TaskExecutorStartParam& startParam)
+    ParallelTaskScheduler& setDispatchPolicy(TaskDispatchPolicy dispatchPolicy)
     {
-        auto& ri = m_resourceInfo.at(startParam.task.resourceType);
-        ri.tasks.push_back(startParam);
-        maybeStartNextTask(startParam.task.resourceType);
+        m_dispatchPolicy = dispatchPolicy;
         return *this;
     }
 
+    TaskDispatchPolicy dispatchPolicy() const {
+        return m_dispatchPolicy;
+    }
+
+    // Failed tasks are retried on other executors of the same resource type;
+    // failed executors are not used while they are not alive (see TaskExecutor::isAlive()).
+    // If a task fails retryPolicy.maxAttempts times, no more tasks are started,
+    // and propagateCb() throws an exception once all running tasks are finished.
+    ParallelTaskScheduler& setRetryPolicy(const TaskRetryPolicy& retryPolicy)
+    {
+        m_retryPolicy = retryPolicy;
+        return *this;
+    }
+
+    const TaskRetryPolicy& retryPolicy() const {
+        return m_retryPolicy;
+    }
+
+    // Tasks of different tenants waiting for executors of the same resource type are started
+    // using weighted fair queuing; tasks of the same tenant are started in FIFO order.
+    // Tenants without settings have the default ones.
+    ParallelTaskScheduler& setTenantSettings(int tenant, const ParallelTaskTenantSettings& settings)
+    {
+        BOOST_ASSERT(settings.weight > 0);
+        BOOST_ASSERT(settings.maxRunningTaskCount > 0);
+        m_tenantInfo[tenant].settings = settings;
+        return *this;
+    }
+
+    ParallelTaskTenantSettings tenantSettings(int tenant) const
+    {
+        auto it = m_tenantInfo.find(tenant);
+        return it == m_tenantInfo.end()? ParallelTaskTenantSettings(): it->second.settings;
+    }
+
+    // Adds a task that is started once all its predecessors have completed.
+    // Handles of completed tasks can be passed as predecessors, too.
+    // Throws std::invalid_argument if a predecessor is not a task of this scheduler,
+    // and std::runtime_error if a predecessor has been cancelled, because the scheduler
+    // has stopped on cancellation or failure before running it.
+    // Note: Call from the thread that calls wait() or propagateCb(); use spawnTask() in other threads.
+    ParallelTaskHandle addTask(
+            const TaskExecutorStartParam& startParam,
+            const std::vector<ParallelTaskHandle>& predecessors = {},
+            int tenant = 0)
+    {
+        checkPredecessorHandles(predecessors);
+        receiveSpawnedTasks();
+        ParallelTaskHandle result = { m_nextTaskId++ };
+        insertTask(result.id, startParam, predecessors, tenant);
+        return result;
+    }
+
+    // Same as addTask(), but can be called from any thread, e.g., from a running task function.
+    // The task is added to the scheduler during the next call to propagateCb(),
+    // which throws if a predecessor has been cancelled.
+    ParallelTaskHandle spawnTask(
+            const TaskExecutorStartParam& startParam,
+            const std::vector<ParallelTaskHandle>& predecessors = {},
+            int tenant = 0)
+    {
+        checkPredecessorHandles(predecessors);
+        std::unique_lock<std::mutex> lk(m_spawnedTaskMutex);
+        ParallelTaskHandle result = { m_nextTaskId++ };
+        m_spawnedTasks.push_back({ result.id, startParam, predecessors, tenant });
+        lk.unlock();
+        m_taskCompletionNotifier.notify_all();
+        return result;
+    }
+
     bool isRunning() const {
         return m_running;
     }
@@ -43,7 +140,10 @@ public:
     ParallelTaskScheduler& wait()
     {
         while(m_running) {
-            m_taskCompletionNotifier.wait();
+            if (m_retries.empty())
+                m_taskCompletionNotifier.wait();
+            else
+                m_taskCompletionNotifier.wait_for(pollInterval());
             propagateCb();
         }
         return *this;
@@ -55,7 +155,9 @@ public:
         auto endTime = std::chrono::system_clock::now() + timeout;
         auto remainingTimeout = timeout;
         while(m_running) {
-            if (!m_taskCompletionNotifier.wait_for(remainingTimeout))
+            if (!m_retries.empty() && remainingTimeout > pollInterval())
+                m_taskCompletionNotifier.wait_for(pollInterval());
+            else if (!m_taskCompletionNotifier.wait_for(remainingTimeout))
                 return false;
             auto currentTime = std::chrono::system_clock::now();
             if (currentTime >= endTime)
@@ -69,36 +171,81 @@ public:
     bool propagateCb()
     {
         auto cancelled = TaskExecutorCancelParam<TaskFunc>::isCancelled(m_cancelParam);
+        if (!m_running && !cancelled)
+            receiveSpawnedTasks();
         if (m_running) {
+            auto stopping = cancelled || m_failed;
+            if (stopping)
+                m_retries.clear();
+            else {
+                receiveSpawnedTasks();
+                startRetries();
+            }
+
             // Track finished tasks
-            std::size_t totalRunningExecutorCount = 0;
             for (auto& resourceInfoItem : m_resourceInfo) {
                 auto& ri = resourceInfoItem.second;
-                if (cancelled)
-                    ri.tasks.clear();
+                if (stopping)
+                    for (auto& tenantQueueItem : ri.tenantQueues)
+                        tenantQueueItem.second.tasks.clear();
                 for (std::size_t i=0; i<ri.runningExecutorCount; ++i) {
-                    auto& x = ri.executors[i];
-                    if (x->propagateCb()) {
+                    auto& xi = ri.executorInfo[i];
+                    if (xi.executor->propagateCb()) {
                         // Executor has finished task
+                        --m_tenantInfo.at(xi.task.tenant).runningTaskCount;
+                        if (xi.executor->taskFailed())
+                            retryTask(resourceInfoItem.first, std::move(xi.task));
+                        else if (!(cancelled || m_failed))
+                            completeTask(xi.task.taskId);
+                        xi.task = PendingTask();
 
                         // Put the executor after the last currently executing one
                         BOOST_ASSERT(ri.runningExecutorCount > 0);
                         --ri.runningExecutorCount;
                         if (i != ri.runningExecutorCount) {
                             BOOST_ASSERT(i < ri.runningExecutorCount);
-                            std::swap(x, ri.executors[ri.runningExecutorCount]);
+                            std::swap(xi, ri.executorInfo[ri.runningExecutorCount]);
                             --i;
                         }
 
                         // Start next task, if any
-                        if (!cancelled)
+                        if (!(cancelled || m_failed))
                             maybeStartNextTask(resourceInfoItem.first);
                     }
                 }
-                totalRunningExecutorCount += ri.runningExecutorCount;
             }
-            if (totalRunningExecutorCount == 0)
+
+            // Tasks of tenants that have reached their limits might be startable now
+            if (!(cancelled || m_failed))
+                for (auto& resourceInfoItem : m_resourceInfo)
+                    while (maybeStartNextTask(resourceInfoItem.first)) {}
+
+            // Note: Completed tasks might have started their successors of any resource type
+            std::size_t totalRunningExecutorCount = 0;
+            for (auto& resourceInfoItem : m_resourceInfo)
+                totalRunningExecutorCount += resourceInfoItem.second.runningExecutorCount;
+            stopping = cancelled || m_failed;
+            if (totalRunningExecutorCount == 0 && m_retries.empty()) {
+                // Note: Tasks might have been spawned by the tasks that have just completed
+                if (!stopping && receiveSpawnedTasks())
+                    return !m_running;
                 m_running = false;
+                if (stopping) {
+                    for (auto& taskItem : m_tasks)
+                        m_cancelledTaskIds.insert(taskItem.first);
+                    std::lock_guard<std::mutex> lk(m_spawnedTaskMutex);
+                    for (auto& spawnedTask : m_spawnedTasks)
+                        m_cancelledTaskIds.insert(spawnedTask.taskId);
+                    m_spawnedTasks.clear();
+                }
+                m_tasks.clear();
+                if (m_failed) {
+                    m_failed = false;
+                    throw std::runtime_error(
+                        "ParallelTaskScheduler: A task has failed " +
+                        std::to_string(m_retryPolicy.maxAttempts) + " times");
+                }
+            }
         }
         return !m_running;
     }
@@ -108,35 +255,261 @@ public:
     }
 
 private:
+    struct PendingTask
+    {
+        std::size_t taskId = 0;
+        TaskExecutorStartParam startParam;
+        std::size_t failedAttempts = 0;
+        int tenant = 0;
+    };
+    struct ExecutorInfo
+    {
+        std::shared_ptr<TaskExecutor<TaskFunc>> executor;
+        PendingTask task;   // Task being run, kept in case it has to be retried
+    };
     struct ResourceInfo
     {
-        std::vector<std::shared_ptr<TaskExecutor<TaskFunc>>> executors;
-        std::size_t runningExecutorCount = 0;   // Running are all at the beginning of executors
-        std::deque <TaskExecutorStartParam> tasks;
+        std::vector<ExecutorInfo> executorInfo;
+        std::size_t runningExecutorCount = 0;   // Running are all at the beginning of executorInfo
+        struct TenantQueue
+        {
+            std::deque<PendingTask> tasks;
+            double virtualTime = 0; // Grows by 1/weight as tasks are started
+        };
+        std::map<int, TenantQueue> tenantQueues;
+        double virtualTime = 0; // Virtual time of the tenant whose task has been started last
     };
 
     TaskExecutorCancelParam_t<TaskFunc> m_cancelParam;
 
     sync::ThreadNotifier m_taskCompletionNotifier;
     std::map<int, ResourceInfo> m_resourceInfo;
+    TaskDispatchPolicy m_dispatchPolicy = TaskDispatchPolicy::FirstAvailable;
+
+    TaskRetryPolicy m_retryPolicy;
+    struct Retry {
+        int resourceType;
+        PendingTask task;
+        std::chrono::steady_clock::time_point time;
+    };
+    std::vector<Retry> m_retries;
+    bool m_failed = false;  // A task has failed too many times
 
     bool m_running = false;
 
+    struct TenantInfo
+    {
+        ParallelTaskTenantSettings settings;
+        std::size_t runningTaskCount = 0;
+    };
+    std::map<int, TenantInfo> m_tenantInfo;
+
+    struct TaskInfo
+    {
+        std::size_t remainingPredecessorCount = 0;
+        std::vector<std::size_t> successors;
+        TaskExecutorStartParam startParam;  // Only until the task is queued
+        int tenant = 0;
+    };
+    // Tasks that are not completed yet
+    std::unordered_map<std::size_t, TaskInfo> m_tasks;
+    // Tasks dropped when the scheduler has stopped; other tasks with smaller ids
+    // than m_nextTaskId, but not in m_tasks, have completed.
+    std::unordered_set<std::size_t> m_cancelledTaskIds;
+    std::atomic<std::size_t> m_nextTaskId = 1;
+
+    struct SpawnedTask
+    {
+        std::size_t taskId;
+        TaskExecutorStartParam startParam;
+        std::vector<ParallelTaskHandle> predecessors;
+        int tenant;
+    };
+    std::mutex m_spawnedTaskMutex;
+    std::vector<SpawnedTask> m_spawnedTasks;   // Ordered by taskId
+
+    void insertTask(
+            std::size_t taskId,
+            const TaskExecutorStartParam& startParam,
+            const std::vector<ParallelTaskHandle>& predecessors,
+            int tenant)
+    {
+        if (m_resourceInfo.count(startParam.task.resourceType) == 0)
+            throw std::runtime_error("ParallelTaskScheduler: No suitable resources are supplied");
+        for (auto& predecessor : predecessors)
+            if (m_cancelledTaskIds.count(predecessor.id) > 0)
+                throw std::runtime_error(
+                    "ParallelTaskScheduler: Predecessor task " + std::to_string(predecessor.id) +
+                    " has been cancelled");
+        auto& taskInfo = m_tasks[taskId];
+        for (auto& predecessor : predecessors) {
+            BOOST_ASSERT(predecessor.id < taskId);
+            auto it = m_tasks.find(predecessor.id);
+            if (it != m_tasks.end()) {
+                ++taskInfo.remainingPredecessorCount;
+                it->second.successors.push_back(taskId);
+            }
+        }
+        if (taskInfo.remainingPredecessorCount == 0)
+            queueTask({taskId, startParam, 0, tenant}, false);
+        else {
+            taskInfo.startParam = startParam;
+            taskInfo.tenant = tenant;
+        }
+    }
+
+    void checkPredecessorHandles(const std::vector<ParallelTaskHandle>& predecessors) const
+    {
+        auto nextTaskId = m_nextTaskId.load();
+        for (auto& predecessor : predecessors)
+            if (!predecessor.isValid() || predecessor.id >= nextTaskId)
+                throw std::invalid_argument("ParallelTaskScheduler: Invalid predecessor task handle");
+    }
+
+    // Puts task at the end of its tenant's queue, or at the beginning if it is retried
+    void queueTask(PendingTask&& task, bool retry)
+    {
+        auto resourceType = task.startParam.task.resourceType;
+        auto& ri = m_resourceInfo.at(resourceType);
+        auto& tq = ri.tenantQueues[task.tenant];
+        if (tq.tasks.empty())
+            // An idle tenant does not get the share it has not used
+            tq.virtualTime = std::max(tq.virtualTime, ri.virtualTime);
+        m_tenantInfo[task.tenant];  // Make sure the tenant is known
+        if (retry)
+            tq.tasks.push_front(std::move(task));
+        else
+            tq.tasks.push_back(std::move(task));
+        maybeStartNextTask(resourceType);
+    }
+
+    // Queues successors whose predecessors have all completed
+    void completeTask(std::size_t taskId)
+    {
+        auto it = m_tasks.find(taskId);
+        BOOST_ASSERT(it != m_tasks.end());
+        auto successors = std::move(it->second.successors);
+        m_tasks.erase(it);
+        for (auto successorId : successors) {
+            auto& successor = m_tasks.at(successorId);
+            BOOST_ASSERT(successor.remainingPredecessorCount > 0);
+            if (--successor.remainingPredecessorCount == 0)
+                queueTask({successorId, std::move(successor.startParam), 0, successor.tenant}, false);
+        }
+    }
+
+    // Returns true if any tasks have been spawned since the last call.
+    // A task that cannot be added is cancelled, and the exception is rethrown;
+    // the tasks spawned after it are added during the next call.
+    bool receiveSpawnedTasks()
+    {
+        std::vector<SpawnedTask> spawnedTasks;
+        {
+            std::lock_guard<std::mutex> lk(m_spawnedTaskMutex);
+            if (m_spawnedTasks.empty())
+                return false;
+            spawnedTasks.swap(m_spawnedTasks);
+        }
+        for (auto it=spawnedTasks.begin(); it!=spawnedTasks.end(); ++it) {
+            try {
+                insertTask(it->taskId, it->startParam, it->predecessors, it->tenant);
+            }
+            catch(...) {
+                m_cancelledTaskIds.insert(it->taskId);
+                std::lock_guard<std::mutex> lk(m_spawnedTaskMutex);
+                m_spawnedTasks.insert(m_spawnedTasks.begin(), std::next(it), spawnedTasks.end());
+                throw;
+            }
+        }
+        return true;
+    }
+
+    std::chrono::milliseconds pollInterval() const
+    {
+        using namespace std::chrono;
+        BOOST_ASSERT(!m_retries.empty());
+        auto nextRetryTime = std::min_element(
+                    m_retries.begin(), m_retries.end(),
+                    [](const Retry& a, const Retry& b) { return a.time < b.time; })->time;
+        auto untilRetry = duration_cast<milliseconds>(nextRetryTime - steady_clock::now()) + milliseconds(1);
+        return std::max(untilRetry, milliseconds(1));
+    }
+
+    void retryTask(int resourceType, PendingTask&& task)
+    {
+        ++task.failedAttempts;
+        if (task.failedAttempts >= m_retryPolicy.maxAttempts)
+            m_failed = true;
+        else {
+            auto time = std::chrono::steady_clock::now() + m_retryPolicy.backoff(task.failedAttempts);
+            m_retries.push_back({ resourceType, std::move(task), time });
+        }
+    }
+
+    // Puts tasks whose retry time has come in front of their queues
+    void startRetries()
+    {
+        auto currentTime = std::chrono::steady_clock::now();
+        auto it = std::remove_if(m_retries.begin(), m_retries.end(), [&](Retry& retry) {
+            if (retry.time > currentTime)
+                return false;
+            queueTask(std::move(retry.task), true);
+            return true;
+        });
+        m_retries.erase(it, m_retries.end());
+    }
+
+    // Returns the queue of the tenant whose task is to be started next, or end() if there is none
+    typename std::map<int, typename ResourceInfo::TenantQueue>::iterator nextTenantQueue(ResourceInfo& ri)
+    {
+        auto result = ri.tenantQueues.end();
+        for (auto it=ri.tenantQueues.begin(); it!=ri.tenantQueues.end(); ++it) {
+            if (it->second.tasks.empty())
+                continue;
+            auto& ti = m_tenantInfo.at(it->first);
+            if (ti.runningTaskCount < ti.settings.maxRunningTaskCount &&
+                (result == ri.tenantQueues.end() || it->second.virtualTime < result->second.virtualTime))
+                result = it;
+        }
+        return result;
+    }
+
     bool maybeStartNextTask(int resourceType)
     {
         auto& ri = m_resourceInfo.at(resourceType);
-        if (ri.tasks.empty())
+        auto tqit = nextTenantQueue(ri);
+        if (tqit == ri.tenantQueues.end())
             return false;
 
-        if (ri.executors.empty())
+        if (ri.executorInfo.empty())
             throw std::runtime_error("ParallelTaskScheduler: No suitable resources are supplied");
 
-        if (ri.runningExecutorCount < ri.executors.size()) {
+        if (ri.runningExecutorCount < ri.executorInfo.size()) {
+            auto ix = selectIdleExecutor(
+                        m_dispatchPolicy, ri.runningExecutorCount, ri.executorInfo.size(),
+                        [&ri](std::size_t i) -> auto& { return *ri.executorInfo[i].executor; });
+            if (ix == ri.executorInfo.size()) {
+                if (ri.runningExecutorCount > 0)
+                    // Wait for a running executor
+                    return false;
+                else
+                    // No executor is known to be alive, so probe any of them
+                    ix = 0;
+            }
+
             // Start next task
-            auto& x = ri.executors[ri.runningExecutorCount];
-            auto startParam = ri.tasks.front();
-            ri.tasks.pop_front();
-            x->start(std::move(startParam));
+            if (ix != ri.runningExecutorCount)
+                std::swap(ri.executorInfo[ix], ri.executorInfo[ri.runningExecutorCount]);
+            auto& xi = ri.executorInfo[ri.runningExecutorCount];
+            auto& tq = tqit->second;
+            auto& ti = m_tenantInfo.at(tqit->first);
+            xi.task = std::move(tq.tasks.front());
+            tq.tasks.pop_front();
+            ++ti.runningTaskCount;
+            ri.virtualTime = tq.virtualTime;
+            tq.virtualTime += 1 / ti.settings.weight;
+            auto startParam = xi.task.startParam;
+            xi.executor->start(std::move(startParam));
             ++ri.runningExecutorCount;
             m_running = true;
             return true;
@@ -54,6 +54,26 @@ template<class F> inline SimpleTaskFunc makeSimpleTaskFunc(
 }
 
 
+// Returns task function of a map task (see TaskKind::Map) calling f for each element
+// of the chunk at input 0; f receives the element and other task inputs, as in makeSimpleTaskFunc().
+template<class F> inline SimpleTaskFunc makeSimpleMapTaskFunc(F f)
+{
+    auto elementFunc = makeSimpleTaskFunc(f);
+    return [elementFunc](const pany_range& outputs, const const_pany_range& inputs) {
+        auto& chunk = boost::any_cast<const TaskCollection&>(*inputs[0]);
+        TaskCollection results(chunk.size());
+        std::vector<const boost::any*> elementInputs(inputs.begin(), inputs.end());
+        auto in = elementInputs.data();
+        for (std::size_t i=0, n=chunk.size(); i<n; ++i) {
+            elementInputs[0] = &chunk[i];
+            auto out = &results[i];
+            elementFunc({ &out, &out+1 }, { in, in+elementInputs.size() });
+        }
+        *outputs[0] = std::move(results);
+    };
+}
+
+
 
 template<> struct ThreadLocalData<SimpleTaskFunc> {
     struct type {};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <boost/any.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <vector>
+
+namespace silver_bullets {
+namespace task_engine {
+
+// Converts values of one type, held by boost::any, to bytes and back
+struct TaskDataCodec
+{
+    std::uint32_t codecId;
+
+    // Appends bytes representing value to the second argument
+    std::function<void(const boost::any&, std::vector<char>&)> encode;
+
+    std::function<boost::any(const char*, std::size_t)> decode;
+};
+
+namespace detail {
+
+// Codec copying bytes of a trivially copyable value
+template<class T>
+struct TrivialTaskDataCodec
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    static void encode(const T& value, std::vector<char>& bytes)
+    {
+        auto begin = reinterpret_cast<const char*>(&value);
+        bytes.insert(bytes.end(), begin, begin + sizeof(T));
+    }
+
+    static T decode(const char *data, std::size_t size)
+    {
+        if (size != sizeof(T))
+            throw std::runtime_error("TaskDataCodec: Invalid size of encoded data");
+        T result;
+        std::memcpy(&result, data, sizeof(T));
+        return result;
+    }
+};
+
+// Codec copying bytes of elements of a contiguous container
+template<class C, class E>
+struct TrivialTaskDataSequenceCodec
+{
+    static_assert(std::is_trivially_copyable_v<E>);
+
+    static void encode(const C& value, std::vector<char>& bytes)
+    {
+        auto begin = reinterpret_cast<const char*>(value.data());
+        bytes.insert(bytes.end(), begin, begin + value.size()*sizeof(E));
+    }
+
+    static C decode(const char *data, std::size_t size)
+    {
+        if (size % sizeof(E) != 0)
+            throw std::runtime_error("TaskDataCodec: Invalid size of encoded data");
+        C result(size / sizeof(E), E());
+        std::memcpy(result.data(), data, size);
+        return result;
+    }
+};
+
+template<class E, class A>
+struct TrivialTaskDataCodec<std::vector<E, A>> : TrivialTaskDataSequenceCodec<std::vector<E, A>, E>
+{
+    static_assert(!std::is_same_v<E, bool>);
+};
+
+template<class E, class Tr, class A>
+struct TrivialTaskDataCodec<std::basic_string<E, Tr, A>> : TrivialTaskDataSequenceCodec<std::basic_string<E, Tr, A>, E>
+{};
+
+} // namespace detail
+
+// Codecs of values passed between tasks, found by the type of a value or by codecId.
+// Codec ids are written to files (see TaskGraphExecutor::setCheckpointing()),
+// so a codec must keep its id in all programs reading these files.
+class TaskDataCodecRegistry
+{
+public:
+    // Adds the codec of values of type T; encode(const T&, std::vector<char>& bytes) appends to bytes,
+    // decode(const char *data, std::size_t size) returns T.
+    template<class T, class Encode, class Decode>
+    TaskDataCodecRegistry& add(std::uint32_t codecId, Encode encode, Decode decode)
+    {
+        if (m_typeById.count(codecId) > 0)
+            throw std::invalid_argument("TaskDataCodecRegistry: Duplicate codec id " + std::to_string(codecId));
+        std::type_index type = typeid(T);
+        if (m_codecs.count(type) > 0)
+            throw std::invalid_argument(std::string("TaskDataCodecRegistry: Duplicate codec of type ") + type.name());
+        m_codecs.emplace(type, TaskDataCodec{
+            codecId,
+            [encode](const boost::any& value, std::vector<char>& bytes) {
+                encode(boost::any_cast<const T&>(value), bytes);
+            },
+            [decode](const char *data, std::size_t size) {
+                return boost::any(decode(data, size));
+            }
+        });
+        m_typeById.emplace(codecId, type);
+        return *this;
+    }
+
+    // Adds the codec copying bytes of a trivially copyable T, or of elements of std::vector
+    // or std::basic_string with trivially copyable elements.
+    // Note: The encoding depends on the platform (endianness and sizes of types).
+    template<class T>
+    TaskDataCodecRegistry& add(std::uint32_t codecId)
+    {
+        using Codec = detail::TrivialTaskDataCodec<T>;
+        return add<T>(codecId, Codec::encode, Codec::decode);
+    }
+
+    // Returns the codec of the value type, or nullptr if there is no such codec
+    const TaskDataCodec *find(const boost::any& value) const
+    {
+        auto it = m_codecs.find(value.type());
+        return it == m_codecs.end()? nullptr: &it->second;
+    }
+
+    const TaskDataCodec *find(std::uint32_t codecId) const
+    {
+        auto it = m_typeById.find(codecId);
+        return it == m_typeById.end()? nullptr: &m_codecs.at(it->second);
+    }
+
+private:
+    std::map<std::type_index, TaskDataCodec> m_codecs;
+    std::map<std::uint32_t, std::type_index> m_typeById;
+};
+
+} // namespace task_engine
+} // namespace silver_bullets
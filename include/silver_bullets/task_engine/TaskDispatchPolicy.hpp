@@ -0,0 +1,54 @@
+#pragma once
+
+#include "TaskExecutor.hpp"
+
+#include <tuple>
+
+#include <boost/assert.hpp>
+
+namespace silver_bullets {
+namespace task_engine {
+
+enum class TaskDispatchPolicy
+{
+    FirstAvailable, // Take the first idle executor
+    LeastLoaded,    // Take the idle executor reporting the smallest queue depth
+    Fastest         // Take the idle executor reporting the smallest recent task latency
+};
+
+// Returns the index, in the range [first, last), of the idle executor
+// that should receive the next task according to policy.
+// Executors that are not alive are skipped; if none is alive, last is returned.
+// executorAt(i) must return a reference to the i-th executor.
+template<class ExecutorAt>
+inline std::size_t selectIdleExecutor(
+        TaskDispatchPolicy policy,
+        std::size_t first,
+        std::size_t last,
+        ExecutorAt executorAt)
+{
+    BOOST_ASSERT(first <= last);
+    auto result = last;
+    auto key = [policy](const TaskExecutorLoad& load) {
+        return policy == TaskDispatchPolicy::LeastLoaded?
+            std::make_tuple(static_cast<double>(load.queueDepth), load.recentTaskLatency):
+            std::make_tuple(load.recentTaskLatency, static_cast<double>(load.queueDepth));
+    };
+    decltype(key(TaskExecutorLoad())) bestKey;
+    for (auto i=first; i<last; ++i) {
+        auto& executor = executorAt(i);
+        if (!executor.isAlive())
+            continue;
+        if (policy == TaskDispatchPolicy::FirstAvailable)
+            return i;
+        auto k = key(executor.load());
+        if (result == last || k < bestKey) {
+            bestKey = k;
+            result = i;
+        }
+    }
+    return result;
+}
+
+} // namespace task_engine
+} // namespace silver_bullets
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace silver_bullets {
+namespace task_engine {
+
+enum class TaskExecutionOutcome : std::uint32_t
+{
+    Completed,
+    Failed,
+    Discarded   // The task was cancelled or duplicated (see TaskGraphExecutor::setSpeculation())
+};
+
+// Task, or a part of a map or reduce task, run by an executor (see TaskGraphExecutor::setExecutionLog()).
+// Records can be written to files as a TaskGraphFile section.
+struct TaskExecutionLogRecord
+{
+    std::uint64_t taskId;
+
+    // Executors are numbered in the order of TaskGraphExecutor::addTaskExecutor() calls
+    std::uint64_t executorIndex;
+
+    // Elements [partBegin, partEnd) of a map task, or first input ports of the segments
+    // combined by a reduce task; zero for other tasks
+    std::uint64_t partBegin;
+    std::uint64_t partEnd;
+
+    // Nanoseconds since the computation has started; the finish time is when
+    // the task is found to be finished by TaskGraphExecutor::propagateCb()
+    std::int64_t startTime;
+    std::int64_t finishTime;
+
+    TaskExecutionOutcome outcome;
+    std::uint32_t reserved;
+};
+
+// Records in the order tasks are started
+using TaskExecutionLog = std::vector<TaskExecutionLogRecord>;
+
+} // namespace task_engine
+} // namespace silver_bullets
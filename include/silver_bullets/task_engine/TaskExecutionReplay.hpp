@@ -0,0 +1,87 @@
+#pragma once
+
+#include "TaskExecutionLog.hpp"
+#include "TaskGraph.hpp"
+
+#include <stdexcept>
+#include <vector>
+
+#include <boost/assert.hpp>
+
+namespace silver_bullets {
+namespace task_engine {
+namespace detail {
+
+// Position of a computation in the replayed execution log (see TaskGraphExecutor::setReplay())
+class TaskExecutionReplay
+{
+public:
+    // nullptr disables replay
+    void setLog(const TaskExecutionLog *log) {
+        m_log = log;
+    }
+
+    const TaskExecutionLog *log() const {
+        return m_log;
+    }
+
+    bool isEnabled() const {
+        return m_log != nullptr;
+    }
+
+    // Throws an exception if the log refers to tasks or executors that don't exist;
+    // element i of executorResourceTypes is the resource type of the executor with index i
+    void check(const TaskGraph& g, const std::vector<int>& executorResourceTypes) const
+    {
+        for (auto& record : *m_log)
+            if (record.taskId >= g.taskInfo.size() || record.executorIndex >= executorResourceTypes.size() ||
+                    executorResourceTypes[record.executorIndex] != g.taskInfo[record.taskId].task.resourceType)
+                throw std::runtime_error("TaskGraphExecutor: Replayed log does not match the graph and executors");
+    }
+
+    // Called when a computation starts
+    void rewind()
+    {
+        m_position = 0;
+        m_startingRecord = nullptr;
+    }
+
+    // Index of the next record to replay
+    std::size_t position() const {
+        return m_position;
+    }
+
+    // Returns the next record to replay, or nullptr if all records are replayed
+    const TaskExecutionLogRecord *next() const {
+        return m_position < m_log->size()? &(*m_log)[m_position]: nullptr;
+    }
+
+    // Called before and after starting the task of the next record; while the task is being started,
+    // startingRecord() returns the record
+    void beginStart()
+    {
+        BOOST_ASSERT(m_position < m_log->size());
+        m_startingRecord = &(*m_log)[m_position];
+    }
+
+    void endStart(bool started)
+    {
+        m_startingRecord = nullptr;
+        if (started)
+            ++m_position;
+    }
+
+    // Returns nullptr unless the task of a record is being started
+    const TaskExecutionLogRecord *startingRecord() const {
+        return m_startingRecord;
+    }
+
+private:
+    const TaskExecutionLog *m_log = nullptr;
+    std::size_t m_position = 0;
+    const TaskExecutionLogRecord *m_startingRecord = nullptr;
+};
+
+} // namespace detail
+} // namespace task_engine
+} // namespace silver_bullets
@@ -24,6 +24,13 @@ struct TaskExecutorStartParam
     std::function<void()> cb;
 };
 
+// Load of the worker behind an executor, as last reported by the worker
+struct TaskExecutorLoad
+{
+    std::size_t queueDepth = 0;     // Number of tasks queued or running on the worker
+    double recentTaskLatency = 0;   // Recent average task duration, in seconds (0 if unknown)
+};
+
 template<class TaskFunc>
 class TaskExecutor
 {
@@ -36,6 +43,27 @@ public:
     virtual void setTaskCompletionNotifier(sync::ThreadNotifier *taskCompletionNotifier) = 0;
     virtual sync::ThreadNotifier *taskCompletionNotifier() const = 0;
 
+    // Executors that cannot report their load return default-constructed value
+    virtual TaskExecutorLoad load() const {
+        return {};
+    }
+
+    // Requests the executor to abandon the task it is running, if it can.
+    // The executor still reports task completion, see propagateCb().
+    virtual void cancelTask() {}
+
+    // Returns true if the task whose completion has been reported
+    // by the last call to propagateCb() could not be run (e.g., because
+    // a remote worker is unreachable), so its outputs are not computed.
+    virtual bool taskFailed() const {
+        return false;
+    }
+
+    // Returns false if the executor is known to be unable to run tasks
+    virtual bool isAlive() const {
+        return true;
+    }
+
     template<class ... Args>
     void start(
             const Task& task,
@@ -12,8 +12,38 @@
 namespace silver_bullets {
 namespace task_engine {
 
+// Determines how a task takes part in conditional execution.
+// A skipped task is not run; its outputs are cleared, counted as computed, and are dead.
+enum class TaskBranching
+{
+    None,       // The task is skipped if any of its inputs is dead
+    Switch,     // Outputs left empty by the task are dead, which prunes untaken branches
+    Merge       // The task is run once each input is computed or dead, receiving empty values
+                // for dead inputs; it is skipped if all its connected inputs are dead
+};
+
+// Determines how the task function is applied to task inputs
+enum class TaskKind
+{
+    Plain,      // The task function is called once for all inputs
+    Map,        // Input 0 is a TaskCollection, whose elements are split into chunks processed in parallel.
+                // For each chunk, the task function receives a TaskCollection with chunk elements
+                // at input 0, other task inputs unchanged, and returns a TaskCollection with results
+                // for chunk elements at output 0, the only output of the task. Task output is
+                // a TaskCollection with results for all elements (see TaskGraphExecutor::setMapChunkDuration()).
+    Reduce      // The task function, which must be associative, combines two values into one. It is called
+                // for values of adjacent input ports, and then for adjacent partial results, as soon as both
+                // are available, in any order. Task output is the result of combining all inputs in port order.
+};
+
 struct TaskGraph
 {
+    // Amount of a resource that a task holds while it is running
+    struct ResourceDemand {
+        int resource;
+        std::size_t amount;
+    };
+
     struct TaskInfo {
         Task task;
 
@@ -24,10 +54,39 @@ struct TaskGraph
         // outputs of the task are determined by indices in dataMap range
         // [outputIndex, outputIndex+task.outputCount)
         std::size_t outputIndex;
+
+        // resources demanded by the task in addition to one unit of task.resourceType
+        // are given by resourceDemands range [resourceDemandIndex, resourceDemandIndex+resourceDemandCount)
+        std::size_t resourceDemandIndex = 0;
+        std::size_t resourceDemandCount = 0;
+
+        // Estimated memory taken by task outputs, and used by the task while it is running
+        // (see TaskGraphExecutor::setMemoryBudget())
+        std::size_t outputFootprint = 0;
+        std::size_t scratchFootprint = 0;
+
+        TaskBranching branching = TaskBranching::None;
+        TaskKind kind = TaskKind::Plain;
     };
+    // Tasks repeated until the converged output is true or maxIterationCount iterations are done.
+    // Each feedback connection passes an output computed at an iteration to an input at the next one;
+    // at the first iteration, that input keeps its own value. Tasks outside the loop
+    // receive outputs of the last iteration.
+    struct Loop {
+        std::vector<std::size_t> tasks;
+        std::vector<Connection> feedback;
+        OutputEndPoint converged;   // Output of a loop task, of type bool
+        std::size_t maxIterationCount = ~0;
+    };
+
     std::vector<TaskInfo> taskInfo;
     std::vector<Connection> connections;
+    std::vector<Loop> loops;
+
+    // Maximal total amount of each resource held by running tasks; keys are resource types
+    // and resource identifiers used in resourceDemands. Resources not listed here are unlimited.
     std::map<int, std::size_t> resourceCapacity;
+    std::vector<ResourceDemand> resourceDemands;
     std::vector<boost::any> data;   // All data elements, including inputs and outputs
     std::vector<size_t> dataMap;    // Each element is an index in data
 
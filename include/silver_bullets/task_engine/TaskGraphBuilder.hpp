@@ -2,6 +2,12 @@
 
 #include "TaskGraph.hpp"
 
+#include <algorithm>
+#include <numeric>
+#include <set>
+#include <stdexcept>
+#include <string>
+
 #include <boost/assert.hpp>
 
 namespace silver_bullets {
@@ -21,6 +27,52 @@ public:
         return result;
     }
 
+    // Declares that the task holds amount of resource while it is running,
+    // in addition to one unit of its resource type.
+    void setResourceDemand(std::size_t taskId, int resource, std::size_t amount)
+    {
+        BOOST_ASSERT(taskId < m_tasks.size());
+        m_resourceDemands[taskId][resource] = amount;
+    }
+
+    // Sets estimated memory taken by task outputs, and used by the task while it is running
+    void setMemoryFootprint(std::size_t taskId, std::size_t outputFootprint, std::size_t scratchFootprint)
+    {
+        BOOST_ASSERT(taskId < m_tasks.size());
+        m_memoryFootprints[taskId] = { outputFootprint, scratchFootprint };
+    }
+
+    void setBranching(std::size_t taskId, TaskBranching branching)
+    {
+        BOOST_ASSERT(taskId < m_tasks.size());
+        m_branching[taskId] = branching;
+    }
+
+    // Note: Map tasks must have at least one input, reduce tasks at least two inputs;
+    // both must have exactly one output, and can't be switch or merge tasks.
+    void setKind(std::size_t taskId, TaskKind kind)
+    {
+        BOOST_ASSERT(taskId < m_tasks.size());
+        m_kinds[taskId] = kind;
+    }
+
+    // Makes tasks a loop body (see TaskGraph::Loop); returns the loop index.
+    // Note: Tasks of a loop must not be in other loops, and must not be switch, merge, map, or reduce tasks.
+    std::size_t addLoop(
+            const std::vector<std::size_t>& tasks,
+            const std::vector<Connection>& feedback,
+            OutputEndPoint converged,
+            std::size_t maxIterationCount = ~0)
+    {
+        auto result = m_loops.size();
+        m_loops.push_back({ tasks, feedback, converged, maxIterationCount });
+        return result;
+    }
+
+    void setResourceCapacity(int resource, std::size_t capacity) {
+        m_resourceCapacity[resource] = capacity;
+    }
+
     void connect(
             std::size_t sourceTaskId,
             std::size_t sourcePort,
@@ -31,50 +83,88 @@ public:
             Connection{{sourceTaskId, sourcePort}, {sinkTaskId, sinkPort}});
     }
 
+    // Returns the graph; throws an exception if the graph is invalid or has cycles.
+    // Takes time linear in the number of tasks, ports, and connections.
     TaskGraph taskGraph() const
     {
         TaskGraph result;
+        auto taskCount = m_tasks.size();
+
+        // Index inputs of all tasks by a single number
+        std::vector<std::size_t> inputOffsets(taskCount+1);
         size_t dataMapSize = 0;
-        for (auto& t : m_tasks)
-            dataMapSize += t.inputCount + t.outputCount;
+        for (size_t taskId=0; taskId<taskCount; ++taskId) {
+            auto& task = m_tasks[taskId];
+            inputOffsets[taskId+1] = inputOffsets[taskId] + task.inputCount;
+            dataMapSize += task.inputCount + task.outputCount;
+        }
         BOOST_ASSERT(m_connections.size() < dataMapSize);
         auto dataSize = dataMapSize - m_connections.size();
-        result.taskInfo.reserve(m_tasks.size());
+        result.taskInfo.reserve(taskCount);
         result.data.resize(dataSize);
         result.dataMap.resize(dataMapSize);
         result.connections = m_connections;
+        result.resourceCapacity = m_resourceCapacity;
 
-        std::map<InputEndPoint, OutputEndPoint> i2o;
-        for (auto c : m_connections) {
-            if (c.from.taskId >= m_tasks.size() ||
+        // Find output connected to each input
+        std::vector<OutputEndPoint> inputSources(inputOffsets.back(), { ~std::size_t(0), 0 });
+        for (auto& c : m_connections) {
+            if (c.from.taskId >= taskCount ||
                     c.from.outputPort >= m_tasks[c.from.taskId].outputCount ||
-                    c.to.taskId >= m_tasks.size() ||
+                    c.to.taskId >= taskCount ||
                     c.to.inputPort >= m_tasks[c.to.taskId].inputCount)
                 throw std::invalid_argument("TaskGraphBuilder: invalid connection");
-            if (i2o.find(c.to) != i2o.end())
+            auto& source = inputSources[inputOffsets[c.to.taskId] + c.to.inputPort];
+            if (source.taskId != ~std::size_t(0))
                 throw std::invalid_argument("TaskGraphBuilder: multiple connetions to the same input port");
-            i2o.insert({c.to, c.from});
+            source = c.from;
         }
+        checkAcyclic();
 
         size_t idata = 0;
         size_t imap = 0;
-        for (size_t taskId=0, n=m_tasks.size(); taskId<n; ++taskId) {
+        for (size_t taskId=0; taskId<taskCount; ++taskId) {
             auto& task = m_tasks[taskId];
             auto outputIndex = imap;
             for (std::size_t outputPort=0; outputPort<task.outputCount; ++outputPort)
                 result.dataMap[imap++] = idata++;
             result.taskInfo.emplace_back(TaskGraph::TaskInfo{task, 0, outputIndex});
         }
-        for (size_t taskId=0, n=m_tasks.size(); taskId<n; ++taskId) {
+        for (auto& footprintItem : m_memoryFootprints) {
+            auto& ti = result.taskInfo[footprintItem.first];
+            ti.outputFootprint = footprintItem.second.first;
+            ti.scratchFootprint = footprintItem.second.second;
+        }
+        for (auto& branchingItem : m_branching)
+            result.taskInfo[branchingItem.first].branching = branchingItem.second;
+        for (auto& kindItem : m_kinds) {
+            auto& ti = result.taskInfo[kindItem.first];
+            if (kindItem.second == TaskKind::Map &&
+                    (ti.task.inputCount == 0 || ti.task.outputCount != 1 || ti.branching != TaskBranching::None))
+                throw std::invalid_argument("TaskGraphBuilder: invalid map task");
+            if (kindItem.second == TaskKind::Reduce &&
+                    (ti.task.inputCount < 2 || ti.task.outputCount != 1 || ti.branching != TaskBranching::None))
+                throw std::invalid_argument("TaskGraphBuilder: invalid reduce task");
+            ti.kind = kindItem.second;
+        }
+        for (auto& demandItem : m_resourceDemands) {
+            auto& ti = result.taskInfo[demandItem.first];
+            ti.resourceDemandIndex = result.resourceDemands.size();
+            ti.resourceDemandCount = demandItem.second.size();
+            for (auto& resourceItem : demandItem.second)
+                result.resourceDemands.push_back({ resourceItem.first, resourceItem.second });
+        }
+        validateLoops(inputOffsets, inputSources);
+        result.loops = m_loops;
+
+        for (size_t taskId=0; taskId<taskCount; ++taskId) {
             auto& task = m_tasks[taskId];
             result.taskInfo[taskId].inputIndex = imap;
             for (std::size_t inputPort=0; inputPort<task.inputCount; ++inputPort) {
-                InputEndPoint input = { taskId, inputPort };
-                auto it = i2o.find(input);
-                if (it == i2o.end())
+                auto& output = inputSources[inputOffsets[taskId] + inputPort];
+                if (output.taskId == ~std::size_t(0))
                     result.dataMap[imap++] = idata++;
                 else {
-                    auto output = it->second;
                     auto& adjTaskInfo = result.taskInfo[output.taskId];
                     result.dataMap[imap++] = result.dataMap[adjTaskInfo.outputIndex + output.outputPort];
                 }
@@ -85,7 +175,127 @@ public:
 
 private:
     std::vector<Task> m_tasks;
+    std::vector<TaskGraph::Loop> m_loops;
     std::vector<Connection> m_connections;
+    std::map<std::size_t, std::map<int, std::size_t>> m_resourceDemands;  // key = taskId
+    std::map<int, std::size_t> m_resourceCapacity;
+    std::map<std::size_t, std::pair<std::size_t, std::size_t>> m_memoryFootprints;  // key = taskId
+    std::map<std::size_t, TaskBranching> m_branching;  // key = taskId
+    std::map<std::size_t, TaskKind> m_kinds;    // key = taskId
+
+    void validateLoops(
+            const std::vector<std::size_t>& inputOffsets,
+            const std::vector<OutputEndPoint>& inputSources) const
+    {
+        std::map<std::size_t, std::size_t> taskLoops;   // key = taskId, value = loop index
+        for (std::size_t loopIndex=0, n=m_loops.size(); loopIndex<n; ++loopIndex) {
+            auto& loop = m_loops[loopIndex];
+            for (auto taskId : loop.tasks) {
+                if (taskId >= m_tasks.size() || !taskLoops.insert({taskId, loopIndex}).second)
+                    throw std::invalid_argument("TaskGraphBuilder: invalid loop task");
+                auto it = m_branching.find(taskId);
+                if (it != m_branching.end() && it->second != TaskBranching::None)
+                    throw std::invalid_argument("TaskGraphBuilder: branching in a loop");
+                auto kindIt = m_kinds.find(taskId);
+                if (kindIt != m_kinds.end() && kindIt->second != TaskKind::Plain)
+                    throw std::invalid_argument("TaskGraphBuilder: map or reduce task in a loop");
+            }
+            auto inLoop = [&](std::size_t taskId) {
+                auto it = taskLoops.find(taskId);
+                return it != taskLoops.end() && it->second == loopIndex;
+            };
+            std::set<InputEndPoint> feedbackInputs;
+            for (auto& c : loop.feedback) {
+                if (!inLoop(c.from.taskId) ||
+                        c.from.outputPort >= m_tasks[c.from.taskId].outputCount ||
+                        !inLoop(c.to.taskId) ||
+                        c.to.inputPort >= m_tasks[c.to.taskId].inputCount ||
+                        inputSources[inputOffsets[c.to.taskId] + c.to.inputPort].taskId != ~std::size_t(0) ||
+                        !feedbackInputs.insert(c.to).second)
+                    throw std::invalid_argument("TaskGraphBuilder: invalid loop feedback connection");
+            }
+            if (!inLoop(loop.converged.taskId) ||
+                    loop.converged.outputPort >= m_tasks[loop.converged.taskId].outputCount)
+                throw std::invalid_argument("TaskGraphBuilder: invalid loop convergence output");
+        }
+    }
+
+    // Throws an exception listing tasks of a cycle, if any, and tasks that
+    // can never run because they depend on cycles
+    void checkAcyclic() const
+    {
+        // Compute predecessors and successors of each task in compressed form:
+        // successors of task i are successors[successorIndex[i]], ..., successors[successorIndex[i+1]-1]
+        auto taskCount = m_tasks.size();
+        std::vector<std::size_t> successorIndex(taskCount+1), predecessorIndex(taskCount+1);
+        for (auto& c : m_connections) {
+            ++successorIndex[c.from.taskId+1];
+            ++predecessorIndex[c.to.taskId+1];
+        }
+        std::partial_sum(successorIndex.begin(), successorIndex.end(), successorIndex.begin());
+        std::partial_sum(predecessorIndex.begin(), predecessorIndex.end(), predecessorIndex.begin());
+        std::vector<std::size_t> successors(m_connections.size()), predecessors(m_connections.size());
+        {
+            auto nextSuccessor = successorIndex;
+            auto nextPredecessor = predecessorIndex;
+            for (auto& c : m_connections) {
+                successors[nextSuccessor[c.from.taskId]++] = c.to.taskId;
+                predecessors[nextPredecessor[c.to.taskId]++] = c.from.taskId;
+            }
+        }
+
+        // Visit tasks in topological order; unvisited tasks keep nonzero counts
+        // of unvisited predecessors
+        std::vector<std::size_t> predecessorCounts(taskCount);
+        std::vector<std::size_t> visited;
+        visited.reserve(taskCount);
+        for (std::size_t taskId=0; taskId<taskCount; ++taskId) {
+            predecessorCounts[taskId] = predecessorIndex[taskId+1] - predecessorIndex[taskId];
+            if (predecessorCounts[taskId] == 0)
+                visited.push_back(taskId);
+        }
+        for (std::size_t i=0; i<visited.size(); ++i)
+            for (auto j=successorIndex[visited[i]]; j<successorIndex[visited[i]+1]; ++j)
+                if (--predecessorCounts[successors[j]] == 0)
+                    visited.push_back(successors[j]);
+        if (visited.size() == taskCount)
+            return;
+
+        // Each unvisited task has an unvisited predecessor, so going
+        // to predecessors from any unvisited task eventually makes a cycle
+        std::vector<std::size_t> path;
+        std::vector<std::size_t> pathPos(taskCount, ~std::size_t(0));
+        auto taskId = static_cast<std::size_t>(std::find_if(
+                    predecessorCounts.begin(), predecessorCounts.end(),
+                    [](std::size_t n) { return n > 0; }) - predecessorCounts.begin());
+        while (pathPos[taskId] == ~std::size_t(0)) {
+            pathPos[taskId] = path.size();
+            path.push_back(taskId);
+            auto begin = predecessors.begin() + static_cast<std::ptrdiff_t>(predecessorIndex[taskId]);
+            auto end = predecessors.begin() + static_cast<std::ptrdiff_t>(predecessorIndex[taskId+1]);
+            taskId = *std::find_if(begin, end, [&](std::size_t id) { return predecessorCounts[id] > 0; });
+        }
+        std::vector<std::size_t> cycle(path.rbegin(), path.rend() - static_cast<std::ptrdiff_t>(pathPos[taskId]));
+        std::vector<std::size_t> unreachable;
+        for (std::size_t id=0; id<taskCount; ++id)
+            if (predecessorCounts[id] > 0 && std::find(cycle.begin(), cycle.end(), id) == cycle.end())
+                unreachable.push_back(id);
+        auto message = "TaskGraphBuilder: tasks " + taskIdList(cycle) + " make a cycle";
+        if (!unreachable.empty())
+            message += "; tasks " + taskIdList(unreachable) + " are unreachable";
+        throw std::invalid_argument(message);
+    }
+
+    static std::string taskIdList(const std::vector<std::size_t>& taskIds)
+    {
+        constexpr std::size_t MaxListedTaskCount = 20;
+        std::string result;
+        for (std::size_t i=0, n=std::min(taskIds.size(), MaxListedTaskCount); i<n; ++i)
+            result += (i == 0? "": ", ") + std::to_string(taskIds[i]);
+        if (taskIds.size() > MaxListedTaskCount)
+            result += ", ... (" + std::to_string(taskIds.size()) + " total)";
+        return result;
+    }
 };
 
 } // namespace task_engine
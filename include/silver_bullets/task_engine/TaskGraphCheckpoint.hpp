@@ -0,0 +1,157 @@
+#pragma once
+
+#include "OutputEndPoint.hpp"
+#include "TaskDataCodec.hpp"
+#include "TaskGraphFile.hpp"
+#include "TaskStatus.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/assert.hpp>
+
+namespace silver_bullets {
+namespace task_engine {
+
+// Determines how a computation is saved, so that it can be restarted if the process dies
+// (see TaskGraphExecutor::setCheckpointing())
+struct TaskGraphCheckpointParam
+{
+    // File to write checkpoints to; empty means no checkpoints (the default).
+    // A checkpoint replaces the previous one once it is written completely.
+    std::string fileName;
+
+    // Minimum time between checkpoints
+    std::chrono::milliseconds interval = std::chrono::seconds(60);
+
+    // Codecs of output values, also used to read checkpoints
+    const TaskDataCodecRegistry *codecs = nullptr;
+
+    // Outputs to save; each of them must have a codec. If empty, all outputs whose values
+    // have codecs are saved. Task ids refer to the expanded graph if it has composite tasks.
+    std::vector<OutputEndPoint> outputs;
+};
+
+namespace detail {
+
+// Encodes outputs and writes checkpoints, each replacing the previous one, on a separate thread
+class TaskGraphCheckpointWriter
+{
+public:
+    // State of the computation; null value pointers stand for empty outputs of switch tasks
+    struct Snapshot {
+        std::vector<TaskStatus> taskStatus;
+        std::vector<std::pair<OutputEndPoint, const boost::any*>> newOutputs;   // Not saved before
+    };
+
+    ~TaskGraphCheckpointWriter()
+    {
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+    // Called when a computation starts; forgets outputs saved by checkpoints of the previous one
+    void reset()
+    {
+        m_outputs.clear();
+        m_outputData.clear();
+    }
+
+    // Returns true if a checkpoint is being written, or has been written but join() has not been called;
+    // outputs of the snapshot must not change meanwhile
+    bool isWriting() const {
+        return m_thread.joinable();
+    }
+
+    // Returns true if join() won't block
+    bool isFinished() const {
+        return m_finished;
+    }
+
+    // Starts writing the checkpoint on a separate thread
+    void start(Snapshot&& snapshot, const TaskGraphCheckpointParam& param)
+    {
+        BOOST_ASSERT(!m_thread.joinable());
+        m_snapshot = std::move(snapshot);
+        m_finished = false;
+        m_thread = std::thread([this, &param] {
+            m_error = write(param);
+            m_finished = true;
+        });
+    }
+
+    // Waits for the checkpoint being written; returns the error, if any
+    std::exception_ptr join()
+    {
+        m_thread.join();
+        auto result = m_error;
+        m_error = nullptr;
+        return result;
+    }
+
+    // Writes the checkpoint on the calling thread; returns the error, if any
+    std::exception_ptr write(Snapshot&& snapshot, const TaskGraphCheckpointParam& param)
+    {
+        BOOST_ASSERT(!m_thread.joinable());
+        m_snapshot = std::move(snapshot);
+        return write(param);
+    }
+
+private:
+    std::thread m_thread;
+    std::atomic<bool> m_finished = false;
+    std::exception_ptr m_error;
+    Snapshot m_snapshot;
+
+    // Outputs saved by previous checkpoints of the computation
+    std::vector<TaskGraphFileCheckpointOutput> m_outputs;
+    std::vector<char> m_outputData;
+
+    // Encodes new outputs and writes the checkpoint; replaces the previous checkpoint file on success
+    std::exception_ptr write(const TaskGraphCheckpointParam& param)
+    {
+        try {
+            for (auto& item : m_snapshot.newOutputs) {
+                TaskGraphFileCheckpointOutput o = { item.first, m_outputData.size(), 0, TaskGraphFileCheckpointOutput::EmptyValue, 0 };
+                if (item.second) {
+                    auto codec = param.codecs? param.codecs->find(*item.second): nullptr;
+                    if (!codec) {
+                        if (param.outputs.empty())
+                            continue;
+                        throw std::runtime_error(
+                            "TaskGraphExecutor: No codec for output " + std::to_string(item.first.outputPort) +
+                            " of task " + std::to_string(item.first.taskId));
+                    }
+                    codec->encode(*item.second, m_outputData);
+                    o.size = m_outputData.size() - o.offset;
+                    o.codecId = codec->codecId;
+                }
+                m_outputs.push_back(o);
+            }
+            auto tempFileName = param.fileName + ".tmp";
+            TaskGraphFileWriter()
+                    .addSection(TaskGraphFileSection::CheckpointTaskStatus, m_snapshot.taskStatus)
+                    .addSection(TaskGraphFileSection::CheckpointOutputs, m_outputs)
+                    .addSection(TaskGraphFileSection::CheckpointOutputData, m_outputData)
+                    .write(tempFileName);
+            if (std::rename(tempFileName.c_str(), param.fileName.c_str()) != 0)
+                throw std::runtime_error(
+                    "TaskGraphExecutor: Failed to rename checkpoint file '" + tempFileName + "'");
+            return nullptr;
+        }
+        catch(...) {
+            return std::current_exception();
+        }
+    }
+};
+
+} // namespace detail
+
+} // namespace task_engine
+} // namespace silver_bullets
@@ -1,12 +1,29 @@
 #pragma once
 
 #include "TaskGraph.hpp"
+#include "CompositeTask.hpp"
+#include "TaskGraphFile.hpp"
+#include "TaskGraphCheckpoint.hpp"
+#include "TaskGraphLoops.hpp"
+#include "TaskGraphPartitions.hpp"
+#include "TaskStatus.hpp"
+#include "TaskExecutionLog.hpp"
+#include "TaskExecutionReplay.hpp"
 #include "TaskExecutor.hpp"
+#include "TaskDispatchPolicy.hpp"
+#include "TaskLatencyStats.hpp"
+#include "TaskRetryPolicy.hpp"
 
 #include "silver_bullets/sync/ThreadNotifier.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <memory>
+#include <numeric>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <boost/range/algorithm/copy.hpp>
@@ -38,25 +55,308 @@ public:
 
     TaskGraphExecutor& addTaskExecutor(const std::shared_ptr<TaskExecutor<TaskFunc>>& taskExecutor)
     {
-        m_resourceInfo[taskExecutor->resourceType()].executorInfo.push_back({taskExecutor});
+        m_resourceInfo[taskExecutor->resourceType()].executorInfo.emplace_back(taskExecutor, m_executorCount++);
         taskExecutor->setTaskCompletionNotifier(&m_taskCompletionNotifier);
         return *this;
     }
 
+    TaskGraphExecutor& setDispatchPolicy(TaskDispatchPolicy dispatchPolicy)
+    {
+        m_dispatchPolicy = dispatchPolicy;
+        return *this;
+    }
+
+    TaskDispatchPolicy dispatchPolicy() const {
+        return m_dispatchPolicy;
+    }
+
+    // Enables speculative re-execution of straggler tasks: when a task runs
+    // longer than latencyFactor times the median duration of its task function,
+    // a duplicate is started on an idle executor of the same resource type.
+    // The first copy to finish provides task outputs; the other one
+    // is cancelled (see TaskExecutor::cancelTask()), and its outputs are discarded.
+    // Running tasks are checked each checkInterval. Pass zero latencyFactor
+    // to disable speculation (the default).
+    // Note: The graph computation is only reported to be finished
+    // when all duplicates have finished.
+    TaskGraphExecutor& setSpeculation(
+            double latencyFactor,
+            std::chrono::milliseconds checkInterval = std::chrono::milliseconds(10))
+    {
+        BOOST_ASSERT(!m_running);
+        m_speculationFactor = latencyFactor;
+        m_speculationCheckInterval = checkInterval;
+        return *this;
+    }
+
+    // Failed tasks are retried on other executors of the same resource type;
+    // failed executors are not used while they are not alive (see TaskExecutor::isAlive()).
+    // If a task fails retryPolicy.maxAttempts times, the computation is stopped,
+    // and propagateCb() throws an exception once all running tasks are finished.
+    TaskGraphExecutor& setRetryPolicy(const TaskRetryPolicy& retryPolicy)
+    {
+        m_retryPolicy = retryPolicy;
+        return *this;
+    }
+
+    const TaskRetryPolicy& retryPolicy() const {
+        return m_retryPolicy;
+    }
+
+    // Holds back ready tasks while starting them would make the estimated memory usage exceed
+    // memoryBudget; zero means no limit (the default). The estimate is the sum of
+    // TaskGraph::TaskInfo::scratchFootprint of running tasks and outputFootprint of tasks
+    // whose outputs are still needed. Ready tasks releasing more memory are started first.
+    // When all tasks consuming outputs of a task have completed, these outputs are cleared,
+    // unless speculation is enabled. Outputs not connected to other tasks are kept.
+    // Note: If no task is running, a task is started even if it exceeds the budget.
+    TaskGraphExecutor& setMemoryBudget(std::size_t memoryBudget)
+    {
+        BOOST_ASSERT(!m_running);
+        m_memoryBudget = memoryBudget;
+        return *this;
+    }
+
+    std::size_t memoryBudget() const {
+        return m_memoryBudget;
+    }
+
+    // Tasks whose taskFuncId is in compositeTaskRegistry are replaced by tasks of the composite
+    // task graph, which are run by the executors of this object as any other tasks.
+    // Task graphs are expanded when the cache is built, i.e., the registry must not change
+    // until caches made before are discarded. Task ids in exception messages refer to the expanded graph.
+    TaskGraphExecutor& setCompositeTaskRegistry(const CompositeTaskRegistry *compositeTaskRegistry)
+    {
+        BOOST_ASSERT(!m_running);
+        m_compositeTaskRegistry = compositeTaskRegistry;
+        return *this;
+    }
+
+    const CompositeTaskRegistry *compositeTaskRegistry() const {
+        return m_compositeTaskRegistry;
+    }
+
+    // Elements of a map task (see TaskKind::Map) are split into chunks taking about chunkDuration
+    // each, estimated from the median duration per element of recent chunks of the same task function.
+    // Chunks also shrink as fewer elements remain, so that all executors finish at about the same time;
+    // while the duration is unknown, chunks have one element. A failed chunk is retried alone after
+    // the backoff (see setRetryPolicy()); its attempts are counted separately from other chunks.
+    TaskGraphExecutor& setMapChunkDuration(std::chrono::milliseconds chunkDuration)
+    {
+        m_mapChunkDuration = chunkDuration;
+        return *this;
+    }
+
+    std::chrono::milliseconds mapChunkDuration() const {
+        return m_mapChunkDuration;
+    }
+
+    // Saves status of tasks (see taskStatus()) and outputs of completed tasks to checkpointParam.fileName,
+    // so that the computation can be restarted if the process dies (see restart()). A checkpoint is taken
+    // when a task completes, at most once per checkpointParam.interval; outputs are encoded and written
+    // on a separate thread while the computation goes on. Outputs are saved once per run, and the ones
+    // to be cleared (see setMemoryBudget()) are kept while a checkpoint is being written.
+    // The last checkpoint is written when the computation is cancelled or a task fails.
+    // If a checkpoint can't be written, the computation is stopped, and propagateCb() throws an exception
+    // once all running tasks are finished.
+    TaskGraphExecutor& setCheckpointing(const TaskGraphCheckpointParam& checkpointParam)
+    {
+        BOOST_ASSERT(!m_running);
+        m_checkpointParam = checkpointParam;
+        return *this;
+    }
+
+    const TaskGraphCheckpointParam& checkpointParam() const {
+        return m_checkpointParam;
+    }
+
+    // Records tasks run by executors to executionLog, which is cleared when a computation starts;
+    // nullptr disables recording (the default). Recording a task takes two clock readings
+    // and appending a record. The log must not be accessed while the computation is running.
+    TaskGraphExecutor& setExecutionLog(TaskExecutionLog *executionLog)
+    {
+        BOOST_ASSERT(!m_running);
+        m_executionLog = executionLog;
+        return *this;
+    }
+
+    TaskExecutionLog *executionLog() const {
+        return m_executionLog;
+    }
+
+    // Runs computations with the schedule of replayLog, recorded with the same graph and executors
+    // added in the same order (see setExecutionLog()): tasks, chunks of map tasks, and combines
+    // of reduce tasks are started in the order of the log records, each on the executor of its record,
+    // once it is ready.
+    // If the computation can't follow the log, e.g., because tasks fail differently, it is stopped,
+    // and propagateCb() throws an exception. nullptr disables replay (the default).
+    // Note: Speculation can't be enabled in this mode.
+    TaskGraphExecutor& setReplay(const TaskExecutionLog *replayLog)
+    {
+        BOOST_ASSERT(!m_running);
+        m_replay.setLog(replayLog);
+        return *this;
+    }
+
+    const TaskExecutionLog *replayLog() const {
+        return m_replay.log();
+    }
+
+    // Sets the maximum number of threads building the cache of a large graph;
+    // zero means std::thread::hardware_concurrency() (the default).
+    TaskGraphExecutor& setCacheBuildThreadCount(std::size_t cacheBuildThreadCount)
+    {
+        m_cacheBuildThreadCount = cacheBuildThreadCount;
+        return *this;
+    }
+
+    std::size_t cacheBuildThreadCount() const {
+        return m_cacheBuildThreadCount;
+    }
+
+    // Runs tasks level by level: tasks of a topological level are started once all tasks
+    // of the previous level have completed, without tracking availability of individual inputs.
+    // This saves time on wide graphs of short tasks, but leaves executors idle if task durations
+    // within a level vary. Levels are computed the first time the cache is used in this mode.
+    // Note: Graphs with loops or branching tasks can't be run in this mode.
+    TaskGraphExecutor& setLevelSynchronous(bool levelSynchronous)
+    {
+        BOOST_ASSERT(!m_running);
+        m_levelSynchronous = levelSynchronous;
+        return *this;
+    }
+
+    bool isLevelSynchronous() const {
+        return m_levelSynchronous;
+    }
+
+    // Returns the number of topological levels of the graph, or zero if levels are not computed
+    // (see setLevelSynchronous()). Level 0 consists of root tasks; tasks of level L have inputs
+    // connected to tasks of level L-1 and, possibly, lower levels.
+    static std::size_t levelCount(const boost::any& cache)
+    {
+        auto& c = boost::any_cast<const Cache&>(cache);
+        return c.levelIndex.empty()? 0: c.levelIndex.size() - 1;
+    }
+
+    // Returns taskIds of tasks at the specified level
+    static boost::iterator_range<const std::size_t*> levelTasks(const boost::any& cache, std::size_t level)
+    {
+        auto& c = boost::any_cast<const Cache&>(cache);
+        BOOST_ASSERT(level + 1 < c.levelIndex.size());
+        auto d = c.levelTasks.data();
+        return { d + c.levelIndex[level], d + c.levelIndex[level+1] };
+    }
+
     boost::any makeCache() {
         return Cache();
     }
 
+    // Adds sections with the cache built by a previous run to writer,
+    // normally along with the graph (see TaskGraphFileWriter::addTaskGraph()).
+    static void addCacheSections(TaskGraphFileWriter& writer, const boost::any& cache)
+    {
+        auto& c = boost::any_cast<const Cache&>(cache);
+        if (c.roots.empty())
+            throw std::runtime_error("TaskGraphExecutor: Cache is not built");
+        if (c.expandedTaskGraph)
+            throw std::runtime_error("TaskGraphExecutor: Saving cache of a graph with composite tasks is not supported");
+        std::uint64_t totalOutputCount = c.totalOutputCount;
+        writer.addSection(TaskGraphFileSection::CacheTotalOutputCount, &totalOutputCount, 1)
+              .addSection(TaskGraphFileSection::CacheRoots, c.roots)
+              .addSection(TaskGraphFileSection::CacheInitAvailTaskInputs, c.initAvailTaskInputs)
+              .addSection(TaskGraphFileSection::CacheTaskIoDataIdx, c.taskIoDataIdx)
+              .addSection(TaskGraphFileSection::CacheInputSources, c.inputSources)
+              .addSection(TaskGraphFileSection::CacheInitConsumerCounts, c.initConsumerCounts)
+              .addSection(TaskGraphFileSection::CacheConsumerIndex, c.consumerIndex)
+              .addSection(TaskGraphFileSection::CacheConsumers, c.consumers);
+        if (!c.levelIndex.empty())
+            writer.addSection(TaskGraphFileSection::CacheLevelIndex, c.levelIndex)
+                  .addSection(TaskGraphFileSection::CacheLevelTasks, c.levelTasks);
+    }
+
+    // Returns cache read from file, to be used with the graph read from the same file.
+    // If the file has no cache sections, returns an empty cache, as makeCache() does.
+    static boost::any loadCache(const TaskGraphFile& file)
+    {
+        Cache c;
+        auto totalOutputCount = file.section<std::uint64_t>(TaskGraphFileSection::CacheTotalOutputCount);
+        if (totalOutputCount.empty())
+            return c;
+        c.totalOutputCount = static_cast<std::size_t>(totalOutputCount.front());
+        file.assign(c.roots, TaskGraphFileSection::CacheRoots);
+        file.assign(c.initAvailTaskInputs, TaskGraphFileSection::CacheInitAvailTaskInputs);
+        file.assign(c.taskIoDataIdx, TaskGraphFileSection::CacheTaskIoDataIdx);
+        file.assign(c.inputSources, TaskGraphFileSection::CacheInputSources);
+        file.assign(c.initConsumerCounts, TaskGraphFileSection::CacheInitConsumerCounts);
+        file.assign(c.consumerIndex, TaskGraphFileSection::CacheConsumerIndex);
+        file.assign(c.consumers, TaskGraphFileSection::CacheConsumers);
+        if (file.hasSection(TaskGraphFileSection::CacheLevelIndex)) {
+            file.assign(c.levelIndex, TaskGraphFileSection::CacheLevelIndex);
+            file.assign(c.levelTasks, TaskGraphFileSection::CacheLevelTasks);
+        }
+        return c;
+    }
+
     template<class ... Args>
     TaskGraphExecutor& start(
             TaskGraph *taskGraph,
             boost::any& cache,
             Args&& ... args)
     {
-        startPriv({ taskGraph, &cache, args... });
+        startPriv(makeStartParam(taskGraph, cache, std::forward<Args>(args)...), StartMode::Start);
+        return *this;
+    }
+
+    // Continues the computation stopped by cancellation or by a task failure, using outputs
+    // of tasks completed before; pending and cancelled tasks are run, as well as all tasks
+    // of loops that have not finished. Inputs of the graph must not be modified in between;
+    // note that unfinished loops restart with inputs last written by their feedback connections.
+    template<class ... Args>
+    TaskGraphExecutor& resume(
+            TaskGraph *taskGraph,
+            boost::any& cache,
+            Args&& ... args)
+    {
+        startPriv(makeStartParam(taskGraph, cache, std::forward<Args>(args)...), StartMode::Resume);
+        return *this;
+    }
+
+    // Continues the computation saved in the checkpoint file (see setCheckpointing()),
+    // e.g., by another process, as resume() does; outputs of completed tasks are read from the file
+    // using checkpointParam().codecs. Completed tasks are run again if their outputs needed
+    // by pending tasks, or having no consumers, have not been saved.
+    template<class ... Args>
+    TaskGraphExecutor& restart(
+            const std::string& checkpointFileName,
+            TaskGraph *taskGraph,
+            boost::any& cache,
+            Args&& ... args)
+    {
+        TaskGraphFile checkpoint(checkpointFileName);
+        startPriv(makeStartParam(taskGraph, cache, std::forward<Args>(args)...), StartMode::Restart, &checkpoint);
         return *this;
     }
 
+    // Cancels the computation; this can also be done using the cancel parameter passed
+    // to the constructor. Ready tasks are not started anymore, and running tasks are asked to stop
+    // (see TaskExecutor::cancelTask()); their outputs are discarded, because they might be
+    // computed partially, unless task functions are not cancellable (see IsCancellable).
+    // The computation stops once running tasks finish; outputs of completed tasks are kept,
+    // so that it can be resumed (see resume()).
+    void cancel()
+    {
+        m_cancelRequested = true;
+        m_taskCompletionNotifier.notify_all();
+    }
+
+    // Returns status of each task in the last computation using the cache, index = taskId;
+    // empty if no computation has been started. Task ids refer to the expanded graph
+    // if it has composite tasks.
+    static const std::vector<TaskStatus>& taskStatus(const boost::any& cache) {
+        return boost::any_cast<const Cache&>(cache).taskStatus;
+    }
+
     bool isRunning() const {
         return m_running;
     }
@@ -64,7 +364,10 @@ public:
     TaskGraphExecutor& wait()
     {
         while(m_running) {
-            m_taskCompletionNotifier.wait();
+            if (needsPolling())
+                m_taskCompletionNotifier.wait_for(pollInterval());
+            else
+                m_taskCompletionNotifier.wait();
             propagateCb();
         }
         return *this;
@@ -76,7 +379,9 @@ public:
         auto endTime = std::chrono::system_clock::now() + timeout;
         auto remainingTimeout = timeout;
         while(m_running) {
-            if (!m_taskCompletionNotifier.wait_for(remainingTimeout))
+            if (needsPolling() && remainingTimeout > pollInterval())
+                m_taskCompletionNotifier.wait_for(pollInterval());
+            else if (!m_taskCompletionNotifier.wait_for(remainingTimeout))
                 return false;
             auto currentTime = std::chrono::system_clock::now();
             if (currentTime >= endTime)
@@ -89,63 +394,55 @@ public:
 
     bool propagateCb()
     {
-        auto cancelled = TaskExecutorCancelParam<TaskFunc>::isCancelled(m_cancelParam);
+        auto cancelled = m_cancelRequested || TaskExecutorCancelParam<TaskFunc>::isCancelled(m_cancelParam);
         if (m_running) {
-            // Track finished tasks
-            std::size_t totalRunningExecutorCount = 0;
-            BOOST_ASSERT(m_totalComputedOutputCount < m_cache->totalOutputCount);
-            for (auto& resourceInfoItem : m_resourceInfo) {
-                auto& ri = resourceInfoItem.second;
-                for (std::size_t i=0; i<ri.runningExecutorCount; ++i) {
-                    auto& xi = ri.executorInfo[i];
-                    if (xi.executor->propagateCb()) {
-                        // Executor has finished task
-
-                        // Update the total number of computed outputs
-                        auto& ti = m_startParam.taskGraph->taskInfo[xi.taskId];
-                        m_totalComputedOutputCount += ti.task.outputCount;
-
-                        // Update available input counters for connected tasks;
-                        // enqueue next tasks, if any
-                        for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
-                            auto itr = m_cache->o2i.equal_range({xi.taskId, outputPort});
-                            for (auto& o2iItem : boost::make_iterator_range(itr.first, itr.second)) {
-                                auto adjTaskId = o2iItem.second.taskId;
-                                auto availAdjInputCount = ++m_cache->availTaskInputs[adjTaskId];
-                                if (availAdjInputCount == m_startParam.taskGraph->taskInfo[adjTaskId].task.inputCount)
-                                    m_ready.insert(adjTaskId);
-                            }
-                        }
-
-                        // Put the executor after the last currently executing one
-                        xi.taskId = ~0;
-                        BOOST_ASSERT(ri.runningExecutorCount > 0);
-                        --ri.runningExecutorCount;
-                        if (i != ri.runningExecutorCount) {
-                            BOOST_ASSERT(i < ri.runningExecutorCount);
-                            std::swap(xi, ri.executorInfo[ri.runningExecutorCount]);
-                            --i;
-                        }
-                    }
-                }
-                totalRunningExecutorCount += ri.runningExecutorCount;
+            if (cancelled && !m_cancelling) {
+                // Keep outputs of tasks that have finished before the cancellation was found
+                trackFinishedTasks();
+                startCancellation();
             }
 
-            if (cancelled) {
+            // Track finished tasks
+            auto totalRunningExecutorCount = trackFinishedTasks();
+
+            if (cancelled || m_failedTaskId != ~std::size_t(0) || m_checkpointError) {
                 if (totalRunningExecutorCount == 0) {
+                    auto failedTaskId = m_failedTaskId;
+                    auto checkpointError = finishCheckpoints(true);
                     setNonRunningState();
+                    if (failedTaskId != ~std::size_t(0))
+                        throw std::runtime_error(
+                            "TaskGraphExecutor: Task " + std::to_string(failedTaskId) +
+                            " has failed " + std::to_string(m_retryPolicy.maxAttempts) + " times");
+                    if (checkpointError)
+                        std::rethrow_exception(checkpointError);
                     return true;
                 }
                 else
                     return false;
             }
-            else
+            else {
+                startRetries();
                 startNextTasks();
+                if (isSpeculating())
+                    startDuplicates();
+                checkpoint();
+                if (m_replay.isEnabled() && isReplayStuck()) {
+                    auto replayPosition = m_replay.position();
+                    finishCheckpoints(false);
+                    setNonRunningState();
+                    throw std::runtime_error(
+                        "TaskGraphExecutor: The computation does not follow the replayed log at record " +
+                        std::to_string(replayPosition));
+                }
+            }
         }
         else
             return false;
-        if (m_totalComputedOutputCount == m_cache->totalOutputCount) {
+        if (m_totalComputedOutputCount == m_cache->totalOutputCount && m_discardedTaskCount == 0) {
             auto cb = std::move(m_startParam.cb);
+            // Note: The computation has completed, so the error of the last checkpoint, if any, is ignored
+            finishCheckpoints(false);
             setNonRunningState();
             if (cb)
                 cb();
@@ -159,8 +456,33 @@ public:
 
 private:
     struct ExecutorInfo {
+        ExecutorInfo(const std::shared_ptr<TaskExecutor<TaskFunc>>& executor, std::size_t executorIndex) :
+            executor(executor),
+            executorIndex(executorIndex)
+        {}
+
         std::shared_ptr<TaskExecutor<TaskFunc>> executor;
+        std::size_t executorIndex = 0;  // See TaskExecutionLogRecord::executorIndex
         std::size_t taskId = ~0;
+        std::size_t logRecord = ~0;     // Index of the record in the execution log
+
+        // The fields below are only used when speculation is enabled or the task is a map or reduce task
+        std::chrono::steady_clock::time_point startTime;
+        bool duplicated = false;        // Another executor is running the same task
+        bool discardOutputs = false;    // Another executor has already computed the task
+        bool cancelled = false;         // The task was asked to stop when the computation was cancelled
+        std::vector<boost::any> outputs;    // Task outputs, moved to the graph on completion
+        std::vector<boost::any*> outputPtrs;
+
+        // Elements [chunkBegin, chunkEnd) of the collection processed by a map task,
+        // or first input ports of the segments combined by a reduce task (see detail::ReduceTaskState);
+        // chunkInput holds a copy of map task elements, and chunkInputPtrs are inputs passed to the executor.
+        // Note: Values are held by pointers because executor info is moved while the task is running.
+        std::size_t chunkBegin = 0;
+        std::size_t chunkEnd = 0;
+        std::size_t chunkFailedAttempts = 0;    // Previous failed attempts to process the map task chunk
+        std::unique_ptr<boost::any> chunkInput;
+        std::vector<const boost::any*> chunkInputPtrs;
     };
     struct ResourceInfo
     {
@@ -172,11 +494,42 @@ private:
 
     sync::ThreadNotifier m_taskCompletionNotifier;
     std::map<int, ResourceInfo> m_resourceInfo;
+    std::size_t m_executorCount = 0;
+    TaskDispatchPolicy m_dispatchPolicy = TaskDispatchPolicy::FirstAvailable;
+
+    // Speculation is only started for task functions having at least this number
+    // of duration samples
+    static constexpr std::size_t MinSpeculationSamples = 3;
+
+    double m_speculationFactor = 0;
+    std::chrono::milliseconds m_speculationCheckInterval;
+    std::map<int, TaskLatencyStats> m_latencyStats;   // key = taskFuncId
+
+    // Number of running tasks whose outputs are to be discarded
+    std::size_t m_discardedTaskCount = 0;
+
+    TaskRetryPolicy m_retryPolicy;
+    struct Retry {
+        std::size_t taskId;
+        std::chrono::steady_clock::time_point time;
+    };
+    std::vector<Retry> m_retries;
+    std::unordered_map<std::size_t, std::size_t> m_failedAttempts;  // key = taskId
+    std::size_t m_failedTaskId = ~0;    // Task that has failed too many times
 
     struct Cache
     {
+        // Graph with composite tasks expanded, or null if there are no composite tasks
+        std::shared_ptr<TaskGraph> expandedTaskGraph;
+
         std::vector<std::size_t> roots; // taskIds of tasks with all inputs initially available
-        std::multimap<OutputEndPoint, InputEndPoint> o2i;
+
+        // Inputs connected to task output with index i in dataPtrs are
+        // consumers[consumerIndex[i]], ..., consumers[consumerIndex[i+1]-1],
+        // ordered by taskId and inputPort
+        std::vector<std::size_t> consumerIndex;
+        std::vector<InputEndPoint> consumers;
+
         std::size_t totalOutputCount = 0;
         // index=taskId, value=number of inputs initially available
         std::vector<std::size_t> initAvailTaskInputs;
@@ -186,115 +539,678 @@ private:
         };
         std::vector<TaskIoDataIdx> taskIoDataIdx;   // index = taskId
 
+        // Index is as in dataPtrs, value = taskId of the task producing the input, or ~0
+        std::vector<std::size_t> inputSources;
+
+        // index=taskId, value=number of connections from task outputs
+        std::vector<std::size_t> initConsumerCounts;
+
+        // index=taskId, value=number of connections from task outputs to tasks not yet completed
+        mutable std::vector<std::size_t> consumerCounts;
+
         // index=taskId, value=number of inputs currently available
         mutable std::vector<std::size_t> availTaskInputs;
 
+        // index=taskId, value=number of inputs currently known to be dead (see TaskBranching)
+        mutable std::vector<std::size_t> deadTaskInputs;
+
+        mutable std::vector<TaskStatus> taskStatus;     // index = taskId
+
+        mutable detail::TaskGraphLoops loops;
+
         // Index is TaskGraph::TaskInfo::inputIndex + inputPort or
         // TaskGraph::TaskInfo::outputIndex + outputPort,
         // value = pointer to corresponding input/output value
         mutable std::vector<boost::any*> dataPtrs;
+
+        // Tasks of topological level i are levelTasks[levelIndex[i]], ..., levelTasks[levelIndex[i+1]-1];
+        // only computed in the level-synchronous mode
+        std::vector<std::size_t> levelIndex;
+        std::vector<std::size_t> levelTasks;
     };
 
     bool m_running = false;
+    std::atomic<bool> m_cancelRequested = false;    // See cancel()
+    bool m_cancelling = false;  // Cancellation is found, waiting for running tasks to finish
     TaskGraphExecutorStartParam m_startParam;
+    const TaskGraph *m_taskGraph = nullptr;    // Graph being run, with composite tasks expanded
+    const CompositeTaskRegistry *m_compositeTaskRegistry = nullptr;
     std::size_t m_totalComputedOutputCount = 0;
     const Cache *m_cache = nullptr;
 
     // Elements are taskIds of tasks with all inputs available, whose processing has not started yet.
     std::unordered_set<std::size_t> m_ready;
 
-    void startPriv(TaskGraphExecutorStartParam&& startParam)
+    // Amounts of resources held by running tasks, only for resources listed in TaskGraph::resourceCapacity
+    std::map<int, std::size_t> m_resourceUsage;
+
+    std::size_t m_memoryBudget = 0;
+    std::size_t m_memoryUsage = 0;  // Estimated, see setMemoryBudget()
+
+    std::chrono::milliseconds m_mapChunkDuration = std::chrono::milliseconds(10);
+    std::map<int, TaskLatencyStats> m_mapElementLatencyStats;  // key = taskFuncId
+
+    std::unordered_map<std::size_t, detail::MapTaskState> m_mapStates;  // key = taskId of a started map task
+
+    // key = taskId of a reduce task with available inputs
+    std::unordered_map<std::size_t, detail::ReduceTaskState> m_reduceStates;
+
+    // Cache is built by a single thread if there are less than this number of elements per thread
+    static constexpr std::size_t MinCacheBuildChunkSize = 1 << 14;
+    std::size_t m_cacheBuildThreadCount = 0;
+
+    bool m_levelSynchronous = false;
+    std::size_t m_level = 0;                    // Level being run in the level-synchronous mode
+    std::size_t m_levelRemainingTaskCount = 0;  // Tasks of m_level not yet completed
+
+    enum class StartMode { Start, Resume, Restart };
+
+    TaskGraphCheckpointParam m_checkpointParam;
+    std::unique_ptr<detail::TaskGraphCheckpointWriter> m_checkpointWriter;
+    std::exception_ptr m_checkpointError;
+    std::chrono::steady_clock::time_point m_nextCheckpointTime;
+    std::vector<bool> m_checkpointOutputs;  // index = index in dataPtrs; empty if all outputs are saved
+    std::vector<bool> m_checkpointedTasks;  // index = taskId; true if outputs are passed to the writer
+    std::vector<std::size_t> m_deferredOutputClears;   // Tasks whose consumed outputs are to be cleared
+
+    TaskExecutionLog *m_executionLog = nullptr;
+    std::chrono::steady_clock::time_point m_executionLogStartTime;
+    detail::TaskExecutionReplay m_replay;
+
+    // Throws an exception if a task demands more of a resource than its capacity
+    static void checkResourceDemands(const TaskGraph& g)
+    {
+        if (g.resourceCapacity.empty())
+            return;
+        for (std::size_t taskId=0, n=g.taskInfo.size(); taskId<n; ++taskId) {
+            forEachResourceDemand(g, taskId, [&](int resource, std::size_t amount) {
+                auto it = g.resourceCapacity.find(resource);
+                if (it != g.resourceCapacity.end() && amount > it->second)
+                    throw std::runtime_error(
+                        "TaskGraphExecutor: Task " + std::to_string(taskId) +
+                        " demands more of resource " + std::to_string(resource) + " than its capacity");
+            });
+        }
+    }
+
+    // args are passed to the constructor of TaskGraphExecutorStartParam::cb
+    template<class ... Args>
+    static TaskGraphExecutorStartParam makeStartParam(TaskGraph *taskGraph, boost::any& cache, Args&& ... args)
+    {
+        TaskGraphExecutorStartParam result;
+        result.taskGraph = taskGraph;
+        result.cache = &cache;
+        result.cb = Cb(std::forward<Args>(args)...);
+        return result;
+    }
+
+    void startPriv(TaskGraphExecutorStartParam&& startParam, StartMode mode, const TaskGraphFile *checkpoint = nullptr)
     {
         BOOST_ASSERT(!m_running);
+        auto mcache = &boost::any_cast<Cache&>(*startParam.cache);
+        auto cacheBuilt = !mcache->roots.empty();
+        if (!cacheBuilt)
+            mcache->expandedTaskGraph = expandCompositeTasks(*startParam.taskGraph);
+        else if (mcache->dataPtrs.empty() && mcache->taskIoDataIdx.size() != startParam.taskGraph->taskInfo.size())
+            throw std::runtime_error("TaskGraphExecutor: Cache does not match the graph");
+        const TaskGraph *taskGraph = mcache->expandedTaskGraph? mcache->expandedTaskGraph.get(): startParam.taskGraph;
+        checkResourceDemands(*taskGraph);
+        if (m_levelSynchronous)
+            checkLevelSynchronous(*taskGraph);
+        if (mode == StartMode::Resume && mcache->taskStatus.size() != taskGraph->taskInfo.size())
+            throw std::runtime_error("TaskGraphExecutor: There is no computation to resume");
+        if (mode == StartMode::Restart &&
+                checkpoint->section<TaskStatus>(TaskGraphFileSection::CheckpointTaskStatus).size() != taskGraph->taskInfo.size())
+            throw std::runtime_error("TaskGraphExecutor: Checkpoint does not match the graph");
+        checkCheckpointOutputs(*taskGraph);
+        if (m_replay.isEnabled())
+            checkReplayLog(*taskGraph);
         m_startParam = std::move(startParam);
+        m_taskGraph = taskGraph;
         BOOST_ASSERT(!m_cache);
         m_running = true;
+        m_cancelRequested = false;
+        m_replay.rewind();
+        if (m_executionLog) {
+            BOOST_ASSERT(m_executionLog != m_replay.log());
+            m_executionLog->clear();
+            m_executionLogStartTime = std::chrono::steady_clock::now();
+        }
         m_totalComputedOutputCount = 0;
-        auto mcache = &boost::any_cast<Cache&>(*m_startParam.cache);
         m_cache = mcache;
-        if (mcache->roots.empty()) {
-            // Build cache
+        if (!cacheBuilt)
+            buildCache(*mcache);
+        if (mcache->dataPtrs.empty()) {
+            // The cache is just built or loaded (see loadCache())
+            buildDataPtrs(*mcache);
+            mcache->loops.build(*m_taskGraph);
+        }
+        if (m_levelSynchronous && mcache->levelIndex.empty())
+            buildLevels(*mcache);
+
+        // Initialize cache mutable data
+        auto taskCount = m_taskGraph->taskInfo.size();
+        mcache->availTaskInputs = mcache->initAvailTaskInputs;
+        mcache->deadTaskInputs.assign(taskCount, 0);
+        mcache->consumerCounts = mcache->initConsumerCounts;
+        mcache->loops.reset(m_taskGraph->loops.size());
+
+        m_ready.clear();
+        if (mode == StartMode::Start) {
+            mcache->taskStatus.assign(taskCount, TaskStatus::Pending);
+            if (!m_levelSynchronous)
+                boost::range::copy(mcache->roots, std::inserter(m_ready, m_ready.end()));
+        }
+        else if (mode == StartMode::Resume)
+            resumeTasks(*mcache, nullptr);
+        else {
+            std::vector<bool> restoredOutputs;
+            try {
+                restoredOutputs = restoreCheckpoint(*mcache, *checkpoint);
+            }
+            catch(...) {
+                setNonRunningState();
+                throw;
+            }
+            resumeTasks(*mcache, &restoredOutputs);
+        }
+        startCheckpoints();
+        if (m_levelSynchronous) {
+            m_level = 0;
+            enqueueLevel();
+        }
+
+        // Start all or part of ready tasks
+        startNextTasks();
+        if (m_totalComputedOutputCount == mcache->totalOutputCount)
+            // Nothing to compute, e.g., all tasks have completed while the computation was being cancelled;
+            // the computation finishes in propagateCb()
+            m_taskCompletionNotifier.notify_all();
+    }
 
-            auto taskCount = m_startParam.taskGraph->taskInfo.size();
+    // Prepares resuming the computation: tasks that have not completed or been skipped,
+    // and all tasks of unfinished loops, become pending, and receive outputs of other tasks.
+    // When restarting from a checkpoint, restoredOutputs flags outputs read from it (see rerunTasks()).
+    void resumeTasks(Cache& c, const std::vector<bool> *restoredOutputs)
+    {
+        auto& g = *m_taskGraph;
+        auto& status = c.taskStatus;
+        auto finished = [&](std::size_t taskId) {
+            return status[taskId] == TaskStatus::Completed || status[taskId] == TaskStatus::Skipped;
+        };
+        for (auto& loop : g.loops)
+            if (!std::all_of(loop.tasks.begin(), loop.tasks.end(), finished))
+                for (auto taskId : loop.tasks)
+                    status[taskId] = TaskStatus::Pending;
+        std::replace(status.begin(), status.end(), TaskStatus::Cancelled, TaskStatus::Pending);
+        if (restoredOutputs)
+            rerunTasks(c, *restoredOutputs);
 
-            // Compute i2o and o2i maps
-            BOOST_ASSERT(mcache->o2i.empty());
-            std::map<InputEndPoint, OutputEndPoint> i2o;
-            for (auto& c : m_startParam.taskGraph->connections) {
-                i2o[c.to] = c.from;
-                mcache->o2i.insert({c.from, c.to});
+        for (std::size_t taskId=0, n=g.taskInfo.size(); taskId<n; ++taskId) {
+            if (!finished(taskId))
+                continue;
+            auto& ti = g.taskInfo[taskId];
+            m_totalComputedOutputCount += ti.task.outputCount;
+            auto d = c.dataPtrs.data() + c.taskIoDataIdx[taskId].outputIndex;
+            for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+                auto dead = status[taskId] == TaskStatus::Skipped ||
+                        (ti.branching == TaskBranching::Switch && d[outputPort]->empty());
+                for (auto& input : consumersOf(taskId, outputPort)) {
+                    if (finished(input.taskId))
+                        --c.consumerCounts[taskId];
+                    else if (dead)
+                        ++c.deadTaskInputs[input.taskId];
+                    else {
+                        ++c.availTaskInputs[input.taskId];
+                        if (isReduceTask(input.taskId) && !m_levelSynchronous)
+                            addReduceInput(input.taskId, input.inputPort);
+                    }
+                }
             }
+            if (m_memoryBudget > 0 && c.consumerCounts[taskId] > 0)
+                m_memoryUsage += ti.outputFootprint;
+        }
 
-            // Compute roots, initAvailTaskInputs, totalOutputCount,
-            // taskIoDataIdx, and dataPtrs
-            mcache->initAvailTaskInputs.resize(taskCount);
-            mcache->taskIoDataIdx.resize(taskCount);
-            mcache->dataPtrs.resize(m_startParam.taskGraph->dataMap.size());
-            std::size_t idataPtrs = 0;
-            BOOST_ASSERT(mcache->totalOutputCount == 0);
-            for (std::size_t taskId=0; taskId<taskCount; ++taskId) {
-                // Compute available inputs
-                auto& ti = m_startParam.taskGraph->taskInfo[taskId];
-                std::size_t availInputCount = 0;
-                for (std::size_t inputPort=0; inputPort<ti.task.inputCount; ++inputPort)
-                    if (i2o.find({taskId, inputPort}) == i2o.end())
-                        ++availInputCount;
-                mcache->initAvailTaskInputs[taskId] = availInputCount;
+        if (m_levelSynchronous)
+            return;
+        std::vector<std::size_t> skipped;
+        for (std::size_t taskId=0, n=g.taskInfo.size(); taskId<n; ++taskId)
+            if (!finished(taskId))
+                checkTaskInputs(taskId, skipped);
+        while (!skipped.empty()) {
+            auto taskId = skipped.back();
+            skipped.pop_back();
+            skipTask(taskId, skipped);
+        }
+    }
 
-                // Make root if all inputs are available
-                if (availInputCount == ti.task.inputCount)
-                    mcache->roots.push_back(taskId);
+    // Reads status of tasks and saved outputs from the checkpoint; returns flags of restored outputs,
+    // index = index in dataPtrs
+    std::vector<bool> restoreCheckpoint(Cache& c, const TaskGraphFile& checkpoint) const
+    {
+        auto& g = *m_taskGraph;
+        auto status = checkpoint.section<TaskStatus>(TaskGraphFileSection::CheckpointTaskStatus);
+        c.taskStatus.assign(status.begin(), status.end());
+        auto data = checkpoint.section<char>(TaskGraphFileSection::CheckpointOutputData);
+        std::vector<bool> result(c.dataPtrs.size());
+        for (auto& o : checkpoint.section<TaskGraphFileCheckpointOutput>(TaskGraphFileSection::CheckpointOutputs)) {
+            auto valid =
+                    o.output.taskId < g.taskInfo.size() &&
+                    o.output.outputPort < g.taskInfo[o.output.taskId].task.outputCount &&
+                    o.offset <= data.size() && o.size <= data.size() - o.offset;
+            if (!valid)
+                throw std::runtime_error("TaskGraphExecutor: Invalid output in checkpoint");
+            auto index = c.taskIoDataIdx[o.output.taskId].outputIndex + o.output.outputPort;
+            if (o.codecId == TaskGraphFileCheckpointOutput::EmptyValue)
+                *c.dataPtrs[index] = boost::any();
+            else {
+                auto codec = m_checkpointParam.codecs? m_checkpointParam.codecs->find(o.codecId): nullptr;
+                if (!codec)
+                    throw std::runtime_error("TaskGraphExecutor: No codec with id " + std::to_string(o.codecId));
+                *c.dataPtrs[index] = codec->decode(data.begin() + o.offset, static_cast<std::size_t>(o.size));
+            }
+            result[index] = true;
+        }
+        return result;
+    }
 
-                // Update total output count
-                mcache->totalOutputCount += ti.task.outputCount;
+    // Makes completed tasks pending if their outputs are needed by pending tasks or have no consumers,
+    // but have not been restored from a checkpoint; then, the same is done for tasks providing their inputs.
+    void rerunTasks(Cache& c, const std::vector<bool>& restoredOutputs)
+    {
+        auto& g = *m_taskGraph;
+        auto& status = c.taskStatus;
+        auto needsRerun = [&](std::size_t taskId) {
+            if (status[taskId] != TaskStatus::Completed)
+                return false;
+            auto outputIndex = c.taskIoDataIdx[taskId].outputIndex;
+            for (std::size_t outputPort=0; outputPort<g.taskInfo[taskId].task.outputCount; ++outputPort) {
+                if (restoredOutputs[outputIndex + outputPort])
+                    continue;
+                auto consumers = consumersOf(taskId, outputPort);
+                auto needed = consumers.empty() || std::any_of(consumers.begin(), consumers.end(), [&](const InputEndPoint& input) {
+                    return status[input.taskId] == TaskStatus::Pending;
+                });
+                if (needed)
+                    return true;
+            }
+            return false;
+        };
+        std::vector<std::size_t> rerun;     // Tasks made pending, whose inputs are to be checked
+        for (std::size_t taskId=0, n=g.taskInfo.size(); taskId<n; ++taskId)
+            if (needsRerun(taskId))
+                rerun.push_back(taskId);
+        for (auto taskId : rerun)
+            status[taskId] = TaskStatus::Pending;
+        while (!rerun.empty()) {
+            auto taskId = rerun.back();
+            rerun.pop_back();
+            auto makePending = [&](std::size_t id) {
+                status[id] = TaskStatus::Pending;
+                rerun.push_back(id);
+            };
+            if (c.loops.isLoopTask(taskId))
+                for (auto loopTaskId : g.loops[c.loops.loopOf(taskId)].tasks)
+                    if (status[loopTaskId] == TaskStatus::Completed)
+                        makePending(loopTaskId);
+            auto sources = c.inputSources.data() + c.taskIoDataIdx[taskId].inputIndex;
+            for (std::size_t inputPort=0; inputPort<g.taskInfo[taskId].task.inputCount; ++inputPort) {
+                auto source = sources[inputPort];
+                if (source != ~std::size_t(0) && needsRerun(source))
+                    makePending(source);
+            }
+        }
+    }
 
-                // Initialize taskIoDataIdx and dataPtrs
-                mcache->taskIoDataIdx[taskId].inputIndex = idataPtrs;
+    // Enqueues pending tasks of the first level, starting from m_level, that has them
+    void enqueueLevel()
+    {
+        auto& c = *m_cache;
+        for (; m_level + 1 < c.levelIndex.size(); ++m_level) {
+            m_levelRemainingTaskCount = 0;
+            for (auto i=c.levelIndex[m_level]; i<c.levelIndex[m_level+1]; ++i) {
+                auto taskId = c.levelTasks[i];
+                if (c.taskStatus[taskId] == TaskStatus::Pending) {
+                    m_ready.insert(taskId);
+                    ++m_levelRemainingTaskCount;
+                }
+            }
+            if (m_levelRemainingTaskCount > 0)
+                return;
+        }
+    }
+
+    // Returns the number of chunks to split size elements into when building the cache
+    std::size_t cacheBuildChunkCount(std::size_t size) const
+    {
+        std::size_t threadCount = m_cacheBuildThreadCount;
+        if (threadCount == 0)
+            threadCount = std::thread::hardware_concurrency();
+        return std::max<std::size_t>(1, std::min(threadCount, size / MinCacheBuildChunkSize));
+    }
+
+    // Calls f(chunk, begin, end) for chunkCount chunks of range [0, size), each in a separate thread
+    template<class F>
+    static void forEachChunk(std::size_t size, std::size_t chunkCount, F f)
+    {
+        auto chunkBegin = [&](std::size_t chunk) {
+            return size / chunkCount * chunk + std::min(chunk, size % chunkCount);
+        };
+        std::vector<std::thread> threads;
+        for (std::size_t chunk=1; chunk<chunkCount; ++chunk)
+            threads.emplace_back(f, chunk, chunkBegin(chunk), chunkBegin(chunk+1));
+        f(0, 0, chunkBegin(1));
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    // Replaces elements of v with their partial sums
+    static void partialSum(std::vector<std::size_t>& v, std::size_t chunkCount)
+    {
+        std::vector<std::size_t> chunkSums(chunkCount);
+        forEachChunk(v.size(), chunkCount, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            std::partial_sum(v.begin() + begin, v.begin() + end, v.begin() + begin);
+            chunkSums[chunk] = begin == end? 0: v[end-1];
+        });
+        if (chunkCount == 1)
+            return;
+        std::partial_sum(chunkSums.begin(), chunkSums.end(), chunkSums.begin());
+        forEachChunk(v.size(), chunkCount, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            if (chunk > 0)
+                for (auto i=begin; i<end; ++i)
+                    v[i] += chunkSums[chunk-1];
+        });
+    }
+
+    // Computes the part of the cache that does not depend on the location of graph data.
+    // Large graphs are processed in parallel (see setCacheBuildThreadCount());
+    // the result does not depend on the number of threads.
+    void buildCache(Cache& c) const
+    {
+        auto& g = *m_taskGraph;
+        auto taskCount = g.taskInfo.size();
+        auto connectionCount = g.connections.size();
+        auto taskChunkCount = cacheBuildChunkCount(taskCount);
+        auto connectionChunkCount = cacheBuildChunkCount(connectionCount);
+
+        // Compute taskIoDataIdx and totalOutputCount
+        std::vector<std::size_t> ioDataIdx(taskCount + 1, 0);
+        forEachChunk(taskCount, taskChunkCount, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (auto taskId=begin; taskId<end; ++taskId) {
+                auto& task = g.taskInfo[taskId].task;
+                ioDataIdx[taskId+1] = task.inputCount + task.outputCount;
+            }
+        });
+        partialSum(ioDataIdx, taskChunkCount);
+        auto ioCount = ioDataIdx.back();
+        auto ioChunkCount = cacheBuildChunkCount(ioCount);
+        c.taskIoDataIdx.resize(taskCount);
+        std::vector<std::size_t> chunkOutputCounts(taskChunkCount, 0);
+        forEachChunk(taskCount, taskChunkCount, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            for (auto taskId=begin; taskId<end; ++taskId) {
+                auto& task = g.taskInfo[taskId].task;
+                auto& idx = c.taskIoDataIdx[taskId];
+                idx.inputIndex = ioDataIdx[taskId];
+                idx.outputIndex = idx.inputIndex + task.inputCount;
+                chunkOutputCounts[chunk] += task.outputCount;
+            }
+        });
+        c.totalOutputCount = std::accumulate(chunkOutputCounts.begin(), chunkOutputCounts.end(), std::size_t(0));
+
+        // Compute inputSources and consumers
+        auto outputIndex = [&](const OutputEndPoint& from) {
+            return c.taskIoDataIdx[from.taskId].outputIndex + from.outputPort;
+        };
+        c.inputSources.assign(ioCount, ~std::size_t(0));
+        std::vector<std::atomic<std::size_t>> consumerCounters(ioCount);
+        forEachChunk(connectionCount, connectionChunkCount, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (auto i=begin; i<end; ++i) {
+                auto& conn = g.connections[i];
+                c.inputSources[c.taskIoDataIdx[conn.to.taskId].inputIndex + conn.to.inputPort] = conn.from.taskId;
+                consumerCounters[outputIndex(conn.from)].fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        c.consumerIndex.resize(ioCount + 1);
+        c.consumerIndex[0] = 0;
+        forEachChunk(ioCount, ioChunkCount, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (auto i=begin; i<end; ++i)
+                c.consumerIndex[i+1] = consumerCounters[i].load(std::memory_order_relaxed);
+        });
+        partialSum(c.consumerIndex, ioChunkCount);
+        forEachChunk(ioCount, ioChunkCount, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (auto i=begin; i<end; ++i)
+                consumerCounters[i].store(c.consumerIndex[i], std::memory_order_relaxed);
+        });
+        c.consumers.resize(connectionCount);
+        forEachChunk(connectionCount, connectionChunkCount, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (auto i=begin; i<end; ++i) {
+                auto& conn = g.connections[i];
+                c.consumers[consumerCounters[outputIndex(conn.from)].fetch_add(1, std::memory_order_relaxed)] = conn.to;
+            }
+        });
+        forEachChunk(ioCount, ioChunkCount, [&](std::size_t, std::size_t begin, std::size_t end) {
+            auto d = c.consumers.data();
+            for (auto i=begin; i<end; ++i)
+                if (c.consumerIndex[i+1] - c.consumerIndex[i] > 1)
+                    std::sort(d + c.consumerIndex[i], d + c.consumerIndex[i+1],
+                              [](const InputEndPoint& a, const InputEndPoint& b) {
+                        return a.taskId < b.taskId || (a.taskId == b.taskId && a.inputPort < b.inputPort);
+                    });
+        });
+
+        // Compute initAvailTaskInputs, initConsumerCounts, and roots
+        c.initAvailTaskInputs.resize(taskCount);
+        c.initConsumerCounts.resize(taskCount);
+        std::vector<std::vector<std::size_t>> chunkRoots(taskChunkCount);
+        forEachChunk(taskCount, taskChunkCount, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            for (auto taskId=begin; taskId<end; ++taskId) {
+                auto& task = g.taskInfo[taskId].task;
+                auto& idx = c.taskIoDataIdx[taskId];
+                auto sources = c.inputSources.begin() + idx.inputIndex;
+                auto avail = static_cast<std::size_t>(std::count(sources, sources + task.inputCount, ~std::size_t(0)));
+                c.initAvailTaskInputs[taskId] = avail;
+                c.initConsumerCounts[taskId] =
+                        c.consumerIndex[idx.outputIndex + task.outputCount] - c.consumerIndex[idx.outputIndex];
+                if (avail == task.inputCount)
+                    chunkRoots[chunk].push_back(taskId);
+            }
+        });
+        for (auto& roots : chunkRoots)
+            c.roots.insert(c.roots.end(), roots.begin(), roots.end());
+    }
+
+    // Index of dataPtrs is as in taskIoDataIdx
+    void buildDataPtrs(Cache& c) const
+    {
+        auto& g = *m_taskGraph;
+        auto taskCount = g.taskInfo.size();
+        c.dataPtrs.resize(c.inputSources.size());
+        forEachChunk(taskCount, cacheBuildChunkCount(taskCount), [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (auto taskId=begin; taskId<end; ++taskId) {
+                auto& ti = g.taskInfo[taskId];
+                auto& idx = c.taskIoDataIdx[taskId];
                 for (std::size_t inputPort=0; inputPort<ti.task.inputCount; ++inputPort)
-                    mcache->dataPtrs[idataPtrs++] =
-                            &m_startParam.taskGraph->data[m_startParam.taskGraph->dataMap[ti.inputIndex+inputPort]];
-                mcache->taskIoDataIdx[taskId].outputIndex = idataPtrs;
+                    c.dataPtrs[idx.inputIndex + inputPort] = dataPtr(ti.inputIndex + inputPort);
                 for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort)
-                    mcache->dataPtrs[idataPtrs++] =
-                            &m_startParam.taskGraph->data[m_startParam.taskGraph->dataMap[ti.outputIndex+outputPort]];
+                    c.dataPtrs[idx.outputIndex + outputPort] = dataPtr(ti.outputIndex + outputPort);
+            }
+        });
+    }
+
+    static void checkLevelSynchronous(const TaskGraph& g)
+    {
+        auto branching = std::any_of(g.taskInfo.begin(), g.taskInfo.end(), [](const TaskGraph::TaskInfo& ti) {
+            return ti.branching != TaskBranching::None;
+        });
+        if (branching || !g.loops.empty())
+            throw std::runtime_error(
+                "TaskGraphExecutor: Graphs with loops or branching tasks can't be run in the level-synchronous mode");
+    }
+
+    // Computes levelIndex and levelTasks: roots are at level 0, and other tasks
+    // are one level above the highest level of tasks providing their inputs
+    void buildLevels(Cache& c) const
+    {
+        auto& g = *m_taskGraph;
+        auto taskCount = g.taskInfo.size();
+        std::vector<std::size_t> remainingInputs(taskCount);
+        for (std::size_t taskId=0; taskId<taskCount; ++taskId)
+            remainingInputs[taskId] = g.taskInfo[taskId].task.inputCount - c.initAvailTaskInputs[taskId];
+        c.levelTasks.reserve(taskCount);
+        c.levelTasks = c.roots;
+        c.levelIndex.assign(1, 0);
+        for (std::size_t begin=0, end=c.levelTasks.size(); begin<end; begin=end, end=c.levelTasks.size()) {
+            c.levelIndex.push_back(end);
+            for (auto i=begin; i<end; ++i) {
+                auto taskId = c.levelTasks[i];
+                auto outputIndex = c.taskIoDataIdx[taskId].outputIndex;
+                auto consumerBegin = c.consumerIndex[outputIndex];
+                auto consumerEnd = c.consumerIndex[outputIndex + g.taskInfo[taskId].task.outputCount];
+                for (auto j=consumerBegin; j<consumerEnd; ++j) {
+                    auto consumerTaskId = c.consumers[j].taskId;
+                    if (--remainingInputs[consumerTaskId] == 0)
+                        c.levelTasks.push_back(consumerTaskId);
+                }
             }
-            mcache->availTaskInputs = mcache->initAvailTaskInputs;
         }
+        BOOST_ASSERT(c.levelTasks.size() == taskCount);
+    }
+
+    // Returns inputs connected to the output of the task
+    boost::iterator_range<const InputEndPoint*> consumersOf(std::size_t taskId, std::size_t outputPort) const
+    {
+        auto i = m_cache->taskIoDataIdx[taskId].outputIndex + outputPort;
+        auto d = m_cache->consumers.data();
+        return { d + m_cache->consumerIndex[i], d + m_cache->consumerIndex[i+1] };
+    }
+
+    // Returns the graph with composite tasks expanded, or null if g has no composite tasks
+    std::shared_ptr<TaskGraph> expandCompositeTasks(const TaskGraph& g) const
+    {
+        if (!m_compositeTaskRegistry)
+            return nullptr;
+        auto hasCompositeTasks = std::any_of(g.taskInfo.begin(), g.taskInfo.end(), [this](const TaskGraph::TaskInfo& ti) {
+            return m_compositeTaskRegistry->count(ti.task.taskFuncId) > 0;
+        });
+        if (!hasCompositeTasks)
+            return nullptr;
+        return std::make_shared<TaskGraph>(task_engine::expandCompositeTasks(g, *m_compositeTaskRegistry));
+    }
+
+    // Returns pointer to the data element at the specified index in dataMap of the graph being run
+    boost::any *dataPtr(std::size_t mapIndex) const
+    {
+        auto dataIndex = m_taskGraph->dataMap[mapIndex];
+        auto& g = *m_startParam.taskGraph;
+        if (dataIndex < g.data.size())
+            // Data of the original graph (see task_engine::expandCompositeTasks())
+            return &g.data[dataIndex];
         else
-            // Initialize cache mutable data
-            boost::range::copy(mcache->initAvailTaskInputs, mcache->availTaskInputs.begin());
+            return &m_cache->expandedTaskGraph->data[dataIndex];
+    }
 
-        m_ready.clear();
-        boost::range::copy(mcache->roots, std::inserter(m_ready, m_ready.end()));
+    bool isSpeculating() const {
+        return m_speculationFactor > 0;
+    }
 
-        // Start all or part of root tasks
-        startNextTasks();
+    // Returns true if the wait functions have to call propagateCb()
+    // at least each pollInterval(), even if no task completes
+    bool needsPolling() const {
+        return isSpeculating() || !m_retries.empty();
+    }
+
+    std::chrono::milliseconds pollInterval() const
+    {
+        using namespace std::chrono;
+        auto result = isSpeculating()? m_speculationCheckInterval: milliseconds::max();
+        if (!m_retries.empty()) {
+            auto nextRetryTime = std::min_element(
+                        m_retries.begin(), m_retries.end(),
+                        [](const Retry& a, const Retry& b) { return a.time < b.time; })->time;
+            auto untilRetry = duration_cast<milliseconds>(nextRetryTime - steady_clock::now()) + milliseconds(1);
+            result = std::min(result, std::max(untilRetry, milliseconds(1)));
+        }
+        return result;
+    }
+
+    void retryTask(std::size_t taskId)
+    {
+        retryTask(taskId, ++m_failedAttempts[taskId]);
+    }
+
+    // Schedules a retry of the task, or of its part, that has failed failedAttempts times,
+    // and returns the retry time; if there have been too many attempts, stops the computation.
+    std::chrono::steady_clock::time_point retryTask(std::size_t taskId, std::size_t failedAttempts)
+    {
+        if (m_cancelling)
+            // The task is left incomplete, so that it is run again on resume()
+            return std::chrono::steady_clock::time_point::max();
+        if (failedAttempts >= m_retryPolicy.maxAttempts) {
+            m_failedTaskId = taskId;
+            return std::chrono::steady_clock::time_point::max();
+        }
+        auto time = std::chrono::steady_clock::now() + m_retryPolicy.backoff(failedAttempts);
+        m_retries.push_back({ taskId, time });
+        return time;
+    }
+
+    // Makes tasks whose retry time has come ready
+    void startRetries()
+    {
+        auto currentTime = std::chrono::steady_clock::now();
+        auto it = std::remove_if(m_retries.begin(), m_retries.end(), [&](const Retry& retry) {
+            if (retry.time > currentTime)
+                return false;
+            // Failed parts of a map or reduce task may have been retried along with other parts
+            if (!isPartitionedTask(retry.taskId) || hasPendingParts(retry.taskId))
+                m_ready.insert(retry.taskId);
+            return true;
+        });
+        m_retries.erase(it, m_retries.end());
     }
 
     bool startNextTasks()
+    {
+        if (m_replay.isEnabled())
+            return startReplayedTasks();
+        if (m_memoryBudget > 0) {
+            // Start tasks releasing more memory first
+            std::vector<std::pair<std::ptrdiff_t, std::size_t>> gains;
+            gains.reserve(m_ready.size());
+            for (auto taskId : m_ready)
+                gains.emplace_back(memoryGain(taskId), taskId);
+            std::sort(gains.begin(), gains.end(), [](const auto& a, const auto& b) {
+                return a.first > b.first;
+            });
+            std::vector<std::size_t> ready(gains.size());
+            std::transform(gains.begin(), gains.end(), ready.begin(), [](const auto& x) { return x.second; });
+            return startNextTasks(ready);
+        }
+        else
+            return startNextTasks(m_ready);
+    }
+
+    template<class TaskIdRange>
+    bool startNextTasks(const TaskIdRange& ready)
     {
         // Start tasks
         std::vector<std::size_t> justStarted;
-        for (auto& taskId : m_ready) {
-            auto& ti = m_startParam.taskGraph->taskInfo[taskId];
+        for (auto& taskId : ready) {
+            auto& ti = m_taskGraph->taskInfo[taskId];
             auto it = m_resourceInfo.find(ti.task.resourceType);
             if (it == m_resourceInfo.end())
                 throw std::runtime_error("TaskGraphExecutor: No suitable resources are supplied");
             auto& ri = it->second;
-            if (ri.runningExecutorCount < ri.executorInfo.size()) {
-                // Start new task
-                auto& xi = ri.executorInfo[ri.runningExecutorCount];
-                xi.taskId = taskId;
-                auto d = m_cache->dataPtrs.data();
-                auto outputIndex = m_cache->taskIoDataIdx[taskId].outputIndex;
-                auto inputIndex = m_cache->taskIoDataIdx[taskId].inputIndex;
-                xi.executor->start(
-                        ti.task,
-                        { d+outputIndex, d+outputIndex+ti.task.outputCount },
-                        { d+inputIndex, d+inputIndex+ti.task.inputCount });
-                ++ri.runningExecutorCount;
-                justStarted.push_back(taskId);
+            if (isPartitionedTask(taskId)) {
+                // Pass parts to all idle executors; the task stays ready while it has pending parts
+                while (ri.runningExecutorCount < ri.executorInfo.size() && startTask(ri, taskId))
+                    if (!hasPendingParts(taskId)) {
+                        justStarted.push_back(taskId);
+                        break;
+                    }
             }
+            else if (ri.runningExecutorCount < ri.executorInfo.size() && startTask(ri, taskId))
+                justStarted.push_back(taskId);
         }
 
         // Remove started tasks from m_ready
@@ -304,10 +1220,972 @@ private:
         return !justStarted.empty();
     }
 
+    // Returns memory estimated to be released when the task completes minus memory it takes
+    std::ptrdiff_t memoryGain(std::size_t taskId) const
+    {
+        auto& g = *m_taskGraph;
+        auto& ti = g.taskInfo[taskId];
+        std::ptrdiff_t result = -static_cast<std::ptrdiff_t>(ti.outputFootprint + ti.scratchFootprint);
+        auto sources = m_cache->inputSources.data() + m_cache->taskIoDataIdx[taskId].inputIndex;
+        for (std::size_t inputPort=0; inputPort<ti.task.inputCount; ++inputPort) {
+            auto source = sources[inputPort];
+            if (source == ~std::size_t(0) ||
+                    std::find(sources, sources+inputPort, source) != sources+inputPort)
+                continue;
+            // Outputs of source are released if this task is their last consumer
+            auto connectionCount = static_cast<std::size_t>(
+                        std::count(sources+inputPort, sources+ti.task.inputCount, source));
+            if (m_cache->consumerCounts[source] == connectionCount)
+                result += static_cast<std::ptrdiff_t>(g.taskInfo[source].outputFootprint);
+        }
+        return result;
+    }
+
+    // Returns memory taken by the task when it starts; outputs of a loop, map, or reduce task are
+    // only accounted for once, when the task starts for the first time
+    std::size_t memoryTaken(std::size_t taskId) const
+    {
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        auto reduceState = m_reduceStates.find(taskId);
+        if ((isLoopTask(taskId) && m_cache->loops.startedIterations(taskId) > 0) ||
+                (isMapTask(taskId) && m_mapStates.count(taskId) > 0) ||
+                (reduceState != m_reduceStates.end() && reduceState->second.startedCombineCount() > 0))
+            return ti.scratchFootprint;
+        else
+            return ti.outputFootprint + ti.scratchFootprint;
+    }
+
+    bool fitsMemoryBudget(std::size_t taskId) const
+    {
+        if (m_memoryBudget == 0)
+            return true;
+        if (m_memoryUsage + memoryTaken(taskId) <= m_memoryBudget)
+            return true;
+        // Make progress even if the budget is exceeded
+        for (auto& resourceInfoItem : m_resourceInfo)
+            if (resourceInfoItem.second.runningExecutorCount > 0)
+                return false;
+        return true;
+    }
+
+    void acquireMemory(std::size_t taskId)
+    {
+        if (m_memoryBudget == 0)
+            return;
+        m_memoryUsage += memoryTaken(taskId);
+    }
+
+    // Called when an executor finishes the task; outputs are kept if the task is completed.
+    // Outputs of loop tasks are kept anyway, and inputs of loop tasks are released when the loop ends.
+    // Memory of map and reduce tasks is released when they complete.
+    void releaseMemory(std::size_t taskId, bool completed)
+    {
+        if (m_memoryBudget == 0)
+            return;
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        BOOST_ASSERT(m_memoryUsage >= ti.scratchFootprint);
+        m_memoryUsage -= ti.scratchFootprint;
+        if (isLoopTask(taskId) || isPartitionedTask(taskId))
+            return;
+        if (completed)
+            releaseInputs(taskId);
+        else {
+            BOOST_ASSERT(m_memoryUsage >= ti.outputFootprint);
+            m_memoryUsage -= ti.outputFootprint;
+        }
+    }
+
+    // Called when the task is skipped; its (empty) outputs are accounted
+    // as usual, so that they are released when their consumers finish
+    void skipMemory(std::size_t taskId)
+    {
+        if (m_memoryBudget == 0)
+            return;
+        m_memoryUsage += memoryTaken(taskId) - m_taskGraph->taskInfo[taskId].scratchFootprint;
+        releaseInputs(taskId);
+    }
+
+    // Releases outputs of tasks whose consumers have all completed or have been skipped
+    void releaseInputs(std::size_t taskId)
+    {
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        auto sources = m_cache->inputSources.data() + m_cache->taskIoDataIdx[taskId].inputIndex;
+        for (std::size_t inputPort=0; inputPort<ti.task.inputCount; ++inputPort) {
+            auto source = sources[inputPort];
+            if (source == ~std::size_t(0))
+                continue;
+            BOOST_ASSERT(m_cache->consumerCounts[source] > 0);
+            if (--m_cache->consumerCounts[source] == 0) {
+                auto& sti = m_taskGraph->taskInfo[source];
+                BOOST_ASSERT(m_memoryUsage >= sti.outputFootprint);
+                m_memoryUsage -= sti.outputFootprint;
+                if (!isSpeculating())
+                    clearConsumedOutputs(source);
+            }
+        }
+    }
+
+    void clearConsumedOutputs(std::size_t taskId)
+    {
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        auto d = m_cache->dataPtrs.data() + m_cache->taskIoDataIdx[taskId].outputIndex;
+        if (m_checkpointWriter && m_checkpointWriter->isWriting()) {
+            // The checkpoint writer might be reading the outputs
+            m_deferredOutputClears.push_back(taskId);
+            return;
+        }
+        for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+            if (!consumersOf(taskId, outputPort).empty())
+                *d[outputPort] = boost::any();
+        }
+    }
+
+    bool isCheckpointing() const {
+        return !m_checkpointParam.fileName.empty();
+    }
+
+    void checkCheckpointOutputs(const TaskGraph& g) const
+    {
+        if (!isCheckpointing())
+            return;
+        for (auto& o : m_checkpointParam.outputs)
+            if (o.taskId >= g.taskInfo.size() || o.outputPort >= g.taskInfo[o.taskId].task.outputCount)
+                throw std::runtime_error(
+                    "TaskGraphExecutor: Invalid checkpoint output " + std::to_string(o.outputPort) +
+                    " of task " + std::to_string(o.taskId));
+    }
+
+    // Called when the computation starts
+    void startCheckpoints()
+    {
+        if (!isCheckpointing())
+            return;
+        if (!m_checkpointWriter)
+            m_checkpointWriter = std::make_unique<detail::TaskGraphCheckpointWriter>();
+        m_checkpointWriter->reset();
+        m_checkpointedTasks.assign(m_taskGraph->taskInfo.size(), false);
+        m_checkpointOutputs.clear();
+        if (!m_checkpointParam.outputs.empty()) {
+            m_checkpointOutputs.resize(m_cache->dataPtrs.size());
+            for (auto& o : m_checkpointParam.outputs)
+                m_checkpointOutputs[m_cache->taskIoDataIdx[o.taskId].outputIndex + o.outputPort] = true;
+        }
+        m_nextCheckpointTime = std::chrono::steady_clock::now() + m_checkpointParam.interval;
+    }
+
+    // Called as tasks complete; starts writing a checkpoint if it is time to
+    void checkpoint()
+    {
+        if (!isCheckpointing())
+            return;
+        auto& w = *m_checkpointWriter;
+        if (w.isWriting()) {
+            if (!w.isFinished())
+                return;
+            joinCheckpointWriter();
+        }
+        if (m_checkpointError || std::chrono::steady_clock::now() < m_nextCheckpointTime)
+            return;
+        w.start(takeCheckpointSnapshot(), m_checkpointParam);
+        m_nextCheckpointTime = std::chrono::steady_clock::now() + m_checkpointParam.interval;
+    }
+
+    void joinCheckpointWriter()
+    {
+        if (auto error = m_checkpointWriter->join())
+            m_checkpointError = error;
+        for (auto taskId : m_deferredOutputClears)
+            clearConsumedOutputs(taskId);
+        m_deferredOutputClears.clear();
+    }
+
+    // Called when the computation stops; waits for the checkpoint being written and, if final is true,
+    // writes the last one. Returns the error of writing checkpoints, if any.
+    std::exception_ptr finishCheckpoints(bool final)
+    {
+        if (!isCheckpointing())
+            return nullptr;
+        if (m_checkpointWriter->isWriting())
+            joinCheckpointWriter();
+        if (final && !m_checkpointError)
+            m_checkpointError = m_checkpointWriter->write(takeCheckpointSnapshot(), m_checkpointParam);
+        m_deferredOutputClears.clear();
+        auto result = m_checkpointError;
+        m_checkpointError = nullptr;
+        return result;
+    }
+
+    // Returns task status and outputs of tasks completed since the previous checkpoint
+    detail::TaskGraphCheckpointWriter::Snapshot takeCheckpointSnapshot()
+    {
+        auto& c = *m_cache;
+        detail::TaskGraphCheckpointWriter::Snapshot result;
+        result.taskStatus = c.taskStatus;
+        for (std::size_t taskId=0, n=c.taskStatus.size(); taskId<n; ++taskId) {
+            if (c.taskStatus[taskId] != TaskStatus::Completed || m_checkpointedTasks[taskId])
+                continue;
+            m_checkpointedTasks[taskId] = true;
+            auto& ti = m_taskGraph->taskInfo[taskId];
+            auto outputIndex = c.taskIoDataIdx[taskId].outputIndex;
+            for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+                auto index = outputIndex + outputPort;
+                if (!m_checkpointOutputs.empty() && !m_checkpointOutputs[index])
+                    continue;
+                const boost::any *value = c.dataPtrs[index];
+                if (value->empty()) {
+                    // Only save dead outputs of switch tasks; other empty outputs have been cleared
+                    // after their consumers completed (see setMemoryBudget())
+                    if (ti.branching != TaskBranching::Switch || (m_memoryBudget > 0 && c.consumerCounts[taskId] == 0))
+                        continue;
+                    value = nullptr;
+                }
+                result.newOutputs.push_back({ { taskId, outputPort }, value });
+            }
+        }
+        return result;
+    }
+
+    // Calls f(resource, amount) for each resource demanded by the task
+    template<class F>
+    static void forEachResourceDemand(const TaskGraph& g, std::size_t taskId, F f)
+    {
+        auto& ti = g.taskInfo[taskId];
+        f(ti.task.resourceType, 1);
+        for (std::size_t i=0; i<ti.resourceDemandCount; ++i) {
+            auto& demand = g.resourceDemands[ti.resourceDemandIndex + i];
+            f(demand.resource, demand.amount);
+        }
+    }
+
+    // Returns false if the resources demanded by the task are not available
+    bool acquireResources(std::size_t taskId)
+    {
+        auto& capacity = m_taskGraph->resourceCapacity;
+        if (capacity.empty())
+            return true;
+        auto available = true;
+        forEachResourceDemand(*m_taskGraph, taskId, [&](int resource, std::size_t amount) {
+            auto it = capacity.find(resource);
+            if (it == capacity.end())
+                return;
+            auto& usage = m_resourceUsage[resource];
+            usage += amount;
+            if (usage > it->second)
+                available = false;
+        });
+        if (!available)
+            releaseResources(taskId);
+        return available;
+    }
+
+    void releaseResources(std::size_t taskId)
+    {
+        auto& capacity = m_taskGraph->resourceCapacity;
+        if (capacity.empty())
+            return;
+        forEachResourceDemand(*m_taskGraph, taskId, [&](int resource, std::size_t amount) {
+            if (capacity.count(resource) == 0)
+                return;
+            auto& usage = m_resourceUsage[resource];
+            BOOST_ASSERT(usage >= amount);
+            usage -= amount;
+        });
+    }
+
+    // Returns executor that has started the task, or nullptr if there are
+    // idle executors, but none of them is alive, or resources demanded by the task are not available.
+    // The executor is selected according to the dispatch policy, unless its index in ri.executorInfo is given.
+    ExecutorInfo *startTask(ResourceInfo& ri, std::size_t taskId, std::size_t ix = ~std::size_t(0))
+    {
+        BOOST_ASSERT(ri.runningExecutorCount < ri.executorInfo.size());
+        if (ix == ~std::size_t(0))
+            ix = selectIdleExecutor(
+                        m_dispatchPolicy, ri.runningExecutorCount, ri.executorInfo.size(),
+                        [&ri](std::size_t i) -> auto& { return *ri.executorInfo[i].executor; });
+        if (ix == ri.executorInfo.size()) {
+            if (ri.runningExecutorCount > 0)
+                // Wait for a running executor
+                return nullptr;
+            else
+                // No executor is known to be alive, so probe any of them
+                ix = 0;
+        }
+        if (!fitsMemoryBudget(taskId) || !acquireResources(taskId))
+            return nullptr;
+        acquireMemory(taskId);
+        startLoopIteration(taskId);
+        if (ix != ri.runningExecutorCount)
+            std::swap(ri.executorInfo[ix], ri.executorInfo[ri.runningExecutorCount]);
+        auto& xi = ri.executorInfo[ri.runningExecutorCount];
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        xi.taskId = taskId;
+        auto d = m_cache->dataPtrs.data();
+        auto inputIndex = m_cache->taskIoDataIdx[taskId].inputIndex;
+        const_pany_range inputs = { d+inputIndex, d+inputIndex+ti.task.inputCount };
+        auto outputIndex = m_cache->taskIoDataIdx[taskId].outputIndex;
+        if (ti.branching == TaskBranching::Switch)
+            // Outputs left empty by the task are dead, so they must not keep values of previous runs
+            std::for_each(d+outputIndex, d+outputIndex+ti.task.outputCount, [](boost::any *x) { *x = boost::any(); });
+        if (ti.kind == TaskKind::Map)
+            startMapChunk(ri, xi, inputs);
+        else if (ti.kind == TaskKind::Reduce)
+            startReduceCombine(xi);
+        else if (isSpeculating()) {
+            // Outputs are written to the graph when the task completes,
+            // because another executor might start computing the same task
+            xi.startTime = std::chrono::steady_clock::now();
+            xi.outputs.assign(ti.task.outputCount, boost::any());
+            xi.outputPtrs.resize(ti.task.outputCount);
+            for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort)
+                xi.outputPtrs[outputPort] = &xi.outputs[outputPort];
+            auto o = xi.outputPtrs.data();
+            xi.executor->start(ti.task, { o, o+ti.task.outputCount }, inputs);
+        }
+        else
+            xi.executor->start(ti.task, { d+outputIndex, d+outputIndex+ti.task.outputCount }, inputs);
+        ++ri.runningExecutorCount;
+        logTaskStart(xi);
+        return &xi;
+    }
+
+    std::int64_t executionLogTime() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - m_executionLogStartTime).count();
+    }
+
+    void logTaskStart(ExecutorInfo& xi)
+    {
+        if (!m_executionLog)
+            return;
+        auto partitioned = isPartitionedTask(xi.taskId);
+        xi.logRecord = m_executionLog->size();
+        m_executionLog->push_back({
+            xi.taskId, xi.executorIndex,
+            partitioned? xi.chunkBegin: 0, partitioned? xi.chunkEnd: 0,
+            executionLogTime(), 0, TaskExecutionOutcome::Completed, 0 });
+    }
+
+    void logTaskFinish(const ExecutorInfo& xi)
+    {
+        if (!m_executionLog)
+            return;
+        auto& record = (*m_executionLog)[xi.logRecord];
+        record.finishTime = executionLogTime();
+        if (xi.discardOutputs || xi.cancelled)
+            record.outcome = TaskExecutionOutcome::Discarded;
+        else if (xi.executor->taskFailed())
+            record.outcome = TaskExecutionOutcome::Failed;
+    }
+
+    // Throws an exception if the replayed log refers to tasks or executors that don't exist
+    void checkReplayLog(const TaskGraph& g) const
+    {
+        if (isSpeculating())
+            throw std::runtime_error("TaskGraphExecutor: Speculation can't be enabled in the replay mode");
+        std::vector<int> resourceTypes(m_executorCount);
+        for (auto& resourceInfoItem : m_resourceInfo)
+            for (auto& xi : resourceInfoItem.second.executorInfo)
+                resourceTypes[xi.executorIndex] = resourceInfoItem.first;
+        m_replay.check(g, resourceTypes);
+    }
+
+    // Starts tasks in the order of the replayed log, each on the executor that has run it
+    bool startReplayedTasks()
+    {
+        auto started = false;
+        while (auto next = m_replay.next()) {
+            auto& record = *next;
+            auto taskId = static_cast<std::size_t>(record.taskId);
+            auto combineAdded = false;
+            if (isReduceTask(taskId)?
+                    !prepareReplayedCombine(taskId, record, combineAdded):
+                    m_ready.count(taskId) == 0 || !isReplayedChunkDue(taskId, record))
+                break;
+            auto& ri = m_resourceInfo.at(m_taskGraph->taskInfo[taskId].task.resourceType);
+            auto ix = ri.runningExecutorCount;
+            while (ix < ri.executorInfo.size() && ri.executorInfo[ix].executorIndex != record.executorIndex)
+                ++ix;
+            if (ix == ri.executorInfo.size())
+                // The executor is busy
+                break;
+            m_replay.beginStart();
+            auto xi = startTask(ri, taskId, ix);
+            m_replay.endStart(xi != nullptr);
+            if (!xi) {
+                if (combineAdded)
+                    removeReplayedCombine(taskId);
+                break;
+            }
+            started = true;
+            if (!isPartitionedTask(taskId) || !hasPendingParts(taskId))
+                m_ready.erase(taskId);
+        }
+        return started;
+    }
+
+    // Returns false if the replayed record retries a failed chunk of a map task before its retry time
+    bool isReplayedChunkDue(std::size_t taskId, const TaskExecutionLogRecord& record) const
+    {
+        auto it = m_mapStates.find(taskId);
+        return it == m_mapStates.end() || !it->second.isChunkDelayed(record.partBegin, record.partEnd);
+    }
+
+    // Returns true if the reduce task can combine the segments of the replayed record;
+    // makes them the next pending combine of the task, setting added if the combine was not pending before
+    bool prepareReplayedCombine(std::size_t taskId, const TaskExecutionLogRecord& record, bool& added)
+    {
+        if (m_reduceStates.count(taskId) == 0 && m_ready.count(taskId) == 0)
+            return false;
+        // Note: The state of a ready reduce task with no connected inputs is created here
+        auto& state = reduceState(taskId);
+        detail::ReduceTaskState::Combine combine(record.partBegin, record.partEnd);
+        if (state.isCombinePending(combine)) {
+            // A failed combine is retried once its backoff has elapsed
+            if (std::any_of(m_retries.begin(), m_retries.end(), [&](const Retry& retry) {
+                    return retry.taskId == taskId; }))
+                return false;
+            state.moveCombineLast(combine);
+            return true;
+        }
+        added = state.addCombine(combine);
+        return added;
+    }
+
+    // Undoes prepareReplayedCombine() that has added a combine which could not start
+    void removeReplayedCombine(std::size_t taskId) {
+        m_reduceStates.at(taskId).removeLastCombine();
+    }
+
+    // Returns true if the replayed computation has not finished, but no task is running or waits for a retry,
+    // so none can start
+    bool isReplayStuck() const
+    {
+        if (!m_retries.empty() ||
+                (m_totalComputedOutputCount == m_cache->totalOutputCount && m_discardedTaskCount == 0))
+            return false;
+        return std::all_of(m_resourceInfo.begin(), m_resourceInfo.end(), [](const auto& resourceInfoItem) {
+            return resourceInfoItem.second.runningExecutorCount == 0;
+        });
+    }
+
+    void completeTask(ExecutorInfo& xi)
+    {
+        auto& ti = m_taskGraph->taskInfo[xi.taskId];
+
+        if (isSpeculating() && !isPartitionedTask(xi.taskId)) {
+            // Move outputs to the graph and update latency statistics
+            auto d = m_cache->dataPtrs.data() + m_cache->taskIoDataIdx[xi.taskId].outputIndex;
+            for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort)
+                *d[outputPort] = std::move(xi.outputs[outputPort]);
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - xi.startTime;
+            m_latencyStats[ti.task.taskFuncId].add(duration.count());
+        }
+
+        if (isLoopTask(xi.taskId)) {
+            completeLoopIteration(xi.taskId);
+            return;
+        }
+
+        // Update the total number of computed outputs
+        m_totalComputedOutputCount += ti.task.outputCount;
+        m_cache->taskStatus[xi.taskId] = TaskStatus::Completed;
+
+        if (m_levelSynchronous) {
+            // Enqueue the next level once all tasks of the current level have completed
+            BOOST_ASSERT(m_levelRemainingTaskCount > 0);
+            if (--m_levelRemainingTaskCount == 0) {
+                ++m_level;
+                enqueueLevel();
+            }
+            return;
+        }
+
+        // Update input counters for connected tasks;
+        // enqueue next tasks, if any, and skip tasks on dead branches
+        std::vector<std::size_t> skipped;
+        auto d = m_cache->dataPtrs.data() + m_cache->taskIoDataIdx[xi.taskId].outputIndex;
+        for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+            auto dead = ti.branching == TaskBranching::Switch && d[outputPort]->empty();
+            for (auto& input : consumersOf(xi.taskId, outputPort))
+                resolveTaskInput(input, dead, skipped);
+        }
+        while (!skipped.empty()) {
+            auto taskId = skipped.back();
+            skipped.pop_back();
+            skipTask(taskId, skipped);
+        }
+    }
+
+    bool isMapTask(std::size_t taskId) const {
+        return m_taskGraph->taskInfo[taskId].kind == TaskKind::Map;
+    }
+
+    bool isReduceTask(std::size_t taskId) const {
+        return m_taskGraph->taskInfo[taskId].kind == TaskKind::Reduce;
+    }
+
+    // Returns true for map and reduce tasks, whose parts are run by different executors
+    bool isPartitionedTask(std::size_t taskId) const {
+        return m_taskGraph->taskInfo[taskId].kind != TaskKind::Plain;
+    }
+
+    // Returns true if parts of a started map or reduce task wait to be passed to executors
+    bool hasPendingParts(std::size_t taskId) const
+    {
+        if (isMapTask(taskId)) {
+            auto it = m_mapStates.find(taskId);
+            return it != m_mapStates.end() && it->second.hasPendingChunks();
+        }
+        auto it = m_reduceStates.find(taskId);
+        return it != m_reduceStates.end() && it->second.hasPendingCombines();
+    }
+
+    // Returns the number of elements in the next chunk of the map task
+    std::size_t mapChunkSize(const TaskGraph::TaskInfo& ti, std::size_t remaining, std::size_t executorCount) const
+    {
+        auto result = (remaining + 2*executorCount - 1) / (2*executorCount);
+        auto it = m_mapElementLatencyStats.find(ti.task.taskFuncId);
+        if (it == m_mapElementLatencyStats.end())
+            return std::min<std::size_t>(result, 1);
+        auto elementDuration = it->second.median();
+        std::chrono::duration<double> chunkDuration = m_mapChunkDuration;
+        if (elementDuration > 0 && chunkDuration.count() < elementDuration * static_cast<double>(result))
+            result = std::max<std::size_t>(1, static_cast<std::size_t>(chunkDuration.count() / elementDuration));
+        return result;
+    }
+
+    void startMapChunk(const ResourceInfo& ri, ExecutorInfo& xi, const const_pany_range& inputs)
+    {
+        auto taskId = xi.taskId;
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        auto collection = boost::any_cast<TaskCollection>(inputs[0]);
+        if (!collection)
+            throw std::runtime_error(
+                "TaskGraphExecutor: Input 0 of map task " + std::to_string(taskId) + " is not a TaskCollection");
+        auto& state = m_mapStates.try_emplace(taskId, collection->size()).first->second;
+        // Note: In the replay mode, a failed chunk is only replayed once its retry time has come
+        // (see isReplayedChunkDue())
+        auto chunk = state.startChunk(m_replay.startingRecord(), [&](std::size_t remaining) {
+            return mapChunkSize(ti, remaining, ri.executorInfo.size());
+        });
+        xi.chunkBegin = chunk.begin;
+        xi.chunkEnd = chunk.end;
+        xi.chunkFailedAttempts = chunk.failedAttempts;
+
+        auto elements = collection->begin();
+        xi.chunkInput = std::make_unique<boost::any>(TaskCollection(elements + xi.chunkBegin, elements + xi.chunkEnd));
+        xi.chunkInputPtrs.assign(inputs.begin(), inputs.end());
+        xi.chunkInputPtrs[0] = xi.chunkInput.get();
+        xi.outputs.assign(1, boost::any());
+        xi.outputPtrs.assign(1, xi.outputs.data());
+        xi.startTime = std::chrono::steady_clock::now();
+        auto in = xi.chunkInputPtrs.data();
+        auto out = xi.outputPtrs.data();
+        xi.executor->start(ti.task, { out, out+1 }, { in, in+xi.chunkInputPtrs.size() });
+    }
+
+    // Called when an executor finishes a chunk of a map task; completes the task after the last chunk
+    void finishMapChunk(ExecutorInfo& xi)
+    {
+        auto taskId = xi.taskId;
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        auto& state = m_mapStates.at(taskId);
+        xi.chunkInput.reset();
+        detail::MapTaskState::Chunk chunk{ xi.chunkBegin, xi.chunkEnd, xi.chunkFailedAttempts };
+        auto chunkSize = chunk.end - chunk.begin;
+        auto chunkResults = boost::any_cast<TaskCollection>(&xi.outputs[0]);
+        if (xi.executor->taskFailed() || !chunkResults || chunkResults->size() != chunkSize) {
+            // Attempts are counted for each chunk, so that failures of different chunks do not add up
+            state.failChunk(chunk, retryTask(taskId, chunk.failedAttempts + 1));
+            return;
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - xi.startTime;
+        if (chunkSize > 0)
+            m_mapElementLatencyStats[ti.task.taskFuncId].add(duration.count() / static_cast<double>(chunkSize));
+        auto finished = state.finishChunk(chunk, *chunkResults);
+        xi.outputs[0] = boost::any();
+        if (finished) {
+            *m_cache->dataPtrs[m_cache->taskIoDataIdx[taskId].outputIndex] = std::move(state.results());
+            m_mapStates.erase(taskId);
+            if (m_memoryBudget > 0)
+                releaseInputs(taskId);
+            completeTask(xi);
+        }
+    }
+
+    // Returns state of the reduce task; initially available inputs are added when the state is created.
+    // In the level-synchronous mode, all inputs are available by the time the task is started.
+    // In the replay mode, segments are combined as recorded (see prepareReplayedCombine()).
+    detail::ReduceTaskState& reduceState(std::size_t taskId)
+    {
+        auto it = m_reduceStates.find(taskId);
+        if (it != m_reduceStates.end())
+            return it->second;
+        auto inputCount = m_taskGraph->taskInfo[taskId].task.inputCount;
+        auto& state = m_reduceStates.try_emplace(taskId, inputCount, !m_replay.isEnabled()).first->second;
+        auto sources = m_cache->inputSources.data() + m_cache->taskIoDataIdx[taskId].inputIndex;
+        for (std::size_t inputPort=0; inputPort<inputCount; ++inputPort)
+            if (m_levelSynchronous || sources[inputPort] == ~std::size_t(0))
+                addReduceSegment(taskId, state, inputPort);
+        return state;
+    }
+
+    // Called when an input of the reduce task becomes available
+    void addReduceInput(std::size_t taskId, std::size_t inputPort) {
+        addReduceSegment(taskId, reduceState(taskId), inputPort);
+    }
+
+    void addReduceSegment(std::size_t taskId, detail::ReduceTaskState& state, std::size_t inputPort)
+    {
+        if (state.addInput(inputPort, m_cache->dataPtrs[m_cache->taskIoDataIdx[taskId].inputIndex + inputPort]))
+            m_ready.insert(taskId);
+    }
+
+    void startReduceCombine(ExecutorInfo& xi)
+    {
+        auto taskId = xi.taskId;
+        auto& state = reduceState(taskId);
+        std::tie(xi.chunkBegin, xi.chunkEnd) = state.startCombine();
+
+        xi.chunkInputPtrs = { state.segmentValue(xi.chunkBegin), state.segmentValue(xi.chunkEnd) };
+        xi.outputs.assign(1, boost::any());
+        xi.outputPtrs.assign(1, xi.outputs.data());
+        auto task = m_taskGraph->taskInfo[taskId].task;
+        task.inputCount = 2;
+        auto in = xi.chunkInputPtrs.data();
+        auto out = xi.outputPtrs.data();
+        xi.executor->start(task, { out, out+1 }, { in, in+2 });
+    }
+
+    // Called when an executor finishes combining two segments; completes the task
+    // once all inputs are combined
+    void finishReduceCombine(ExecutorInfo& xi)
+    {
+        auto taskId = xi.taskId;
+        auto& state = m_reduceStates.at(taskId);
+        detail::ReduceTaskState::Combine combine(xi.chunkBegin, xi.chunkEnd);
+        if (xi.executor->taskFailed()) {
+            state.failCombine(combine);
+            retryTask(taskId);
+            return;
+        }
+        if (state.finishCombine(combine, std::move(xi.outputs[0])))
+            m_ready.insert(taskId);
+        else if (state.isComplete()) {
+            *m_cache->dataPtrs[m_cache->taskIoDataIdx[taskId].outputIndex] = std::move(state.result());
+            m_reduceStates.erase(taskId);
+            if (m_memoryBudget > 0)
+                releaseInputs(taskId);
+            completeTask(xi);
+        }
+    }
+
+    // Called when the reduce task is skipped; it might have combined some of its inputs
+    void discardReduceTask(std::size_t taskId)
+    {
+        if (m_reduceStates.erase(taskId) == 0)
+            return;
+        m_ready.erase(taskId);
+        auto& ri = m_resourceInfo.at(m_taskGraph->taskInfo[taskId].task.resourceType);
+        for (std::size_t i=0; i<ri.runningExecutorCount; ++i) {
+            auto& xi = ri.executorInfo[i];
+            if (xi.taskId == taskId && !xi.discardOutputs) {
+                xi.discardOutputs = true;
+                ++m_discardedTaskCount;
+                xi.executor->cancelTask();
+            }
+        }
+    }
+
+    bool isLoopTask(std::size_t taskId) const {
+        return m_cache->loops.isLoopTask(taskId);
+    }
+
+    // Called when the task is started by an executor
+    void startLoopIteration(std::size_t taskId)
+    {
+        if (!isLoopTask(taskId) || !m_cache->loops.startIteration(taskId))
+            return;
+        // Pass outputs of the previous iteration to feedback inputs
+        for (auto& fc : m_cache->loops.feedbackInputs(taskId)) {
+            auto& from = m_taskGraph->taskInfo[fc.from.taskId];
+            auto& to = m_taskGraph->taskInfo[fc.to.taskId];
+            *dataPtr(to.inputIndex + fc.to.inputPort) = *dataPtr(from.outputIndex + fc.from.outputPort);
+        }
+    }
+
+    void completeLoopIteration(std::size_t taskId)
+    {
+        auto& loops = m_cache->loops;
+        auto loopIndex = loops.loopOf(taskId);
+        auto& loop = m_taskGraph->loops[loopIndex];
+        auto iteration = loops.completeIteration(taskId);
+        std::vector<std::size_t> skipped;
+
+        if (iteration == 0) {
+            // At the first iteration, loop tasks become ready as usual, once their inputs are available
+            auto& ti = m_taskGraph->taskInfo[taskId];
+            for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+                for (auto& input : consumersOf(taskId, outputPort))
+                    if (loops.loopOf(input.taskId) == loopIndex)
+                        resolveTaskInput(input, false, skipped);
+            }
+        }
+
+        if (taskId == loop.converged.taskId) {
+            auto& ti = m_taskGraph->taskInfo[taskId];
+            auto converged =
+                    iteration + 1 >= loop.maxIterationCount ||
+                    boost::any_cast<bool>(*dataPtr(ti.outputIndex + loop.converged.outputPort));
+            loops.setConverged(loopIndex, iteration, converged);
+            if (converged) {
+                for (auto loopTaskId : loop.tasks)
+                    if (loops.completedIterations(loopTaskId) == iteration + 1)
+                        finishLoopTask(loopTaskId, skipped);
+            }
+        }
+        else if (loops.isLastIteration(loopIndex, iteration))
+            finishLoopTask(taskId, skipped);
+
+        while (!skipped.empty()) {
+            auto skippedTaskId = skipped.back();
+            skipped.pop_back();
+            skipTask(skippedTaskId, skipped);
+        }
+
+        // Enqueue loop tasks that can start their next iteration
+        for (auto loopTaskId : loop.tasks)
+            if (loops.isNextIterationReady(loopTaskId))
+                m_ready.insert(loopTaskId);
+    }
+
+    // Called when the task has completed the last iteration of its loop
+    void finishLoopTask(std::size_t taskId, std::vector<std::size_t>& skipped)
+    {
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        m_totalComputedOutputCount += ti.task.outputCount;
+        m_cache->taskStatus[taskId] = TaskStatus::Completed;
+        if (m_memoryBudget > 0)
+            releaseInputs(taskId);
+        auto loop = m_cache->loops.loopOf(taskId);
+        for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+            for (auto& input : consumersOf(taskId, outputPort))
+                if (m_cache->loops.loopOf(input.taskId) != loop)
+                    resolveTaskInput(input, false, skipped);
+        }
+    }
+
+    // Called when an input of the task is computed or found to be dead;
+    // makes the task ready or appends it to skipped once all its inputs are known
+    void resolveTaskInput(const InputEndPoint& input, bool dead, std::vector<std::size_t>& skipped)
+    {
+        auto taskId = input.taskId;
+        if (m_cache->taskStatus[taskId] != TaskStatus::Pending)
+            // A task completed before restart consumes outputs of a task run again (see rerunTasks())
+            return;
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        if (ti.kind == TaskKind::Reduce && !dead)
+            addReduceInput(taskId, input.inputPort);
+        if (dead)
+            ++m_cache->deadTaskInputs[taskId];
+        else
+            ++m_cache->availTaskInputs[taskId];
+        checkTaskInputs(taskId, skipped);
+    }
+
+    // Makes the task ready or appends it to skipped if all its inputs are known
+    void checkTaskInputs(std::size_t taskId, std::vector<std::size_t>& skipped)
+    {
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        auto availInputCount = m_cache->availTaskInputs[taskId];
+        auto deadInputCount = m_cache->deadTaskInputs[taskId];
+        if (availInputCount + deadInputCount < ti.task.inputCount)
+            return;
+        auto skip = deadInputCount > 0 && (
+                    ti.branching != TaskBranching::Merge ||
+                    availInputCount == m_cache->initAvailTaskInputs[taskId]);
+        if (skip)
+            skipped.push_back(taskId);
+        else if (ti.kind != TaskKind::Reduce || m_reduceStates.count(taskId) == 0)
+            // Reduce tasks are ready when they have inputs to combine;
+            // a reduce task with no connected inputs finds them when it starts
+            m_ready.insert(taskId);
+    }
+
+    void skipTask(std::size_t taskId, std::vector<std::size_t>& skipped)
+    {
+        auto& ti = m_taskGraph->taskInfo[taskId];
+        m_totalComputedOutputCount += ti.task.outputCount;
+        m_cache->taskStatus[taskId] = TaskStatus::Skipped;
+        skipMemory(taskId);
+        if (ti.kind == TaskKind::Reduce)
+            discardReduceTask(taskId);
+        auto d = m_cache->dataPtrs.data() + m_cache->taskIoDataIdx[taskId].outputIndex;
+        for (std::size_t outputPort=0; outputPort<ti.task.outputCount; ++outputPort) {
+            *d[outputPort] = boost::any();
+            for (auto& input : consumersOf(taskId, outputPort))
+                resolveTaskInput(input, true, skipped);
+        }
+    }
+
+    // Marks the other copy of the task computed by xi as the one to discard
+    void discardDuplicate(ResourceInfo& ri, const ExecutorInfo& xi)
+    {
+        for (std::size_t i=0; i<ri.runningExecutorCount; ++i) {
+            auto& other = ri.executorInfo[i];
+            if (&other != &xi && other.taskId == xi.taskId && !other.discardOutputs) {
+                other.discardOutputs = true;
+                ++m_discardedTaskCount;
+                other.executor->cancelTask();
+                return;
+            }
+        }
+        BOOST_ASSERT(false);
+    }
+
+    // Makes the other copy of the task computed by xi the only one
+    void forgetDuplicate(ResourceInfo& ri, const ExecutorInfo& xi)
+    {
+        for (std::size_t i=0; i<ri.runningExecutorCount; ++i) {
+            auto& other = ri.executorInfo[i];
+            if (&other != &xi && other.taskId == xi.taskId && !other.discardOutputs) {
+                other.duplicated = false;
+                return;
+            }
+        }
+        BOOST_ASSERT(false);
+    }
+
+    // Starts duplicates of straggler tasks on idle executors
+    void startDuplicates()
+    {
+        auto currentTime = std::chrono::steady_clock::now();
+        for (auto& resourceInfoItem : m_resourceInfo) {
+            auto& ri = resourceInfoItem.second;
+            for (std::size_t i=0; i<ri.runningExecutorCount && ri.runningExecutorCount<ri.executorInfo.size(); ++i) {
+                auto& xi = ri.executorInfo[i];
+                if (xi.duplicated || xi.discardOutputs || isPartitionedTask(xi.taskId))
+                    continue;
+                auto& stats = m_latencyStats[m_taskGraph->taskInfo[xi.taskId].task.taskFuncId];
+                if (stats.sampleCount() < MinSpeculationSamples)
+                    continue;
+                std::chrono::duration<double> elapsed = currentTime - xi.startTime;
+                if (elapsed.count() > m_speculationFactor * stats.median()) {
+                    // Note: startTask() does not move running executors
+                    if (auto duplicate = startTask(ri, xi.taskId)) {
+                        xi.duplicated = true;
+                        duplicate->duplicated = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Processes tasks finished by executors; returns the number of executors still running tasks
+    std::size_t trackFinishedTasks()
+    {
+        std::size_t totalRunningExecutorCount = 0;
+        BOOST_ASSERT(m_totalComputedOutputCount <= m_cache->totalOutputCount);
+        for (auto& resourceInfoItem : m_resourceInfo) {
+            auto& ri = resourceInfoItem.second;
+            for (std::size_t i=0; i<ri.runningExecutorCount; ++i) {
+                auto& xi = ri.executorInfo[i];
+                if (xi.executor->propagateCb()) {
+                    // Executor has finished task
+                    logTaskFinish(xi);
+                    releaseResources(xi.taskId);
+                    releaseMemory(xi.taskId, !(xi.discardOutputs || xi.cancelled || xi.executor->taskFailed()));
+                    if (xi.discardOutputs) {
+                        // The task has already been computed by another executor
+                        BOOST_ASSERT(m_discardedTaskCount > 0);
+                        --m_discardedTaskCount;
+                    }
+                    else if (xi.cancelled)
+                        discardCancelledTask(xi);
+                    else if (isMapTask(xi.taskId))
+                        finishMapChunk(xi);
+                    else if (isReduceTask(xi.taskId))
+                        finishReduceCombine(xi);
+                    else if (xi.executor->taskFailed()) {
+                        if (xi.duplicated)
+                            // Leave the task to the other executor
+                            forgetDuplicate(ri, xi);
+                        else
+                            retryTask(xi.taskId);
+                    }
+                    else {
+                        if (xi.duplicated)
+                            discardDuplicate(ri, xi);
+                        completeTask(xi);
+                    }
+
+                    // Put the executor after the last currently executing one
+                    xi.taskId = ~0;
+                    xi.duplicated = false;
+                    xi.discardOutputs = false;
+                    xi.cancelled = false;
+                    xi.logRecord = ~0;
+                    BOOST_ASSERT(ri.runningExecutorCount > 0);
+                    --ri.runningExecutorCount;
+                    if (i != ri.runningExecutorCount) {
+                        BOOST_ASSERT(i < ri.runningExecutorCount);
+                        std::swap(xi, ri.executorInfo[ri.runningExecutorCount]);
+                        --i;
+                    }
+                }
+            }
+            totalRunningExecutorCount += ri.runningExecutorCount;
+        }
+        return totalRunningExecutorCount;
+    }
+
+    // Called when the computation is found to be cancelled: ready tasks are not started anymore,
+    // and running tasks are asked to stop
+    void startCancellation()
+    {
+        m_cancelling = true;
+        m_ready.clear();
+        m_retries.clear();
+        for (auto& resourceInfoItem : m_resourceInfo) {
+            auto& ri = resourceInfoItem.second;
+            for (std::size_t i=0; i<ri.runningExecutorCount; ++i) {
+                auto& xi = ri.executorInfo[i];
+                // Note: Tasks whose outputs are discarded are already cancelled, and tasks
+                // that can't be cancelled are left to complete, keeping their outputs.
+                if (!xi.discardOutputs && IsCancellable_v<TaskFunc>) {
+                    xi.cancelled = true;
+                    xi.executor->cancelTask();
+                }
+            }
+        }
+    }
+
+    // Called when an executor that was running a task at cancellation finishes
+    void discardCancelledTask(const ExecutorInfo& xi)
+    {
+        m_cache->taskStatus[xi.taskId] = TaskStatus::Cancelled;
+        if (isSpeculating() || isPartitionedTask(xi.taskId))
+            // Outputs have not been written to the graph
+            return;
+        auto& ti = m_taskGraph->taskInfo[xi.taskId];
+        auto d = m_cache->dataPtrs.data() + m_cache->taskIoDataIdx[xi.taskId].outputIndex;
+        std::for_each(d, d+ti.task.outputCount, [](boost::any *x) { *x = boost::any(); });
+    }
+
     void setNonRunningState()
     {
         m_running = false;
+        m_cancelling = false;
+        m_retries.clear();
+        m_failedAttempts.clear();
+        m_failedTaskId = ~0;
+        m_resourceUsage.clear();
+        m_memoryUsage = 0;
+        m_mapStates.clear();
+        m_reduceStates.clear();
         m_startParam = TaskGraphExecutorStartParam();
+        m_taskGraph = nullptr;
         m_cache = nullptr;
     }
 };
@@ -0,0 +1,377 @@
+#pragma once
+
+#include "TaskGraph.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <boost/range/iterator_range.hpp>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace silver_bullets {
+namespace task_engine {
+
+// Binary file holding the structure of a task graph (without data values) and, optionally,
+// the part of a TaskGraphExecutor cache that does not change between runs
+// (see TaskGraphExecutor::addCacheSections()). The same format is used by checkpoints
+// of computations (see TaskGraphExecutor::setCheckpointing()). The file consists of sections,
+// each being an array of trivially copyable elements, so nothing is parsed on loading.
+// Note: The format depends on the platform (endianness and sizes of types).
+
+enum class TaskGraphFileSection : std::uint32_t
+{
+    DataSize = 1,       // One element, the size of TaskGraph::data
+    TaskInfo,
+    Connections,
+    DataMap,
+    ResourceDemands,
+    ResourceCapacity,   // TaskGraph::ResourceDemand elements
+    Loops,              // TaskGraphFileLoop elements
+    LoopTasks,
+    LoopFeedback,
+
+    CacheTotalOutputCount = 100,
+    CacheRoots,
+    CacheInitAvailTaskInputs,
+    CacheTaskIoDataIdx,
+    CacheInputSources,
+    CacheInitConsumerCounts,
+    CacheConsumerIndex,
+    CacheConsumers,
+    CacheLevelIndex,
+    CacheLevelTasks,
+
+    CheckpointTaskStatus = 200, // TaskStatus elements, index = taskId
+    CheckpointOutputs,          // TaskGraphFileCheckpointOutput elements
+    CheckpointOutputData,       // Encoded values of outputs
+
+    ExecutionLog = 300          // TaskExecutionLogRecord elements
+};
+
+// TaskGraph::Loop, with tasks and feedback connections stored in separate sections
+struct TaskGraphFileLoop
+{
+    std::uint64_t taskIndex;
+    std::uint64_t taskCount;
+    std::uint64_t feedbackIndex;
+    std::uint64_t feedbackCount;
+    OutputEndPoint converged;
+    std::uint64_t maxIterationCount;
+};
+
+// Output saved in a checkpoint, encoded by the codec with the specified id (see TaskDataCodec)
+struct TaskGraphFileCheckpointOutput
+{
+    static constexpr std::uint32_t EmptyValue = ~std::uint32_t(0);  // codecId of an empty output
+
+    OutputEndPoint output;
+    std::uint64_t offset;   // In the CheckpointOutputData section
+    std::uint64_t size;
+    std::uint32_t codecId;
+    std::uint32_t reserved;
+};
+
+struct TaskGraphFileHeader
+{
+    static constexpr char Magic[8] = { 'S', 'B', 'T', 'G', 'R', 'A', 'P', 'H' };
+    static constexpr std::uint32_t Version = 2;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t sectionCount;
+};
+
+struct TaskGraphFileSectionInfo
+{
+    TaskGraphFileSection id;
+    std::uint32_t elementSize;
+    std::uint64_t offset;   // From the beginning of the file
+    std::uint64_t count;    // Number of elements
+};
+
+class TaskGraphFileWriter
+{
+public:
+    // Sections are aligned in the file, so their elements can be accessed in place
+    static constexpr std::size_t SectionAlignment = 64;
+
+    // Copies count elements starting at data
+    template<class T>
+    TaskGraphFileWriter& addSection(TaskGraphFileSection id, const T *data, std::size_t count)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        auto begin = reinterpret_cast<const char*>(data);
+        m_sections.push_back({ { id, sizeof(T), 0, count }, std::vector<char>(begin, begin + count*sizeof(T)) });
+        return *this;
+    }
+
+    template<class T>
+    TaskGraphFileWriter& addSection(TaskGraphFileSection id, const std::vector<T>& data) {
+        return addSection(id, data.data(), data.size());
+    }
+
+    TaskGraphFileWriter& addTaskGraph(const TaskGraph& g)
+    {
+        std::uint64_t dataSize = g.data.size();
+        addSection(TaskGraphFileSection::DataSize, &dataSize, 1);
+        addSection(TaskGraphFileSection::TaskInfo, g.taskInfo);
+        addSection(TaskGraphFileSection::Connections, g.connections);
+        addSection(TaskGraphFileSection::DataMap, g.dataMap);
+        addSection(TaskGraphFileSection::ResourceDemands, g.resourceDemands);
+        std::vector<TaskGraph::ResourceDemand> capacity;
+        for (auto& item : g.resourceCapacity)
+            capacity.push_back({ item.first, item.second });
+        addSection(TaskGraphFileSection::ResourceCapacity, capacity);
+        std::vector<TaskGraphFileLoop> loops;
+        std::vector<std::size_t> loopTasks;
+        std::vector<Connection> loopFeedback;
+        for (auto& loop : g.loops) {
+            loops.push_back({
+                loopTasks.size(), loop.tasks.size(),
+                loopFeedback.size(), loop.feedback.size(),
+                loop.converged, loop.maxIterationCount });
+            loopTasks.insert(loopTasks.end(), loop.tasks.begin(), loop.tasks.end());
+            loopFeedback.insert(loopFeedback.end(), loop.feedback.begin(), loop.feedback.end());
+        }
+        addSection(TaskGraphFileSection::Loops, loops);
+        addSection(TaskGraphFileSection::LoopTasks, loopTasks);
+        addSection(TaskGraphFileSection::LoopFeedback, loopFeedback);
+        return *this;
+    }
+
+    void write(const std::string& fileName)
+    {
+        TaskGraphFileHeader header;
+        std::memcpy(header.magic, TaskGraphFileHeader::Magic, sizeof(header.magic));
+        header.version = TaskGraphFileHeader::Version;
+        header.sectionCount = static_cast<std::uint32_t>(m_sections.size());
+        auto offset = align(sizeof(header) + m_sections.size()*sizeof(TaskGraphFileSectionInfo));
+        for (auto& section : m_sections) {
+            section.info.offset = offset;
+            offset = align(offset + section.data.size());
+        }
+
+        std::ofstream s(fileName, std::ios::binary);
+        if (!s.is_open())
+            throw std::runtime_error("TaskGraphFileWriter: Failed to open file '" + fileName + "'");
+        s.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+        s.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (auto& section : m_sections)
+            s.write(reinterpret_cast<const char*>(&section.info), sizeof(section.info));
+        for (auto& section : m_sections) {
+            pad(s, section.info.offset);
+            s.write(section.data.data(), static_cast<std::streamsize>(section.data.size()));
+        }
+        pad(s, offset);
+    }
+
+private:
+    struct Section {
+        TaskGraphFileSectionInfo info;
+        std::vector<char> data;
+    };
+    std::vector<Section> m_sections;
+
+    static std::uint64_t align(std::uint64_t offset) {
+        return (offset + SectionAlignment - 1) & ~std::uint64_t(SectionAlignment - 1);
+    }
+
+    static void pad(std::ofstream& s, std::uint64_t offset)
+    {
+        static const char zeros[SectionAlignment] = {};
+        auto pos = static_cast<std::uint64_t>(s.tellp());
+        BOOST_ASSERT(pos <= offset && offset - pos < SectionAlignment);
+        s.write(zeros, static_cast<std::streamsize>(offset - pos));
+    }
+};
+
+// Gives access to sections of a file written by TaskGraphFileWriter.
+// On Unix, the file is mapped into memory read-only, so processes loading
+// the same file share its pages; elsewhere, the file is read into memory.
+class TaskGraphFile
+{
+public:
+    explicit TaskGraphFile(const std::string& fileName)
+    {
+#ifdef __unix__
+        auto fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd == -1)
+            throwError("Failed to open", fileName);
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            auto error = errno;
+            close(fd);
+            errno = error;
+            throwError("Failed to query size of", fileName);
+        }
+        m_size = static_cast<std::size_t>(st.st_size);
+        if (m_size == 0) {
+            close(fd);
+            throw std::runtime_error("TaskGraphFile: Invalid file '" + fileName + "'");
+        }
+        auto data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        auto error = errno;
+        close(fd);
+        if (data == MAP_FAILED) {
+            errno = error;
+            throwError("Failed to map", fileName);
+        }
+        m_data = static_cast<const char*>(data);
+#else
+        std::ifstream s(fileName, std::ios::binary | std::ios::ate);
+        if (!s.is_open())
+            throw std::runtime_error("TaskGraphFile: Failed to open file '" + fileName + "'");
+        m_size = static_cast<std::size_t>(s.tellg());
+        m_buffer.reset(new char[m_size]);
+        s.seekg(0);
+        s.read(m_buffer.get(), static_cast<std::streamsize>(m_size));
+        m_data = m_buffer.get();
+#endif
+        try {
+            validate(fileName);
+        }
+        catch(...) {
+            unmap();
+            throw;
+        }
+    }
+
+    TaskGraphFile(const TaskGraphFile&) = delete;
+    TaskGraphFile& operator=(const TaskGraphFile&) = delete;
+
+    ~TaskGraphFile() {
+        unmap();
+    }
+
+    bool hasSection(TaskGraphFileSection id) const {
+        return findSection(id) != nullptr;
+    }
+
+    // Returns elements of the section in place; returns an empty range if there is no such section
+    template<class T>
+    boost::iterator_range<const T*> section(TaskGraphFileSection id) const
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        auto info = findSection(id);
+        if (!info)
+            return {};
+        if (info->elementSize != sizeof(T))
+            throw std::runtime_error(
+                "TaskGraphFile: Unexpected element size in section " +
+                std::to_string(static_cast<std::uint32_t>(id)));
+        auto begin = reinterpret_cast<const T*>(m_data + info->offset);
+        return { begin, begin + info->count };
+    }
+
+    // Returns the graph with all data elements empty
+    TaskGraph taskGraph() const
+    {
+        TaskGraph result;
+        auto dataSize = section<std::uint64_t>(TaskGraphFileSection::DataSize);
+        result.data.resize(dataSize.empty()? 0: static_cast<std::size_t>(dataSize.front()));
+        assign(result.taskInfo, TaskGraphFileSection::TaskInfo);
+        assign(result.connections, TaskGraphFileSection::Connections);
+        assign(result.dataMap, TaskGraphFileSection::DataMap);
+        assign(result.resourceDemands, TaskGraphFileSection::ResourceDemands);
+        for (auto& item : section<TaskGraph::ResourceDemand>(TaskGraphFileSection::ResourceCapacity))
+            result.resourceCapacity[item.resource] = item.amount;
+        auto loopTasks = section<std::size_t>(TaskGraphFileSection::LoopTasks);
+        auto loopFeedback = section<Connection>(TaskGraphFileSection::LoopFeedback);
+        for (auto& loop : section<TaskGraphFileLoop>(TaskGraphFileSection::Loops)) {
+            if (loop.taskIndex + loop.taskCount > loopTasks.size() ||
+                    loop.feedbackIndex + loop.feedbackCount > loopFeedback.size())
+                throw std::runtime_error("TaskGraphFile: Invalid loop");
+            auto tasks = loopTasks.begin() + loop.taskIndex;
+            auto feedback = loopFeedback.begin() + loop.feedbackIndex;
+            result.loops.push_back({
+                { tasks, tasks + loop.taskCount },
+                { feedback, feedback + loop.feedbackCount },
+                loop.converged,
+                static_cast<std::size_t>(loop.maxIterationCount) });
+        }
+        return result;
+    }
+
+    // Copies section elements to v
+    template<class T>
+    void assign(std::vector<T>& v, TaskGraphFileSection id) const
+    {
+        auto s = section<T>(id);
+        v.assign(s.begin(), s.end());
+    }
+
+private:
+    const char *m_data = nullptr;
+    std::size_t m_size = 0;
+#ifndef __unix__
+    std::unique_ptr<char[]> m_buffer;
+#endif
+
+    void unmap()
+    {
+#ifdef __unix__
+        munmap(const_cast<char*>(m_data), m_size);
+#endif
+    }
+
+    const TaskGraphFileHeader& header() const {
+        return *reinterpret_cast<const TaskGraphFileHeader*>(m_data);
+    }
+
+    const TaskGraphFileSectionInfo *sectionInfo() const {
+        return reinterpret_cast<const TaskGraphFileSectionInfo*>(m_data + sizeof(TaskGraphFileHeader));
+    }
+
+    const TaskGraphFileSectionInfo *findSection(TaskGraphFileSection id) const
+    {
+        auto begin = sectionInfo();
+        auto end = begin + header().sectionCount;
+        auto it = std::find_if(begin, end, [id](const TaskGraphFileSectionInfo& info) { return info.id == id; });
+        return it == end? nullptr: it;
+    }
+
+    void validate(const std::string& fileName) const
+    {
+        auto valid =
+                m_size >= sizeof(TaskGraphFileHeader) &&
+                std::memcmp(header().magic, TaskGraphFileHeader::Magic, sizeof(TaskGraphFileHeader::Magic)) == 0 &&
+                header().version == TaskGraphFileHeader::Version &&
+                (m_size - sizeof(TaskGraphFileHeader)) / sizeof(TaskGraphFileSectionInfo) >= header().sectionCount;
+        if (valid) {
+            auto begin = sectionInfo();
+            valid = std::all_of(begin, begin + header().sectionCount, [this](const TaskGraphFileSectionInfo& info) {
+                return info.offset % TaskGraphFileWriter::SectionAlignment == 0 &&
+                       info.offset <= m_size &&
+                       info.elementSize > 0 &&
+                       info.count <= (m_size - info.offset) / info.elementSize;
+            });
+        }
+        if (!valid)
+            throw std::runtime_error("TaskGraphFile: Invalid file '" + fileName + "'");
+    }
+
+#ifdef __unix__
+    [[noreturn]] static void throwError(const std::string& what, const std::string& fileName)
+    {
+        throw std::runtime_error(
+            "TaskGraphFile: " + what + " file '" + fileName + "': " + std::strerror(errno));
+    }
+#endif
+};
+
+} // namespace task_engine
+} // namespace silver_bullets
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "TaskGraph.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/assert.hpp>
+
+namespace silver_bullets {
+namespace task_engine {
+namespace detail {
+
+// Iterations of loops of a task graph (see TaskGraph::loops) run by TaskGraphExecutor.
+// Iterations overlap: a task does not wait for the whole previous iteration to complete,
+// but only for the tasks it exchanges data with.
+class TaskGraphLoops
+{
+public:
+    // Builds connections of loop tasks; does nothing if the graph has no loops
+    void build(const TaskGraph& g)
+    {
+        if (g.loops.empty())
+            return;
+        auto taskCount = g.taskInfo.size();
+        m_taskInfo.resize(taskCount);
+        for (std::size_t loop=0, n=g.loops.size(); loop<n; ++loop) {
+            for (auto taskId : g.loops[loop].tasks)
+                m_taskInfo[taskId].loop = loop;
+            for (auto& fc : g.loops[loop].feedback) {
+                m_taskInfo[fc.from.taskId].feedbackConsumers.push_back(fc.to.taskId);
+                m_taskInfo[fc.to.taskId].feedbackProducers.push_back(fc.from.taskId);
+                m_taskInfo[fc.to.taskId].feedbackInputs.push_back(fc);
+            }
+        }
+        for (auto& conn : g.connections) {
+            auto& from = m_taskInfo[conn.from.taskId];
+            auto& to = m_taskInfo[conn.to.taskId];
+            if (from.loop != ~std::size_t(0) && from.loop == to.loop) {
+                from.consumers.push_back(conn.to.taskId);
+                to.producers.push_back(conn.from.taskId);
+            }
+        }
+    }
+
+    // Forgets iterations of a previous computation
+    void reset(std::size_t loopCount)
+    {
+        if (m_taskInfo.empty())
+            return;
+        m_startedIterations.assign(m_taskInfo.size(), 0);
+        m_completedIterations.assign(m_taskInfo.size(), 0);
+        m_loopState.assign(loopCount, LoopState());
+    }
+
+    bool isLoopTask(std::size_t taskId) const {
+        return !m_taskInfo.empty() && m_taskInfo[taskId].loop != ~std::size_t(0);
+    }
+
+    // Returns the index of the task loop in TaskGraph::loops, or ~0 if the task is not in a loop
+    std::size_t loopOf(std::size_t taskId) const {
+        return m_taskInfo.empty()? ~std::size_t(0): m_taskInfo[taskId].loop;
+    }
+
+    std::size_t startedIterations(std::size_t taskId) const {
+        return m_startedIterations[taskId];
+    }
+
+    std::size_t completedIterations(std::size_t taskId) const {
+        return m_completedIterations[taskId];
+    }
+
+    // Feedback connections to inputs of the task
+    const std::vector<Connection>& feedbackInputs(std::size_t taskId) const {
+        return m_taskInfo[taskId].feedbackInputs;
+    }
+
+    // Called when the loop task is started by an executor; returns true if it starts an iteration
+    // other than the first one. A task that is retried or duplicated continues its current iteration.
+    bool startIteration(std::size_t taskId)
+    {
+        auto& started = m_startedIterations[taskId];
+        if (started != m_completedIterations[taskId])
+            return false;
+        return started++ > 0;
+    }
+
+    // Called when the loop task completes an iteration; returns its index
+    std::size_t completeIteration(std::size_t taskId)
+    {
+        auto iteration = m_completedIterations[taskId]++;
+        BOOST_ASSERT(m_startedIterations[taskId] == iteration + 1);
+        return iteration;
+    }
+
+    // Called when the task providing TaskGraph::Loop::converged completes the iteration of the loop
+    void setConverged(std::size_t loop, std::size_t iteration, bool converged)
+    {
+        auto& state = m_loopState[loop];
+        if (converged)
+            state.lastIteration = iteration;
+        else
+            state.lastStartableIteration = iteration + 1;
+    }
+
+    // Returns true if the loop has converged at the iteration
+    bool isLastIteration(std::size_t loop, std::size_t iteration) const {
+        return iteration == m_loopState[loop].lastIteration;
+    }
+
+    // Returns true if the task can start its next iteration, other than the first one
+    bool isNextIterationReady(std::size_t taskId) const
+    {
+        auto iteration = m_completedIterations[taskId];
+        if (iteration == 0 || m_startedIterations[taskId] != iteration)
+            return false;
+        auto& lti = m_taskInfo[taskId];
+        if (iteration > m_loopState[lti.loop].lastStartableIteration)
+            return false;
+        auto& completed = m_completedIterations;
+        auto& started = m_startedIterations;
+        auto all = [](const std::vector<std::size_t>& taskIds, auto pred) {
+            return std::all_of(taskIds.begin(), taskIds.end(), pred);
+        };
+        return
+            // Inputs of this iteration are computed
+            all(lti.producers, [&](std::size_t id) { return completed[id] > iteration; }) &&
+            all(lti.feedbackProducers, [&](std::size_t id) { return completed[id] >= iteration; }) &&
+            // Outputs of the previous iteration are no longer needed
+            all(lti.consumers, [&](std::size_t id) { return completed[id] >= iteration; }) &&
+            all(lti.feedbackConsumers, [&](std::size_t id) { return id == taskId || started[id] > iteration; });
+    }
+
+private:
+    // Connections of a task with tasks of the same loop
+    struct TaskInfo {
+        std::size_t loop = ~0;  // Index in TaskGraph::loops, ~0 if the task is not in a loop
+        std::vector<std::size_t> producers;             // Tasks providing inputs at the same iteration
+        std::vector<std::size_t> consumers;             // Tasks consuming outputs at the same iteration
+        std::vector<std::size_t> feedbackProducers;     // Tasks providing inputs for the next iteration
+        std::vector<std::size_t> feedbackConsumers;     // Tasks consuming outputs at the next iteration
+        std::vector<Connection> feedbackInputs;         // Feedback connections to task inputs
+    };
+    std::vector<TaskInfo> m_taskInfo;   // index = taskId; empty if there are no loops
+
+    // index = taskId, value = number of loop iterations started/completed by the task
+    std::vector<std::size_t> m_startedIterations;
+    std::vector<std::size_t> m_completedIterations;
+
+    struct LoopState {
+        std::size_t lastStartableIteration = 0;
+        std::size_t lastIteration = ~0;     // Known once the loop converges
+    };
+    std::vector<LoopState> m_loopState;     // index = loop index
+};
+
+} // namespace detail
+} // namespace task_engine
+} // namespace silver_bullets
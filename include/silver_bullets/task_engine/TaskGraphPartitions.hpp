@@ -0,0 +1,290 @@
+#pragma once
+
+#include "TaskExecutionLog.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/assert.hpp>
+
+namespace silver_bullets {
+namespace task_engine {
+namespace detail {
+
+// Elements of a started map task (see TaskKind::Map), passed to executors in chunks
+class MapTaskState
+{
+public:
+    // Elements [begin, end) passed to an executor
+    struct Chunk {
+        std::size_t begin;
+        std::size_t end;
+        std::size_t failedAttempts;     // Previous failed attempts to process the chunk
+    };
+
+    explicit MapTaskState(std::size_t elementCount) :
+        m_results(elementCount)
+    {}
+
+    // Returns the number of elements not yet passed to an executor, except those of failed chunks
+    std::size_t remainingElementCount() const {
+        return m_results.size() - m_nextElement;
+    }
+
+    // Returns true if there are elements to pass to executors now; failed chunks
+    // wait for their retry time
+    bool hasPendingChunks() const {
+        return m_nextElement < m_results.size() || dueFailedChunk() != m_failedChunks.end();
+    }
+
+    // Returns true if elements [begin, end) are a failed chunk waiting for its retry time
+    bool isChunkDelayed(std::size_t begin, std::size_t end) const
+    {
+        auto currentTime = std::chrono::steady_clock::now();
+        return std::any_of(m_failedChunks.begin(), m_failedChunks.end(), [&](const FailedChunk& chunk) {
+            return chunk.begin == begin && chunk.end == end && chunk.retryTime > currentTime;
+        });
+    }
+
+    // Takes the next chunk to pass to an executor. In the replay mode, this is the chunk of the replayed
+    // record, if it is a failed chunk or starts at the first element not yet passed to an executor.
+    // Otherwise, failed chunks whose retry time has come are taken first, then chunkSize(remainingElementCount())
+    // elements not yet passed to an executor.
+    template<class ChunkSize>
+    Chunk startChunk(const TaskExecutionLogRecord *replayedRecord, ChunkSize chunkSize)
+    {
+        auto failedChunk = m_failedChunks.cend();
+        if (replayedRecord)
+            failedChunk = std::find_if(m_failedChunks.cbegin(), m_failedChunks.cend(), [&](const FailedChunk& chunk) {
+                return chunk.begin == replayedRecord->partBegin && chunk.end == replayedRecord->partEnd;
+            });
+        if (failedChunk == m_failedChunks.end())
+            failedChunk = dueFailedChunk();
+        Chunk result;
+        if (replayedRecord && replayedRecord->partBegin == m_nextElement &&
+                replayedRecord->partBegin < replayedRecord->partEnd && replayedRecord->partEnd <= m_results.size()) {
+            result = { m_nextElement, static_cast<std::size_t>(replayedRecord->partEnd), 0 };
+            m_nextElement = result.end;
+        }
+        else if (failedChunk != m_failedChunks.end()) {
+            result = { failedChunk->begin, failedChunk->end, failedChunk->failedAttempts };
+            m_failedChunks.erase(failedChunk);
+        }
+        else {
+            BOOST_ASSERT(m_nextElement < m_results.size() || m_startedChunkCount == 0);
+            result = { m_nextElement, m_nextElement + chunkSize(remainingElementCount()), 0 };
+            m_nextElement = result.end;
+        }
+        ++m_startedChunkCount;
+        ++m_runningChunkCount;
+        return result;
+    }
+
+    // Called when an executor fails to process the chunk; it is retried alone at retryTime
+    void failChunk(const Chunk& chunk, std::chrono::steady_clock::time_point retryTime)
+    {
+        BOOST_ASSERT(m_runningChunkCount > 0);
+        --m_runningChunkCount;
+        m_failedChunks.push_back({ chunk.begin, chunk.end, chunk.failedAttempts + 1, retryTime });
+    }
+
+    // Called when an executor has processed the chunk; returns true once all elements are processed
+    bool finishChunk(const Chunk& chunk, TaskCollection& chunkResults)
+    {
+        BOOST_ASSERT(m_runningChunkCount > 0);
+        BOOST_ASSERT(chunkResults.size() == chunk.end - chunk.begin);
+        --m_runningChunkCount;
+        std::move(chunkResults.begin(), chunkResults.end(), m_results.begin() + chunk.begin);
+        m_completedElementCount += chunkResults.size();
+        return m_completedElementCount == m_results.size() && m_runningChunkCount == 0;
+    }
+
+    // Results of all elements, once finishChunk() has returned true
+    TaskCollection& results() {
+        return m_results;
+    }
+
+private:
+    // Chunk to be retried at retryTime
+    struct FailedChunk {
+        std::size_t begin;
+        std::size_t end;
+        std::size_t failedAttempts;
+        std::chrono::steady_clock::time_point retryTime;
+    };
+
+    TaskCollection m_results;
+    std::size_t m_nextElement = 0;      // First element not yet passed to an executor
+    std::size_t m_startedChunkCount = 0;
+    std::size_t m_runningChunkCount = 0;
+    std::size_t m_completedElementCount = 0;
+    std::vector<FailedChunk> m_failedChunks;
+
+    std::vector<FailedChunk>::const_iterator dueFailedChunk() const
+    {
+        auto currentTime = std::chrono::steady_clock::now();
+        return std::find_if(m_failedChunks.begin(), m_failedChunks.end(), [&](const FailedChunk& chunk) {
+            return chunk.retryTime <= currentTime;
+        });
+    }
+};
+
+// Available inputs and partial results of a reduce task (see TaskKind::Reduce), whose adjacent segments
+// are combined by executors. The segment with key k is the result of combining inputs at ports [k, end).
+class ReduceTaskState
+{
+public:
+    using Combine = std::pair<std::size_t, std::size_t>;    // Keys of segments to combine
+
+    // Each available input is paired with an adjacent segment if pairSegments is true; otherwise,
+    // combines are only added by addCombine() (used in the replay mode).
+    ReduceTaskState(std::size_t inputCount, bool pairSegments) :
+        m_inputCount(inputCount),
+        m_pairSegments(pairSegments)
+    {}
+
+    // Adds the segment of a single input; returns true if a new combine becomes pending
+    bool addInput(std::size_t inputPort, const boost::any *value)
+    {
+        auto it = m_segments.emplace(inputPort, Segment{ inputPort + 1, value, boost::any(), false }).first;
+        return pairSegment(it);
+    }
+
+    bool hasPendingCombines() const {
+        return !m_pendingCombines.empty();
+    }
+
+    std::size_t startedCombineCount() const {
+        return m_startedCombineCount;
+    }
+
+    // Takes the last pending combine to pass to an executor
+    Combine startCombine()
+    {
+        BOOST_ASSERT(!m_pendingCombines.empty());
+        auto combine = m_pendingCombines.back();
+        m_pendingCombines.pop_back();
+        ++m_startedCombineCount;
+        return combine;
+    }
+
+    // Returns the value of the segment being combined
+    const boost::any *segmentValue(std::size_t key) const {
+        return m_segments.at(key).value;
+    }
+
+    // Called when an executor fails to combine the segments; the combine becomes pending again
+    void failCombine(const Combine& combine) {
+        m_pendingCombines.push_back(combine);
+    }
+
+    // Called when an executor has combined the segments; returns true if a new combine becomes pending
+    bool finishCombine(const Combine& combine, boost::any&& result)
+    {
+        auto left = m_segments.find(combine.first);
+        auto right = m_segments.find(combine.second);
+        BOOST_ASSERT(left != m_segments.end() && right != m_segments.end());
+        auto& segment = left->second;
+        segment.partialResult = std::move(result);
+        segment.value = &segment.partialResult;
+        segment.end = right->second.end;
+        segment.busy = false;
+        m_segments.erase(right);
+        return !isComplete() && pairSegment(left);
+    }
+
+    // Returns true once all inputs are combined
+    bool isComplete() const
+    {
+        return m_segments.size() == 1 &&
+                m_segments.begin()->first == 0 && m_segments.begin()->second.end == m_inputCount;
+    }
+
+    // Result of combining all inputs, once isComplete() returns true
+    boost::any& result() {
+        return m_segments.begin()->second.partialResult;
+    }
+
+    bool isCombinePending(const Combine& combine) const {
+        return std::find(m_pendingCombines.begin(), m_pendingCombines.end(), combine) != m_pendingCombines.end();
+    }
+
+    // Makes the pending combine the next one to start
+    void moveCombineLast(const Combine& combine)
+    {
+        auto pending = std::find(m_pendingCombines.begin(), m_pendingCombines.end(), combine);
+        BOOST_ASSERT(pending != m_pendingCombines.end());
+        std::iter_swap(pending, m_pendingCombines.end() - 1);
+    }
+
+    // Makes the combine of two adjacent segments the next one to start;
+    // returns false if the segments are not available
+    bool addCombine(const Combine& combine)
+    {
+        auto left = m_segments.find(combine.first);
+        auto right = m_segments.find(combine.second);
+        if (left == m_segments.end() || right == m_segments.end() ||
+                left->second.end != right->first || left->second.busy || right->second.busy)
+            return false;
+        left->second.busy = right->second.busy = true;
+        m_pendingCombines.push_back(combine);
+        return true;
+    }
+
+    // Undoes addCombine() if the combine could not start
+    void removeLastCombine()
+    {
+        BOOST_ASSERT(!m_pendingCombines.empty());
+        auto& combine = m_pendingCombines.back();
+        m_segments.at(combine.first).busy = false;
+        m_segments.at(combine.second).busy = false;
+        m_pendingCombines.pop_back();
+    }
+
+private:
+    struct Segment {
+        std::size_t end;
+        const boost::any *value;    // Points to a task input or to partialResult
+        boost::any partialResult;
+        bool busy;                  // Being combined with an adjacent segment
+    };
+    using Segments = std::map<std::size_t, Segment>;
+
+    std::size_t m_inputCount;
+    bool m_pairSegments;
+    Segments m_segments;
+    std::vector<Combine> m_pendingCombines;
+    std::size_t m_startedCombineCount = 0;
+
+    // Schedules combining the segment with an adjacent one, if it is available
+    bool pairSegment(Segments::iterator it)
+    {
+        if (!m_pairSegments)
+            return false;
+        auto left = m_segments.end();
+        auto right = left;
+        if (it != m_segments.begin() && std::prev(it)->second.end == it->first && !std::prev(it)->second.busy) {
+            left = std::prev(it);
+            right = it;
+        }
+        else if (std::next(it) != m_segments.end() &&
+                 it->second.end == std::next(it)->first && !std::next(it)->second.busy) {
+            left = it;
+            right = std::next(it);
+        }
+        else
+            return false;
+        left->second.busy = right->second.busy = true;
+        m_pendingCombines.emplace_back(left->first, right->first);
+        return true;
+    }
+};
+
+} // namespace detail
+} // namespace task_engine
+} // namespace silver_bullets
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+
+namespace silver_bullets {
+namespace task_engine {
+
+// Keeps a window of recent task durations and their median
+class TaskLatencyStats
+{
+public:
+    static constexpr std::size_t WindowSize = 32;
+
+    void add(double duration)
+    {
+        m_durations[m_next] = duration;
+        m_next = (m_next + 1) % WindowSize;
+        if (m_count < WindowSize)
+            ++m_count;
+
+        auto sorted = m_durations;
+        auto end = sorted.begin() + m_count;
+        auto mid = sorted.begin() + m_count/2;
+        std::nth_element(sorted.begin(), mid, end);
+        m_median = *mid;
+    }
+
+    std::size_t sampleCount() const {
+        return m_count;
+    }
+
+    // Returns 0 if there are no samples
+    double median() const {
+        return m_median;
+    }
+
+private:
+    std::array<double, WindowSize> m_durations;
+    std::size_t m_next = 0;
+    std::size_t m_count = 0;
+    double m_median = 0;
+};
+
+} // namespace task_engine
+} // namespace silver_bullets
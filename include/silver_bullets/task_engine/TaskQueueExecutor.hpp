@@ -2,16 +2,25 @@
 
 #include "types.hpp"
 #include "TaskFuncRegistry.hpp"
+#include "TaskQueueFuture.hpp"
 
 #include "silver_bullets/sync/ThreadNotifier.hpp"
 #include "silver_bullets/sync/CancelController.hpp"
+#include "silver_bullets/sync/EventCount.hpp"
+#include "silver_bullets/sync/MpmcRingBuffer.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <deque>
 #include <thread>
 #include <functional>
+#include <iterator>
+#include <type_traits>
 #include <atomic>
 #include <map>
+#include <set>
+#include <stdexcept>
+#include <vector>
 
 namespace silver_bullets {
 namespace task_engine {
@@ -22,6 +31,14 @@ using TaskQueueFunc = std::function<void(
 
 using TaskQueueFuncRegistry = TaskFuncRegistry<TaskQueueFunc>;
 
+// Function of a task posted with a payload; the returned value is the task result.
+using TaskQueuePayloadFunc = std::function<boost::any(
+    boost::any& threadLocalData,
+    boost::any& payload,
+    const sync::CancelController::Checker& isCancelled)>;
+
+using TaskQueuePayloadFuncRegistry = TaskFuncRegistry<TaskQueuePayloadFunc>;
+
 template<> class ThreadedTaskExecutorInit<TaskQueueFunc>
 {
 public:
@@ -39,24 +56,69 @@ struct TaskQueueExecutorStartParam
 
 template<> struct IsCancellable<TaskQueueFunc> : std::true_type {};
 
+// What happens when a task is posted while a task of the same type is waiting in the queue
+enum class TaskQueueCoalescing
+{
+    None,       // The new task is appended to the queue
+    Replace,    // The waiting task is removed, and the new task is appended to the queue
+    Merge       // The waiting task keeps its place in the queue and takes the payload of the new one
+};
 
+// Coalescing mode for task types; types not in the registry are not coalesced.
+using TaskQueueCoalescingRegistry = std::map<int, TaskQueueCoalescing>;
 
+// Priority class of a task posted to TaskQueueExecutor.
+// Values other than the named ones can be used as well; greater means more urgent.
+enum class TaskQueuePriority : int
+{
+    Background = -1,
+    Normal = 0,
+    Urgent = 1
+};
+
+
+
+// Runs posted tasks on workerCount threads, each having its own thread local data.
+// Tasks are started in the order they are posted, but with more than one worker
+// they can complete in any order.
+// Queued tasks of higher priority are started first; tasks of the same priority are started
+// in the order they are posted. Note: Tasks of lower priority can starve if there are
+// always tasks of higher priority in the queue.
+// Posting does not lock a mutex unless more than queueCapacity tasks are waiting
+// to be picked up by workers. Idle workers wait according to waitStrategy.
 class TaskQueueExecutor
 {
 public:
-    explicit TaskQueueExecutor(const sync::CancelController::Checker& cancelParam) :
+    static constexpr std::size_t DefaultQueueCapacity = 4096;
+
+    explicit TaskQueueExecutor(
+            const sync::CancelController::Checker& cancelParam,
+            std::size_t workerCount = 1,
+            std::size_t queueCapacity = DefaultQueueCapacity,
+            sync::WaitStrategy waitStrategy = sync::WaitStrategy::Park) :
         m_cancelParam(cancelParam),
-        m_thread([this](){ run(); })
-    {}
+        m_incomingTasks(queueCapacity),
+        m_incomingTaskEvent(waitStrategy),
+        m_threadLocalData(workerCount),
+        m_payloadSlots(queueCapacity, waitStrategy)
+    {
+        BOOST_ASSERT(workerCount > 0);
+        m_threads.reserve(workerCount);
+        for (std::size_t i=0; i<workerCount; ++i)
+            m_threads.emplace_back([this, i](){ run(i); });
+    }
 
     ~TaskQueueExecutor()
     {
         wait();
-        std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
         m_flags |= ExitRequested;
-        lk.unlock();
-        m_incomingTaskNotifier.notify_one();
-        m_thread.join();
+        m_incomingTaskEvent.notifyAll();
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    std::size_t workerCount() const {
+        return m_threads.size();
     }
 
     void setTaskFuncRegistry(const TaskQueueFuncRegistry *taskFuncRegistry) {
@@ -67,37 +129,140 @@ public:
         return m_taskFuncRegistry;
     }
 
-    std::size_t post(int taskType)
+    void setPayloadTaskFuncRegistry(const TaskQueuePayloadFuncRegistry *payloadTaskFuncRegistry) {
+        m_payloadTaskFuncRegistry = payloadTaskFuncRegistry;
+    }
+
+    const TaskQueuePayloadFuncRegistry *payloadTaskFuncRegistry() const {
+        return m_payloadTaskFuncRegistry;
+    }
+
+    // Enables coalescing of tasks posted with post() (postMany() never coalesces tasks).
+    // Plain and payload tasks of the same type are coalesced separately.
+    // Futures of a coalesced payload task are all given the result of the task that runs.
+    void setCoalescingRegistry(const TaskQueueCoalescingRegistry *coalescingRegistry) {
+        m_coalescingRegistry = coalescingRegistry;
+    }
+
+    const TaskQueueCoalescingRegistry *coalescingRegistry() const {
+        return m_coalescingRegistry;
+    }
+
+    std::size_t post(int taskType, TaskQueuePriority priority = TaskQueuePriority::Normal)
     {
-        std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
         BOOST_ASSERT(!m_cancelParam);
+        if (auto coalescing = coalescingOf(taskType); coalescing != TaskQueueCoalescing::None) {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            auto taskId = coalesce(taskType, priority, coalescing, nullptr).taskId;
+            lk.unlock();
+            m_incomingTaskEvent.notifyOne();
+            return taskId;
+        }
         auto taskId = m_nextTaskId++;
-        m_taskQueue.emplace_back(TaskQueueItem{ taskType, taskId });
-        lk.unlock();
-        m_incomingTaskNotifier.notify_one();
+        ++m_queuedTaskCount;
+        enqueue({ taskType, taskId, priority });
+        m_incomingTaskEvent.notifyOne();
         return taskId;
     };
 
+    // Posts a task whose function is taken from the payload task function registry.
+    // The payload is passed to the function; the returned future holds its result.
+    // If the task is removed from the queue before it runs, the future throws an exception.
+    TaskQueueFuture post(
+            int taskType,
+            boost::any payload,
+            TaskQueuePriority priority = TaskQueuePriority::Normal)
+    {
+        BOOST_ASSERT(!m_cancelParam);
+        BOOST_ASSERT(m_payloadTaskFuncRegistry);
+        if (auto coalescing = coalescingOf(taskType); coalescing != TaskQueueCoalescing::None) {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            auto slot = coalesce(taskType, priority, coalescing, &payload).slot;
+            TaskQueuePayloadSlotPool::addRef(slot);
+            lk.unlock();
+            m_incomingTaskEvent.notifyOne();
+            return TaskQueueFuture(slot);
+        }
+        auto taskId = m_nextTaskId++;
+        auto slot = m_payloadSlots.acquire(taskId, std::move(payload));
+        ++m_queuedTaskCount;
+        enqueue({ taskType, taskId, priority, slot });
+        m_incomingTaskEvent.notifyOne();
+        return TaskQueueFuture(slot);
+    }
+
+    // Posts count tasks of the same type; returns the identifier of the first one.
+    // The tasks have consecutive identifiers.
+    std::size_t postMany(
+            int taskType,
+            std::size_t count,
+            TaskQueuePriority priority = TaskQueuePriority::Normal)
+    {
+        BOOST_ASSERT(!m_cancelParam);
+        auto firstTaskId = m_nextTaskId.fetch_add(count);
+        m_queuedTaskCount += count;
+        for (std::size_t i=0; i<count; ++i)
+            enqueue({ taskType, firstTaskId + i, priority });
+        m_incomingTaskEvent.notifyAll();
+        return firstTaskId;
+    }
+
+    // Posts tasks of types in the range [first, last); returns the identifier of the first one.
+    // The tasks have consecutive identifiers.
+    template<class It, std::enable_if_t<!std::is_integral_v<It>, int> = 0>
+    std::size_t postMany(It first, It last, TaskQueuePriority priority = TaskQueuePriority::Normal)
+    {
+        BOOST_ASSERT(!m_cancelParam);
+        auto count = static_cast<std::size_t>(std::distance(first, last));
+        auto firstTaskId = m_nextTaskId.fetch_add(count);
+        m_queuedTaskCount += count;
+        auto taskId = firstTaskId;
+        for (; first!=last; ++first)
+            enqueue({ *first, taskId++, priority });
+        m_incomingTaskEvent.notifyAll();
+        return firstTaskId;
+    }
 
     void clearQueue()
     {
-        std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
-        m_taskQueue.clear();
+        std::unique_lock<std::mutex> lk(m_mutex);
+        receiveIncomingTasks();
+        for (auto& laneItem : m_lanes)
+            dropTasks(laneItem.second, laneItem.second.begin(), laneItem.second.end());
     }
 
     // Cancel all tasks that are not yet completed and have identifiers >= taskId.
     void clearQueueFrom(std::size_t taskId)
     {
-        std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
-        m_taskQueue.erase(findTasksFrom(taskId), m_taskQueue.end());
+        std::unique_lock<std::mutex> lk(m_mutex);
+        receiveIncomingTasks();
+        for (auto& laneItem : m_lanes) {
+            auto& lane = laneItem.second;
+            dropTasks(lane, findTasksFrom(lane, taskId), lane.end());
+        }
+    }
+
+    // Returns the identifier of the earliest posted task that is not yet completed,
+    // or the identifier the next posted task will have, if all tasks are completed.
+    std::size_t lowestIncompleteTaskId()
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        receiveIncomingTasks();
+        std::size_t result = m_nextTaskId;
+        for (auto& laneItem : m_lanes)
+            if (!laneItem.second.empty())
+                result = std::min(result, laneItem.second.front().taskId);
+        if (!m_runningTaskIds.empty())
+            result = std::min(result, *m_runningTaskIds.begin());
+        return result;
     }
 
     void wait()
     {
         while (true) {
-            std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
-            auto running = !!(m_flags & TaskRunning);
-            if (m_taskQueue.empty() && !running)
+            std::unique_lock<std::mutex> lk(m_mutex);
+            receiveIncomingTasks();
+            if (queuedTaskCountFrom(0) == 0 && m_runningTaskIds.empty())
                 return;
             lk.unlock();
             m_taskCompletionNotifier.wait();
@@ -111,14 +276,13 @@ public:
         auto endTime = std::chrono::system_clock::now() + timeout;
         auto remainingTimeout = timeout;
         while (true) {
-            std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
-            auto remainingTasks = m_taskQueue.size();
-            if (m_flags & TaskRunning)
-                ++remainingTasks;
+            std::unique_lock<std::mutex> lk(m_mutex);
+            receiveIncomingTasks();
+            auto remainingTasks = queuedTaskCountFrom(0) + m_runningTaskIds.size();
             if (remainingTasks == 0)
                 return 0;
             lk.unlock();
-            if (remainingTimeout > 0) {
+            if (remainingTimeout.count() > 0) {
                 m_taskCompletionNotifier.wait_for(remainingTimeout);
                 auto currentTime = std::chrono::system_clock::now();
                 remainingTimeout = std::chrono::duration_cast<decltype (remainingTimeout)>(endTime - currentTime);
@@ -128,13 +292,13 @@ public:
         }
     }
 
+    // Waits for completion of tasks with identifiers >= taskId
     void wait(std::size_t taskId)
     {
         while (true) {
-            std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
-            std::size_t remainingTasks = m_taskQueue.end() - findTasksFrom(taskId);
-            if (m_flags & TaskRunning)
-                ++remainingTasks;
+            std::unique_lock<std::mutex> lk(m_mutex);
+            receiveIncomingTasks();
+            auto remainingTasks = queuedTaskCountFrom(taskId) + runningTaskCountFrom(taskId);
             if (remainingTasks == 0)
                 return;
             lk.unlock();
@@ -148,14 +312,13 @@ public:
         auto endTime = std::chrono::system_clock::now() + timeout;
         auto remainingTimeout = timeout;
         while (true) {
-            std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
-            std::size_t remainingTasks = m_taskQueue.end() - findTasksFrom(taskId);
-            if (m_flags & TaskRunning)
-                ++remainingTasks;
+            std::unique_lock<std::mutex> lk(m_mutex);
+            receiveIncomingTasks();
+            auto remainingTasks = queuedTaskCountFrom(taskId) + runningTaskCountFrom(taskId);
             if (remainingTasks == 0)
                 return 0;
             lk.unlock();
-            if (remainingTimeout > 0) {
+            if (remainingTimeout.count() > 0) {
                 m_taskCompletionNotifier.wait_for(remainingTimeout);
                 auto currentTime = std::chrono::system_clock::now();
                 remainingTimeout = std::chrono::duration_cast<decltype (remainingTimeout)>(endTime - currentTime);
@@ -172,32 +335,49 @@ private:
     {
         int taskType;
         std::size_t taskId;
+        TaskQueuePriority priority;
+        TaskQueuePayloadSlot *slot = nullptr;   // Only for tasks posted with a payload
     };
 
-    std::deque<TaskQueueItem> m_taskQueue;
-    std::size_t m_nextTaskId = 1;
-    sync::ThreadNotifier m_incomingTaskNotifier;
+    sync::MpmcRingBuffer<TaskQueueItem> m_incomingTasks;   // Posted tasks not yet moved to m_lanes
+    sync::EventCount m_incomingTaskEvent;
+    using TaskQueue = std::deque<TaskQueueItem>;    // Ordered by taskId
+    std::map<TaskQueuePriority, TaskQueue, std::greater<TaskQueuePriority>> m_lanes;
+    std::atomic<std::size_t> m_nextTaskId = 1;
+    std::atomic<std::size_t> m_queuedTaskCount = 0; // Posted tasks that are neither started nor cleared
+    std::mutex m_mutex;
     sync::ThreadNotifier m_taskCompletionNotifier;
-    boost::any m_threadLocalData;
+    std::vector<boost::any> m_threadLocalData;  // One element per worker
+    std::set<std::size_t> m_runningTaskIds;
+
+    TaskQueuePayloadSlotPool m_payloadSlots;
 
     const TaskQueueFuncRegistry *m_taskFuncRegistry = nullptr;
+    const TaskQueuePayloadFuncRegistry *m_payloadTaskFuncRegistry = nullptr;
+    const TaskQueueCoalescingRegistry *m_coalescingRegistry = nullptr;
+
+    struct CoalescedTask
+    {
+        std::size_t taskId;
+        TaskQueuePriority priority;
+    };
+    // Waiting coalesced tasks; keys are (task type, whether the task has payload)
+    std::map<std::pair<int, bool>, CoalescedTask> m_coalescedTasks;
 
     enum {
-        TaskCompleted = 0x01,
-        TaskRunning = 0x02,
-        ExitRequested = 0x4
+        ExitRequested = 0x1
     };
-    volatile unsigned int m_flags = 0;   // A combination of elements of the above enum
+    std::atomic<unsigned int> m_flags = 0;   // A combination of elements of the above enum
 
-    // Note: Declare the thread last, such that all fields it can access
-    // are initialized before the thread starts.
-    std::thread m_thread;
+    // Note: Declare the threads last, such that all fields they can access
+    // are initialized before the threads start.
+    std::vector<std::thread> m_threads;
 
-    std::deque<TaskQueueItem>::iterator findTasksFrom(std::size_t taskId)
+    static TaskQueue::iterator findTasksFrom(TaskQueue& lane, std::size_t taskId)
     {
         return std::lower_bound(
-                    m_taskQueue.begin(),
-                    m_taskQueue.end(),
+                    lane.begin(),
+                    lane.end(),
                     taskId,
                     [](const TaskQueueItem& a, const std::size_t& b)
         {
@@ -205,35 +385,192 @@ private:
         });
     }
 
-    void run()
+    void enqueue(const TaskQueueItem& task)
+    {
+        if (!m_incomingTasks.tryPush(task)) {
+            // Too many tasks are waiting, fall back to the locked queue
+            std::unique_lock<std::mutex> lk(m_mutex);
+            receiveIncomingTasks();
+            insertTask(task);
+        }
+    }
+
+    TaskQueueCoalescing coalescingOf(int taskType) const
+    {
+        if (!m_coalescingRegistry)
+            return TaskQueueCoalescing::None;
+        auto it = m_coalescingRegistry->find(taskType);
+        return it == m_coalescingRegistry->end()? TaskQueueCoalescing::None: it->second;
+    }
+
+    // Posts a coalesced task, payload is nullptr for tasks without payload.
+    // Returns the queued task that will run instead of the posted one.
+    // Note: m_mutex must be locked
+    TaskQueueItem& coalesce(
+            int taskType,
+            TaskQueuePriority priority,
+            TaskQueueCoalescing coalescing,
+            boost::any *payload)
+    {
+        receiveIncomingTasks();
+        TaskQueuePayloadSlot *slot = nullptr;
+        auto key = std::make_pair(taskType, payload != nullptr);
+        auto it = m_coalescedTasks.find(key);
+        if (it != m_coalescedTasks.end()) {
+            auto& lane = m_lanes.at(it->second.priority);
+            auto pos = findTasksFrom(lane, it->second.taskId);
+            BOOST_ASSERT(pos != lane.end() && pos->taskId == it->second.taskId);
+            if (coalescing == TaskQueueCoalescing::Merge) {
+                if (payload)
+                    pos->slot->payload = std::move(*payload);
+                return *pos;
+            }
+            // Replace the waiting task, keeping its payload slot for the new one
+            slot = pos->slot;
+            lane.erase(pos);
+            --m_queuedTaskCount;
+        }
+
+        auto taskId = m_nextTaskId++;
+        if (payload) {
+            if (slot) {
+                slot->payload = std::move(*payload);
+                slot->taskId = taskId;
+            }
+            else {
+                slot = m_payloadSlots.acquire(taskId, std::move(*payload));
+                // The new future adds its own reference
+                TaskQueuePayloadSlotPool::release(slot);
+            }
+        }
+        ++m_queuedTaskCount;
+        m_coalescedTasks[key] = { taskId, priority };
+        auto& lane = m_lanes[priority];
+        insertTask({ taskType, taskId, priority, slot });
+        return *findTasksFrom(lane, taskId);
+    }
+
+    // Note: m_mutex must be locked
+    void forgetCoalescedTask(const TaskQueueItem& task)
+    {
+        if (m_coalescedTasks.empty())
+            return;
+        auto it = m_coalescedTasks.find(std::make_pair(task.taskType, task.slot != nullptr));
+        if (it != m_coalescedTasks.end() && it->second.taskId == task.taskId)
+            m_coalescedTasks.erase(it);
+    }
+
+    // Note: m_mutex must be locked
+    std::size_t queuedTaskCountFrom(std::size_t taskId)
+    {
+        std::size_t result = 0;
+        for (auto& laneItem : m_lanes) {
+            auto& lane = laneItem.second;
+            result += static_cast<std::size_t>(lane.end() - findTasksFrom(lane, taskId));
+        }
+        return result;
+    }
+
+    // Note: m_mutex must be locked
+    std::size_t runningTaskCountFrom(std::size_t taskId) const
+    {
+        return static_cast<std::size_t>(
+                    std::distance(m_runningTaskIds.lower_bound(taskId), m_runningTaskIds.end()));
+    }
+
+    // Note: m_mutex must be locked
+    void insertTask(const TaskQueueItem& task)
+    {
+        auto& lane = m_lanes[task.priority];
+        // Concurrent posts can arrive slightly out of order
+        if (lane.empty() || lane.back().taskId < task.taskId)
+            lane.push_back(task);
+        else
+            lane.insert(findTasksFrom(lane, task.taskId), task);
+    }
+
+    // Returns the most urgent lane having tasks, or nullptr if there are no tasks.
+    // Note: m_mutex must be locked
+    TaskQueue *nextLane()
+    {
+        for (auto& laneItem : m_lanes)
+            if (!laneItem.second.empty())
+                return &laneItem.second;
+        return nullptr;
+    }
+
+    // Note: m_mutex must be locked
+    void dropTasks(TaskQueue& lane, TaskQueue::iterator begin, TaskQueue::iterator end)
+    {
+        for (auto it=begin; it!=end; ++it) {
+            forgetCoalescedTask(*it);
+            if (it->slot) {
+                it->slot->error = std::make_exception_ptr(
+                            std::runtime_error("TaskQueueExecutor: Task has been removed from the queue"));
+                m_payloadSlots.complete(it->slot);
+            }
+        }
+        m_queuedTaskCount -= static_cast<std::size_t>(end - begin);
+        lane.erase(begin, end);
+    }
+
+    // Note: m_mutex must be locked
+    void receiveIncomingTasks()
+    {
+        TaskQueueItem task;
+        while (m_incomingTasks.tryPop(task))
+            insertTask(task);
+    }
+
+    void runPayloadTask(const TaskQueueItem& task, boost::any& threadLocalData)
+    {
+        auto slot = task.slot;
+        try {
+            auto& taskFunc = m_payloadTaskFuncRegistry->at(task.taskType);
+            slot->result = taskFunc(threadLocalData, slot->payload, m_cancelParam);
+        }
+        catch(...) {
+            slot->error = std::current_exception();
+        }
+        m_payloadSlots.complete(slot);
+    }
+
+    void run(std::size_t workerIndex)
     {
         while (true) {
-            std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
+            m_incomingTaskEvent.wait([this] {
+                return (m_flags & ExitRequested) || m_queuedTaskCount > 0;
+            });
             if (m_flags & ExitRequested)
                 return;
-            else if (m_cancelParam) {
-                m_taskQueue.clear();
-                m_flags = TaskCompleted;
+            std::unique_lock<std::mutex> lk(m_mutex);
+            receiveIncomingTasks();
+            auto lane = nextLane();
+            if (m_cancelParam) {
+                for (auto& laneItem : m_lanes)
+                    dropTasks(laneItem.second, laneItem.second.begin(), laneItem.second.end());
                 lk.unlock();
                 m_taskCompletionNotifier.notify_all();
             }
-            else if (!m_taskQueue.empty()) {
-                auto task = m_taskQueue.front();
-                m_flags = TaskRunning;
-                m_taskQueue.pop_front();
+            else if (lane) {
+                auto task = lane->front();
+                lane->pop_front();
+                forgetCoalescedTask(task);
+                --m_queuedTaskCount;
+                m_runningTaskIds.insert(task.taskId);
                 lk.unlock();
-                auto& taskFunc = m_taskFuncRegistry->at(task.taskType);
-                taskFunc(m_threadLocalData, m_cancelParam);
+                if (task.slot)
+                    runPayloadTask(task, m_threadLocalData[workerIndex]);
+                else {
+                    auto& taskFunc = m_taskFuncRegistry->at(task.taskType);
+                    taskFunc(m_threadLocalData[workerIndex], m_cancelParam);
+                }
 
                 lk.lock();
-                m_flags = TaskCompleted;
+                m_runningTaskIds.erase(task.taskId);
                 lk.unlock();
                 m_taskCompletionNotifier.notify_all();
             }
-            else {
-                lk.unlock();
-                m_incomingTaskNotifier.wait();
-            }
         }
     }
 };
@@ -0,0 +1,177 @@
+#pragma once
+
+#include "silver_bullets/sync/EventCount.hpp"
+#include "silver_bullets/sync/MpmcRingBuffer.hpp"
+
+#include <boost/any.hpp>
+#include <boost/assert.hpp>
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace silver_bullets {
+namespace task_engine {
+
+class TaskQueuePayloadSlotPool;
+
+// Storage for the payload and the result of a task posted to TaskQueueExecutor
+struct TaskQueuePayloadSlot
+{
+    boost::any payload;
+    boost::any result;
+    std::exception_ptr error;
+    std::atomic<std::size_t> taskId = 0;  // Changes if the task is replaced by a coalesced one
+    std::atomic<bool> ready = false;
+    std::atomic<unsigned int> refCount = 0;  // The task and the futures referring to the slot
+    TaskQueuePayloadSlotPool *pool = nullptr;
+};
+
+// Preallocated payload slots, reused once the task and all its futures release them.
+// More slots are allocated when all preallocated ones are in use.
+class TaskQueuePayloadSlotPool
+{
+public:
+    TaskQueuePayloadSlotPool(std::size_t capacity, sync::WaitStrategy waitStrategy) :
+        m_freeSlots(capacity),
+        m_slots(new TaskQueuePayloadSlot[m_freeSlots.capacity()]),
+        m_completionEvent(waitStrategy)
+    {
+        for (std::size_t i=0, n=m_freeSlots.capacity(); i<n; ++i) {
+            m_slots[i].pool = this;
+            m_freeSlots.tryPush(m_slots.get() + i);
+        }
+    }
+
+    // Returns a slot referred to by the task and one future
+    TaskQueuePayloadSlot *acquire(std::size_t taskId, boost::any&& payload)
+    {
+        TaskQueuePayloadSlot *slot;
+        if (!m_freeSlots.tryPop(slot)) {
+            std::lock_guard<std::mutex> lk(m_extraSlotMutex);
+            m_extraSlots.emplace_back(std::make_unique<TaskQueuePayloadSlot>());
+            slot = m_extraSlots.back().get();
+            slot->pool = this;
+        }
+        slot->payload = std::move(payload);
+        slot->taskId = taskId;
+        slot->refCount.store(2, std::memory_order_relaxed);
+        return slot;
+    }
+
+    static void addRef(TaskQueuePayloadSlot *slot) {
+        slot->refCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void release(TaskQueuePayloadSlot *slot)
+    {
+        if (slot->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            slot->payload = boost::any();
+            slot->result = boost::any();
+            slot->error = std::exception_ptr();
+            slot->ready.store(false, std::memory_order_relaxed);
+            // Note: If the free list is full, the slot stays in m_extraSlots unused
+            slot->pool->m_freeSlots.tryPush(slot);
+        }
+    }
+
+    // Makes the result available to futures and releases the task's reference to the slot
+    void complete(TaskQueuePayloadSlot *slot)
+    {
+        slot->payload = boost::any();
+        slot->ready.store(true, std::memory_order_release);
+        m_completionEvent.notifyAll();
+        release(slot);
+    }
+
+    void waitFor(const TaskQueuePayloadSlot *slot)
+    {
+        m_completionEvent.wait([slot] {
+            return slot->ready.load(std::memory_order_acquire);
+        });
+    }
+
+private:
+    sync::MpmcRingBuffer<TaskQueuePayloadSlot*> m_freeSlots;
+    std::unique_ptr<TaskQueuePayloadSlot[]> m_slots;
+    std::mutex m_extraSlotMutex;
+    std::vector<std::unique_ptr<TaskQueuePayloadSlot>> m_extraSlots;
+    sync::EventCount m_completionEvent;
+};
+
+// Gives access to the result of a task posted to TaskQueueExecutor with a payload.
+// Note: Futures must not outlive the executor.
+class TaskQueueFuture
+{
+public:
+    TaskQueueFuture() = default;
+
+    explicit TaskQueueFuture(TaskQueuePayloadSlot *slot) : m_slot(slot)
+    {}
+
+    TaskQueueFuture(const TaskQueueFuture& that) : m_slot(that.m_slot)
+    {
+        if (m_slot)
+            TaskQueuePayloadSlotPool::addRef(m_slot);
+    }
+
+    TaskQueueFuture(TaskQueueFuture&& that) noexcept : m_slot(that.m_slot) {
+        that.m_slot = nullptr;
+    }
+
+    TaskQueueFuture& operator=(TaskQueueFuture that) noexcept
+    {
+        std::swap(m_slot, that.m_slot);
+        return *this;
+    }
+
+    ~TaskQueueFuture()
+    {
+        if (m_slot)
+            TaskQueuePayloadSlotPool::release(m_slot);
+    }
+
+    bool valid() const {
+        return m_slot != nullptr;
+    }
+
+    std::size_t taskId() const
+    {
+        BOOST_ASSERT(m_slot);
+        return m_slot->taskId;
+    }
+
+    bool isReady() const
+    {
+        BOOST_ASSERT(m_slot);
+        return m_slot->ready.load(std::memory_order_acquire);
+    }
+
+    void wait() const
+    {
+        BOOST_ASSERT(m_slot);
+        m_slot->pool->waitFor(m_slot);
+    }
+
+    // Waits for the task to complete; rethrows the exception thrown by the task, if any.
+    const boost::any& result() const
+    {
+        wait();
+        if (m_slot->error)
+            std::rethrow_exception(m_slot->error);
+        return m_slot->result;
+    }
+
+    template<class T>
+    T get() const {
+        return boost::any_cast<T>(result());
+    }
+
+private:
+    TaskQueuePayloadSlot *m_slot = nullptr;
+};
+
+} // namespace task_engine
+} // namespace silver_bullets
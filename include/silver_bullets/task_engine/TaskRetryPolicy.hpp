@@ -0,0 +1,28 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+
+namespace silver_bullets {
+namespace task_engine {
+
+// Determines how tasks are retried when their executors report failure
+// (see TaskExecutor::taskFailed())
+struct TaskRetryPolicy
+{
+    // Total number of attempts to run a task, including the first one
+    std::size_t maxAttempts = 3;
+
+    // Delay before the first retry; doubles with each subsequent retry
+    std::chrono::milliseconds initialBackoff = std::chrono::milliseconds(100);
+
+    std::chrono::milliseconds backoff(std::size_t failedAttempts) const
+    {
+        auto doublings = std::min<std::size_t>(failedAttempts, 17) - 1;
+        return initialBackoff * (1 << doublings);
+    }
+};
+
+} // namespace task_engine
+} // namespace silver_bullets
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+namespace silver_bullets {
+namespace task_engine {
+
+// Status of a task in the last computation of the graph (see TaskGraphExecutor::taskStatus())
+enum class TaskStatus : std::uint8_t
+{
+    Pending,    // The task has not been run yet
+    Cancelled,  // The task was running when the computation was cancelled; its outputs are discarded
+    Completed,
+    Skipped     // The task is on a dead branch (see TaskBranching)
+};
+
+} // namespace task_engine
+} // namespace silver_bullets
@@ -7,6 +7,7 @@
 
 #include <map>
 #include <functional>
+#include <vector>
 
 namespace silver_bullets {
 namespace task_engine {
@@ -14,6 +15,9 @@ namespace task_engine {
 using const_pany_range = boost::iterator_range<boost::any const* const*>;
 using pany_range = boost::iterator_range<boost::any* const*>;
 
+// Collection of values processed by a map task (see TaskKind::Map)
+using TaskCollection = std::vector<boost::any>;
+
 template<class TaskFunc> struct ThreadLocalData;
 template<class TaskFunc> using ThreadLocalData_t = typename ThreadLocalData<TaskFunc>::type;
 template<class TaskFunc> struct ReadOnlySharedData;
@@ -1,15 +1,24 @@
 #pragma once
 
+#include "silver_bullets/task_engine/TaskExecutorCancelParam.hpp"
 #include "silver_bullets/task_engine/TaskFuncRegistry.hpp"
 #include "silver_bullets/task_engine/types.hpp"
 
 #include "silver_bullets/sync/CancelController.hpp"
 
+#include "SharedMemoryArena.hpp"
+
 #include "proto/task.grpc.pb.h"
 #include "proto/task.pb.h"
 
 #include <grpc/grpc.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+
 namespace silver_bullets
 {
 namespace task_engine
@@ -33,6 +42,8 @@ pany_range prepareRange(
 
 } // namespace
 
+// Each Run request has its own cancel controller, cancelled by the Cancel rpc
+// with the request id; cancelling controller, if not null, cancels all running requests.
 template <class TaskFunc>
 class RemoteServiceImpl final : public Executor::Service
 {
@@ -49,6 +60,9 @@ public:
       m_controller(controller)
     {
         m_threadLocalData = m_initParam.initThreadLocalData();
+        if (m_controller)
+            m_controllerConnection =
+                m_controller->checker().onCanceled([this]() { cancelAllRequests(); });
     }
 
     grpc::Status Cancel(
@@ -56,11 +70,32 @@ public:
         const CancelParam* request,
         CancelReply* response)
     {
-        if (m_controller)
-        {
-            m_controller->cancel();
-        }
+        std::lock_guard<std::mutex> lk(m_requestMutex);
+        auto it = m_runningRequests.find(request->requestid());
+        if (it != m_runningRequests.end())
+            it->second.cancel();
+
+        return grpc::Status::OK;
+    }
+
+    grpc::Status Heartbeat(
+        grpc::ServerContext* context,
+        const HeartbeatParam* request,
+        WorkerStatus* response)
+    {
+        reportStatus(response);
+        return grpc::Status::OK;
+    }
 
+    grpc::Status ReleaseSharedMemory(
+        grpc::ServerContext* context,
+        const SharedMemoryParam* request,
+        SharedMemoryReply* response)
+    {
+        std::lock_guard<std::mutex> lk(m_sharedMemoryMutex);
+        auto it = m_sharedMemory.find(request->name());
+        if (it != m_sharedMemory.end() && it->second->id() == request->id())
+            m_sharedMemory.erase(it);
         return grpc::Status::OK;
     }
 
@@ -72,33 +107,72 @@ public:
         auto taskFuncId = request->task().taskfuncid();
         auto& f = m_initParam.taskFuncRegistry->at(taskFuncId);
 
+        // Registered before inputs are decoded, so that Cancel is not missed meanwhile
+        auto& requestController = startRequest(request->requestid());
+
+        std::shared_ptr<SharedMemoryArena> arena;
+        if (!request->sharedmemory().empty())
+        {
+            try
+            {
+                arena = sharedMemoryArena(
+                    request->sharedmemory(), request->sharedmemoryid());
+            }
+            catch (const std::exception& e)
+            {
+                finishRequest(request->requestid());
+                return grpc::Status(
+                    grpc::StatusCode::FAILED_PRECONDITION, e.what());
+            }
+        }
+        auto inputCount =
+            arena ? request->sharedinputs_size() : request->inputs_size();
+
         std::vector<boost::any> inputData;
         std::vector<boost::any*> inputDataPtr;
-        auto inputs =
-            prepareRange(inputData, inputDataPtr, request->inputs_size());
+        auto inputs = prepareRange(inputData, inputDataPtr, inputCount);
         std::vector<boost::any> outputData;
         std::vector<boost::any*> outputDataPtr;
         auto outputs = prepareRange(
             outputData, outputDataPtr, request->task().outputcount());
 
         auto& fromString = m_paramregistry.at(taskFuncId).second;
-        for (int i = 0; i < request->inputs_size(); i++)
+        std::size_t sharedInputEnd = 0;
+        for (int i = 0; i < inputCount; i++)
         {
-            *(inputs[i]) = fromString(request->inputs(i));
+            if (arena)
+            {
+                auto& buf = request->sharedinputs(i);
+                if (!arena->contains(buf.offset(), buf.size()))
+                {
+                    finishRequest(request->requestid());
+                    return grpc::Status(
+                        grpc::StatusCode::INVALID_ARGUMENT,
+                        "Input is out of shared memory bounds");
+                }
+                *(inputs[i]) = fromString(
+                    std::string(arena->data() + buf.offset(), buf.size()));
+                sharedInputEnd =
+                    std::max<std::size_t>(sharedInputEnd, buf.offset() + buf.size());
+            }
+            else
+                *(inputs[i]) = fromString(request->inputs(i));
         }
+        ++m_queueDepth;
+        auto startTime = std::chrono::steady_clock::now();
         callTaskFunc(
             f,
             outputs,
             inputs,
-            m_initParam.cancelParam,
+            cancelParam(requestController),
             &m_threadLocalData,
             nullptr);
+        updateStatus(std::chrono::steady_clock::now() - startTime);
+        reportStatus(response->mutable_workerstatus());
 
-        if (m_controller->isCancelled())
-        {
-            m_controller->resume();
-            return grpc::Status::OK;
-        }
+        if (finishRequest(request->requestid()))
+            return grpc::Status(
+                grpc::StatusCode::CANCELLED, "Task has been cancelled");
 
         auto& toString = m_paramregistry.at(taskFuncId).first;
         // convert outputs to response
@@ -106,6 +180,8 @@ public:
         {
             response->add_outputs(toString(*output));
         }
+        if (arena)
+            moveOutputsToSharedMemory(*arena, sharedInputEnd, response);
         return grpc::Status::OK;
     }
 
@@ -113,8 +189,110 @@ private:
     ThreadedTaskExecutorInit<TaskFunc> m_initParam;
     const ParametersRegistry m_paramregistry;
     sync::CancelController* m_controller;
+    boost::signals2::scoped_connection m_controllerConnection;
     using ThreadLocalData = ThreadLocalData_t<TaskFunc>;
     ThreadLocalData m_threadLocalData;
+
+    // Weight of the latest task duration in m_recentTaskLatency
+    static constexpr double LatencySmoothing = 0.2;
+
+    // Cancel controllers of running requests, key = request id
+    std::mutex m_requestMutex;
+    std::map<std::uint64_t, sync::CancelController> m_runningRequests;
+
+    std::atomic<int> m_queueDepth = 0;
+    std::mutex m_statusMutex;
+    double m_recentTaskLatency = 0;
+
+    // Arenas of clients, mapped until released with ReleaseSharedMemory
+    std::mutex m_sharedMemoryMutex;
+    std::map<std::string, std::shared_ptr<SharedMemoryArena>> m_sharedMemory;
+
+    // Returns the arena of a client; a cached arena with the same name,
+    // but a different id belongs to a destroyed segment and is replaced.
+    std::shared_ptr<SharedMemoryArena> sharedMemoryArena(
+        const std::string& name, std::uint64_t id)
+    {
+        std::lock_guard<std::mutex> lk(m_sharedMemoryMutex);
+        auto& result = m_sharedMemory[name];
+        if (!result || result->id() != id)
+            result = SharedMemoryArena::open(name, id);
+        return result;
+    }
+
+    // Returns the cancel controller of the request
+    sync::CancelController& startRequest(std::uint64_t requestId)
+    {
+        std::lock_guard<std::mutex> lk(m_requestMutex);
+        return m_runningRequests[requestId];
+    }
+
+    // Returns true if the request has been cancelled
+    bool finishRequest(std::uint64_t requestId)
+    {
+        std::lock_guard<std::mutex> lk(m_requestMutex);
+        auto it = m_runningRequests.find(requestId);
+        auto cancelled = it->second.isCancelled();
+        m_runningRequests.erase(it);
+        return cancelled;
+    }
+
+    void cancelAllRequests()
+    {
+        std::lock_guard<std::mutex> lk(m_requestMutex);
+        for (auto& request: m_runningRequests)
+            request.second.cancel();
+    }
+
+    TaskExecutorCancelParam_t<TaskFunc> cancelParam(
+        sync::CancelController& requestController)
+    {
+        if constexpr (IsCancellable_v<TaskFunc>)
+            return requestController.checker();
+        else
+            return m_initParam.cancelParam;
+    }
+
+    // Places outputs into the arena after the inputs, if there is enough room;
+    // otherwise, outputs are left in the response.
+    static void moveOutputsToSharedMemory(
+        SharedMemoryArena& arena, std::size_t offset, RunReply* response)
+    {
+        auto end = offset;
+        for (auto& output: response->outputs())
+            end = SharedMemoryArena::align(end) + output.size();
+        if (!arena.contains(0, end))
+            return;
+        for (auto& output: response->outputs())
+        {
+            offset = SharedMemoryArena::align(offset);
+            std::memcpy(arena.data() + offset, output.data(), output.size());
+            auto buf = response->add_sharedoutputs();
+            buf->set_offset(offset);
+            buf->set_size(output.size());
+            offset += output.size();
+        }
+        response->clear_outputs();
+    }
+
+    template <class Duration>
+    void updateStatus(const Duration& taskDuration)
+    {
+        auto latency = std::chrono::duration<double>(taskDuration).count();
+        std::lock_guard<std::mutex> lk(m_statusMutex);
+        if (m_recentTaskLatency == 0)
+            m_recentTaskLatency = latency;
+        else
+            m_recentTaskLatency += LatencySmoothing * (latency - m_recentTaskLatency);
+        --m_queueDepth;
+    }
+
+    void reportStatus(WorkerStatus* status)
+    {
+        std::lock_guard<std::mutex> lk(m_statusMutex);
+        status->set_queuedepth(m_queueDepth);
+        status->set_recenttasklatency(m_recentTaskLatency);
+    }
 };
 
 } // namespace task_engine
@@ -3,18 +3,17 @@
 #include "silver_bullets/sync/ThreadNotifier.hpp"
 #include "silver_bullets/task_engine/TaskExecutor.hpp"
 
-#include "proto/task.grpc.pb.h"
-#include "proto/task.pb.h"
+#include "RemoteTransport.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <memory>
 #include <mutex>
+#include <random>
 #include <thread>
 
-#include <grpc/grpc.h>
-#include <grpcpp/channel.h>
-#include <grpcpp/client_context.h>
-
 #include <boost/assert.hpp>
 
 namespace silver_bullets
@@ -34,24 +33,41 @@ public:
         const ParametersRegistry& paramregistry,
         int resourceType,
         const sync::CancelController::Checker* cancelParam) :
-      stub_(Executor::NewStub(channel)),
+      RemoteTaskExecutor(
+          std::make_shared<GrpcRemoteTransport>(channel),
+          paramregistry,
+          resourceType,
+          cancelParam)
+    {
+    }
+
+    explicit RemoteTaskExecutor(
+        std::shared_ptr<RemoteTransport> transport,
+        const ParametersRegistry& paramregistry,
+        int resourceType,
+        const sync::CancelController::Checker* cancelParam) :
+      m_transport(std::move(transport)),
       m_paramregistry(paramregistry),
       m_resourceType(resourceType),
+      m_nextRequestId(firstRequestId()),
       m_thread([this]() { run(); })
     {
         if (cancelParam)
         {
             cancelParam->onCanceled([this]() {
-                grpc::ClientContext context;
-                CancelParam param;
-                CancelReply reply;
-                stub_->Cancel(&context, param, &reply);
+                cancelTask();
             });
         }
     }
 
     ~RemoteTaskExecutor()
     {
+        if (m_heartbeatThread.joinable())
+        {
+            m_heartbeatExitRequested = true;
+            m_heartbeatNotifier.notify_one();
+            m_heartbeatThread.join();
+        }
         std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
         m_flags |= ExitRequested;
         lk.unlock();
@@ -101,8 +117,9 @@ public:
         std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
         if (m_flags & HasOutput)
         {
+            m_taskFailed = !!(m_flags & TaskFailed);
             m_flags = 0;
-            if (m_startParam.cb)
+            if (m_startParam.cb && !m_taskFailed)
                 m_startParam.cb();
             m_startParam = TaskExecutorStartParam();
             return true;
@@ -122,8 +139,61 @@ public:
         return m_taskCompletionNotifier;
     }
 
+    bool taskFailed() const override
+    {
+        return m_taskFailed;
+    }
+
+    // The executor is considered dead after a failed rpc; it is brought
+    // back alive by a successful Run or heartbeat, see startHeartbeat().
+    bool isAlive() const override
+    {
+        return m_alive;
+    }
+
+    TaskExecutorLoad load() const override
+    {
+        std::lock_guard<std::mutex> lk(m_loadMutex);
+        return m_load;
+    }
+
+    // Cancels the task on the worker through the Cancel rpc.
+    // The cancelled task is reported as failed; a task cancelled on the worker
+    // otherwise (see RemoteServiceImpl) is submitted again.
+    void cancelTask() override
+    {
+        auto requestId = m_runningRequestId.load();
+        if (requestId == 0)
+            return;
+        m_cancelledRequestId = requestId;
+        CancelParam param;
+        CancelReply reply;
+        param.set_requestid(requestId);
+        m_transport->cancel(param, &reply);
+    }
+
+    // Starts polling the worker status every interval, so that load()
+    // stays up to date while no task is being run by this executor.
+    // Without heartbeat, the status is only updated on task completion.
+    // The worker is considered dead if it does not reply within timeout.
+    void startHeartbeat(
+        std::chrono::milliseconds interval, std::chrono::milliseconds timeout)
+    {
+        BOOST_ASSERT(!m_heartbeatThread.joinable());
+        m_heartbeatThread = std::thread([this, interval, timeout]() {
+            runHeartbeat(interval, timeout);
+        });
+    }
+
+    void startHeartbeat(std::chrono::milliseconds interval)
+    {
+        startHeartbeat(interval, DefaultHeartbeatTimeoutFactor * interval);
+    }
+
 private:
-    std::unique_ptr<Executor::Stub> stub_;
+    static constexpr int DefaultHeartbeatTimeoutFactor = 3;
+
+    std::shared_ptr<RemoteTransport> m_transport;
     const ParametersRegistry m_paramregistry;
     int m_resourceType;
     TaskExecutorStartParam m_startParam;
@@ -133,13 +203,30 @@ private:
     {
         HasInput = 0x01,
         HasOutput = 0x2,
-        ExitRequested = 0x4
+        ExitRequested = 0x4,
+        TaskFailed = 0x8
     };
     unsigned int m_flags = 0; // A combination of elements of the above enum
     using ThreadLocalData = ThreadLocalData_t<TaskFunc>;
 
     ThreadLocalData m_threadLocalData;
 
+    bool m_taskFailed = false;
+    std::atomic<bool> m_alive = true;
+
+    // Identifiers of Run requests; random, so that requests of different
+    // clients of a worker are distinguished
+    std::uint64_t m_nextRequestId;
+    std::atomic<std::uint64_t> m_runningRequestId = 0; // 0 if there is no request
+    std::atomic<std::uint64_t> m_cancelledRequestId = 0; // Last request cancelled by cancelTask()
+
+    mutable std::mutex m_loadMutex;
+    TaskExecutorLoad m_load;
+
+    sync::ThreadNotifier m_heartbeatNotifier;
+    std::atomic<bool> m_heartbeatExitRequested = false;
+    std::thread m_heartbeatThread;
+
     // Note: Declare the thread last, such that all fields it can access
     // are initialized before the thread starts.
     std::thread m_thread;
@@ -153,7 +240,6 @@ private:
                 return;
             else if (m_flags & HasInput)
             {
-                grpc::ClientContext context;
                 RunParam param;
                 RunReply reply;
 
@@ -173,42 +259,90 @@ private:
                     m_startParam.task.outputCount);
                 param.mutable_task()->set_resourcetype(
                     m_startParam.task.resourceType);
+                grpc::Status status;
+                while (true)
+                {
+                    auto requestId = m_nextRequestId++;
+                    if (requestId == 0)
+                        requestId = m_nextRequestId++;
+                    param.set_requestid(requestId);
 
-                grpc::Status status = stub_->Run(&context, param, &reply);
+                    m_runningRequestId = requestId;
+                    status = m_transport->run(param, &reply);
+                    m_runningRequestId = 0;
+                    // Cancellation not requested by cancelTask() is not a task failure,
+                    // and does not count as a failed attempt
+                    if (status.error_code() != grpc::StatusCode::CANCELLED ||
+                        m_cancelledRequestId == requestId)
+                        break;
+                    reply.Clear();
+                }
                 if (!status.ok())
                 {
-                    // TODO
-                    std::cout << "Run rpc failed." << std::endl;
+                    // Report task failure; unless the task has been cancelled,
+                    // the worker is considered dead
+                    if (status.error_code() != grpc::StatusCode::CANCELLED)
+                        m_alive = false;
+                    reportCompletion(false);
+                    continue;
+                }
 
-                    std::unique_lock<std::mutex> lk(
-                        m_incomingTaskNotifier.mutex());
-                    m_flags |= ExitRequested;
-                    lk.unlock();
-                    m_incomingTaskNotifier.notify_one();
+                m_alive = true;
+                if (reply.has_workerstatus())
+                    updateLoad(reply.workerstatus());
 
-                    return;
+                // A reply without all outputs is reported as task failure
+                auto outputCount = m_startParam.task.outputCount;
+                if (static_cast<std::size_t>(reply.outputs_size()) != outputCount)
+                {
+                    reportCompletion(false);
+                    continue;
                 }
-
                 auto& fromString =
                     m_paramregistry.at(m_startParam.task.taskFuncId).second;
-                int index = 0;
-                if (reply.outputs_size() > 0)
-                {
-                    for (auto& output: m_startParam.outputs)
-                    {
-                        *output = fromString(reply.outputs(index));
-                        index++;
-                    }
-                }
-
-                std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
-                m_flags = HasOutput;
-                lk.unlock();
-                if (m_taskCompletionNotifier)
-                    m_taskCompletionNotifier->notify_all();
+                for (std::size_t index = 0; index < outputCount; ++index)
+                    *m_startParam.outputs[index] =
+                        fromString(reply.outputs(static_cast<int>(index)));
+                reportCompletion(true);
             }
         }
     }
+
+    void reportCompletion(bool succeeded)
+    {
+        std::unique_lock<std::mutex> lk(m_incomingTaskNotifier.mutex());
+        m_flags = succeeded ? HasOutput : HasOutput | TaskFailed;
+        lk.unlock();
+        if (m_taskCompletionNotifier)
+            m_taskCompletionNotifier->notify_all();
+    }
+
+    static std::uint64_t firstRequestId()
+    {
+        std::random_device rd;
+        return (static_cast<std::uint64_t>(rd()) << 32) | rd();
+    }
+
+    void updateLoad(const WorkerStatus& status)
+    {
+        std::lock_guard<std::mutex> lk(m_loadMutex);
+        m_load.queueDepth = static_cast<std::size_t>(status.queuedepth());
+        m_load.recentTaskLatency = status.recenttasklatency();
+    }
+
+    void runHeartbeat(
+        std::chrono::milliseconds interval, std::chrono::milliseconds timeout)
+    {
+        while (!m_heartbeatExitRequested)
+        {
+            HeartbeatParam param;
+            WorkerStatus status;
+            m_alive = m_transport->heartbeat(param, &status, timeout).ok();
+            if (m_alive)
+                updateLoad(status);
+            m_heartbeatNotifier.wait_for(interval);
+        }
+    }
 };
 
 } // namespace task_engine
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "proto/task.grpc.pb.h"
+#include "proto/task.pb.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <grpc/grpc.h>
+#include <grpcpp/channel.h>
+#include <grpcpp/client_context.h>
+#include <grpcpp/server_context.h>
+
+namespace silver_bullets
+{
+namespace task_engine
+{
+
+// Delivers requests of RemoteTaskExecutor to a worker
+class RemoteTransport
+{
+public:
+    virtual ~RemoteTransport() = default;
+
+    virtual grpc::Status run(const RunParam& param, RunReply* reply) = 0;
+
+    virtual grpc::Status cancel(const CancelParam& param, CancelReply* reply) = 0;
+
+    virtual grpc::Status heartbeat(
+        const HeartbeatParam& param,
+        WorkerStatus* status,
+        std::chrono::milliseconds timeout) = 0;
+
+    virtual grpc::Status releaseSharedMemory(
+        const SharedMemoryParam& param, SharedMemoryReply* reply) = 0;
+};
+
+// Sends requests through a gRPC channel. The channel is normally a TCP one,
+// but can also be obtained from grpc::Server::InProcessChannel().
+class GrpcRemoteTransport : public RemoteTransport
+{
+public:
+    explicit GrpcRemoteTransport(
+        const std::shared_ptr<grpc::ChannelInterface>& channel) :
+      m_stub(Executor::NewStub(channel))
+    {
+    }
+
+    grpc::Status run(const RunParam& param, RunReply* reply) override
+    {
+        grpc::ClientContext context;
+        return m_stub->Run(&context, param, reply);
+    }
+
+    grpc::Status cancel(const CancelParam& param, CancelReply* reply) override
+    {
+        grpc::ClientContext context;
+        return m_stub->Cancel(&context, param, reply);
+    }
+
+    grpc::Status heartbeat(
+        const HeartbeatParam& param,
+        WorkerStatus* status,
+        std::chrono::milliseconds timeout) override
+    {
+        grpc::ClientContext context;
+        context.set_deadline(std::chrono::system_clock::now() + timeout);
+        return m_stub->Heartbeat(&context, param, status);
+    }
+
+    grpc::Status releaseSharedMemory(
+        const SharedMemoryParam& param, SharedMemoryReply* reply) override
+    {
+        grpc::ClientContext context;
+        return m_stub->ReleaseSharedMemory(&context, param, reply);
+    }
+
+private:
+    std::unique_ptr<Executor::Stub> m_stub;
+};
+
+// Calls the worker service living in the same process directly, bypassing gRPC.
+// If serializeMessages is true, requests and replies are serialized
+// and parsed back, as they would be when sent over the network;
+// this allows to measure the cost of the remote pipeline without the network.
+class LoopbackRemoteTransport : public RemoteTransport
+{
+public:
+    explicit LoopbackRemoteTransport(
+        Executor::Service* service, bool serializeMessages = true) :
+      m_service(service),
+      m_serializeMessages(serializeMessages)
+    {
+    }
+
+    grpc::Status run(const RunParam& param, RunReply* reply) override
+    {
+        return call(&Executor::Service::Run, param, reply);
+    }
+
+    grpc::Status cancel(const CancelParam& param, CancelReply* reply) override
+    {
+        return call(&Executor::Service::Cancel, param, reply);
+    }
+
+    grpc::Status heartbeat(
+        const HeartbeatParam& param,
+        WorkerStatus* status,
+        std::chrono::milliseconds) override
+    {
+        return call(&Executor::Service::Heartbeat, param, status);
+    }
+
+    grpc::Status releaseSharedMemory(
+        const SharedMemoryParam& param, SharedMemoryReply* reply) override
+    {
+        return call(&Executor::Service::ReleaseSharedMemory, param, reply);
+    }
+
+private:
+    Executor::Service* m_service;
+    bool m_serializeMessages;
+
+    template <class Param, class Reply>
+    grpc::Status call(
+        grpc::Status (Executor::Service::*method)(
+            grpc::ServerContext*, const Param*, Reply*),
+        const Param& param,
+        Reply* reply)
+    {
+        grpc::ServerContext context;
+        if (!m_serializeMessages)
+            return (m_service->*method)(&context, &param, reply);
+
+        std::string buf;
+        Param serverParam;
+        if (!(param.SerializeToString(&buf) && serverParam.ParseFromString(buf)))
+            return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to pass request");
+        Reply serverReply;
+        auto status = (m_service->*method)(&context, &serverParam, &serverReply);
+        if (!(serverReply.SerializeToString(&buf) && reply->ParseFromString(buf)))
+            return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to pass reply");
+        return status;
+    }
+};
+
+} // namespace task_engine
+} // namespace silver_bullets
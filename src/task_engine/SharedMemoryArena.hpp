@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace silver_bullets
+{
+namespace task_engine
+{
+
+// POSIX shared memory segment mapped into the address space of the process.
+// The segment is removed from the system when the arena that created it
+// is destroyed; processes that have it opened keep their mapping valid.
+// Since names can be reused, e.g. by a process with the same pid, a segment
+// is identified by its name along with a random id chosen on creation.
+class SharedMemoryArena
+{
+public:
+    // Alignment of buffers placed into the arena
+    static constexpr std::size_t Alignment = 64;
+
+    SharedMemoryArena(const SharedMemoryArena&) = delete;
+    SharedMemoryArena& operator=(const SharedMemoryArena&) = delete;
+
+    ~SharedMemoryArena()
+    {
+        munmap(m_data, m_size);
+        if (m_owner)
+            shm_unlink(m_name.c_str());
+    }
+
+    static std::shared_ptr<SharedMemoryArena> create(
+        const std::string& name, std::size_t size)
+    {
+        auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1)
+            throwError("Failed to create", name);
+        if (ftruncate(fd, static_cast<off_t>(size)) == -1)
+        {
+            auto error = errno;
+            close(fd);
+            shm_unlink(name.c_str());
+            errno = error;
+            throwError("Failed to resize", name);
+        }
+        return std::shared_ptr<SharedMemoryArena>(
+            new SharedMemoryArena(name, randomId(), fd, size, true));
+    }
+
+    // Opens the segment created by another process; id is the value
+    // of id() in that process.
+    static std::shared_ptr<SharedMemoryArena> open(
+        const std::string& name, std::uint64_t id)
+    {
+        auto fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd == -1)
+            throwError("Failed to open", name);
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+        {
+            close(fd);
+            throwError("Failed to query size of", name);
+        }
+        return std::shared_ptr<SharedMemoryArena>(new SharedMemoryArena(
+            name, id, fd, static_cast<std::size_t>(st.st_size), false));
+    }
+
+    // Returns a name that is unique across processes of the host
+    static std::string uniqueName()
+    {
+        static std::atomic<unsigned int> counter = 0;
+        return "/silver_bullets." + std::to_string(getpid()) + "."
+               + std::to_string(counter++);
+    }
+
+    static std::size_t align(std::size_t offset)
+    {
+        return (offset + Alignment - 1) & ~(Alignment - 1);
+    }
+
+    const std::string& name() const
+    {
+        return m_name;
+    }
+
+    std::uint64_t id() const
+    {
+        return m_id;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    char* data() const
+    {
+        return m_data;
+    }
+
+    // Returns true if size bytes starting at offset are within the arena
+    bool contains(std::size_t offset, std::size_t size) const
+    {
+        return offset <= m_size && size <= m_size - offset;
+    }
+
+private:
+    std::string m_name;
+    std::uint64_t m_id;
+    std::size_t m_size;
+    char* m_data;
+    bool m_owner;
+
+    SharedMemoryArena(
+        const std::string& name,
+        std::uint64_t id,
+        int fd,
+        std::size_t size,
+        bool owner) :
+      m_name(name),
+      m_id(id),
+      m_size(size),
+      m_owner(owner)
+    {
+        auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            if (owner)
+                shm_unlink(name.c_str());
+            throwError("Failed to map", name);
+        }
+        m_data = static_cast<char*>(data);
+    }
+
+    static std::uint64_t randomId()
+    {
+        std::random_device rd;
+        return (static_cast<std::uint64_t>(rd()) << 32) | rd();
+    }
+
+    [[noreturn]] static void throwError(
+        const std::string& what, const std::string& name)
+    {
+        throw std::runtime_error(
+            "SharedMemoryArena: " + what + " shared memory segment '" + name
+            + "': " + std::strerror(errno));
+    }
+};
+
+} // namespace task_engine
+} // namespace silver_bullets
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "RemoteTransport.hpp"
+#include "SharedMemoryArena.hpp"
+
+#include <cstring>
+#include <mutex>
+
+namespace silver_bullets
+{
+namespace task_engine
+{
+
+// Transport for workers running on the same host as the caller.
+// Task inputs and outputs are passed through a POSIX shared memory arena,
+// and only their locations are sent over the control transport.
+// Payloads that do not fit into the arena are sent over the control
+// transport as usual.
+// Since the arena holds data of one request at a time, use a separate
+// transport for each executor.
+// When the transport is destroyed, the worker is told to unmap the arena.
+class SharedMemoryRemoteTransport : public RemoteTransport
+{
+public:
+    SharedMemoryRemoteTransport(
+        std::shared_ptr<RemoteTransport> control,
+        std::size_t arenaSize,
+        const std::string& arenaName = SharedMemoryArena::uniqueName()) :
+      m_control(std::move(control)),
+      m_arena(SharedMemoryArena::create(arenaName, arenaSize))
+    {
+    }
+
+    ~SharedMemoryRemoteTransport()
+    {
+        SharedMemoryParam param;
+        SharedMemoryReply reply;
+        param.set_name(m_arena->name());
+        param.set_id(m_arena->id());
+        m_control->releaseSharedMemory(param, &reply);
+    }
+
+    grpc::Status run(const RunParam& param, RunReply* reply) override
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+
+        std::size_t end = 0;
+        for (auto& input: param.inputs())
+            end = SharedMemoryArena::align(end) + input.size();
+        if (!m_arena->contains(0, end))
+            return m_control->run(param, reply);
+
+        RunParam sharedParam;
+        *sharedParam.mutable_task() = param.task();
+        sharedParam.set_sharedmemory(m_arena->name());
+        sharedParam.set_sharedmemoryid(m_arena->id());
+        std::size_t offset = 0;
+        for (auto& input: param.inputs())
+        {
+            offset = SharedMemoryArena::align(offset);
+            std::memcpy(m_arena->data() + offset, input.data(), input.size());
+            auto buf = sharedParam.add_sharedinputs();
+            buf->set_offset(offset);
+            buf->set_size(input.size());
+            offset += input.size();
+        }
+
+        auto status = m_control->run(sharedParam, reply);
+        if (!status.ok() || reply->sharedoutputs_size() == 0)
+            return status;
+
+        reply->clear_outputs();
+        for (auto& buf: reply->sharedoutputs())
+        {
+            if (!m_arena->contains(buf.offset(), buf.size()))
+                return grpc::Status(
+                    grpc::StatusCode::INTERNAL,
+                    "Output is out of shared memory bounds");
+            reply->add_outputs(m_arena->data() + buf.offset(), buf.size());
+        }
+        reply->clear_sharedoutputs();
+        return status;
+    }
+
+    grpc::Status cancel(const CancelParam& param, CancelReply* reply) override
+    {
+        return m_control->cancel(param, reply);
+    }
+
+    grpc::Status heartbeat(
+        const HeartbeatParam& param,
+        WorkerStatus* status,
+        std::chrono::milliseconds timeout) override
+    {
+        return m_control->heartbeat(param, status, timeout);
+    }
+
+    grpc::Status releaseSharedMemory(
+        const SharedMemoryParam& param, SharedMemoryReply* reply) override
+    {
+        return m_control->releaseSharedMemory(param, reply);
+    }
+
+    const SharedMemoryArena& arena() const
+    {
+        return *m_arena;
+    }
+
+private:
+    std::shared_ptr<RemoteTransport> m_control;
+    std::shared_ptr<SharedMemoryArena> m_arena;
+    std::mutex m_mutex;
+};
+
+} // namespace task_engine
+} // namespace silver_bullets